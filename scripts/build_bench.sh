@@ -0,0 +1,17 @@
+#! /bin/bash
+
+# Builds an optimized copy of the game next to the benchmark, so the
+# numbers do not depend on how the live library was last built, and runs
+# it. Arguments are passed to build/bench/bench, see --help.
+
+mkdir -p build/bench
+
+scripts/reflect_struct.sh GameState src/game.c > build/bench/game_state_fields.h || exit 1
+
+gcc -O2 -g -c -Wall -Werror -Wuninitialized -fpic -Ibuild/bench src/game.c -o build/bench/game.o || exit 1
+
+gcc -shared -o build/bench/libgame.so build/bench/game.o -lm || exit 1
+
+gcc src/bench.c -O2 -g -Wall -Werror -Wuninitialized -ldl -lm -o build/bench/bench || exit 1
+
+build/bench/bench "$@"
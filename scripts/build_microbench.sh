@@ -0,0 +1,23 @@
+#! /bin/bash
+
+# Builds and runs the microbenchmarks for the game's primitives and the
+# platform's event dispatch. Arguments are passed to both, so
+#
+#   scripts/build_microbench.sh --save build/bench/microbench.baseline
+#   (change something)
+#   scripts/build_microbench.sh --baseline build/bench/microbench.baseline
+#
+# shows what the change did, and fails if anything got slower.
+
+mkdir -p build/bench
+
+scripts/reflect_struct.sh GameState src/game.c > build/bench/game_state_fields.h || exit 1
+
+gcc src/microbench.c -O2 -g -Wall -Werror -Wuninitialized -Ibuild/bench -lm -o build/bench/microbench || exit 1
+
+gcc src/platform_microbench.c -O2 -g -Wall -Werror -Wuninitialized -ldl -lSDL2 -lSDL2main -lSDL2_image -lSDL2_mixer -lSDL2_net -o build/bench/platform_microbench || exit 1
+
+build/bench/microbench "$@"
+status=$?
+build/bench/platform_microbench "$@" || exit 1
+exit $status
@@ -0,0 +1,11 @@
+#! /bin/bash
+
+# Builds the asset packer and packs assets/ into build/assets.pack, or the
+# file given, for the platform's --pack. Images are decoded and audio
+# converted to the mixer's format here instead of at every startup.
+
+mkdir -p build
+
+gcc src/pack.c -O2 -g -Wall -Werror -Wuninitialized -lSDL2 -lSDL2_image -o build/pack || exit 1
+
+build/pack "$@"
@@ -5,7 +5,12 @@ then
     mkdir build
 fi
 
-gcc -g -c -Wall -Werror -Wuninitialized -pg -fpic src/game.c -o build/game.o 
+scripts/reflect_struct.sh GameState src/game.c > build/game_state_fields.h || exit 1
 
-gcc -g -shared -o build/libgame.so build/game.o
+gcc -g -DDEBUG -DPROFILE -c -Wall -Werror -Wuninitialized -pg -fpic -Ibuild src/game.c -o build/game.o || exit 1
+
+gcc -g -shared -o build/libgame.so.tmp build/game.o -lm || exit 1
+
+# Renamed into place so a running platform never sees half a library
+mv build/libgame.so.tmp build/libgame.so
 
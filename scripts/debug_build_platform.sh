@@ -2,4 +2,4 @@
 
 scripts/debug_build_game.sh
 
-gcc src/platform.c -g -Wuninitialized -Wall -Werror -pg -ldl -lSDL2 -lSDL2main -lSDL2_image -lSDL2_mixer -lSDL2_net -Lbuild/game -o build/platform
+gcc src/platform.c -g -DDEBUG -DPROFILE -Wuninitialized -Wall -Werror -pg -ldl -lSDL2 -lSDL2main -lSDL2_image -lSDL2_mixer -lSDL2_net -Lbuild/game -o build/platform
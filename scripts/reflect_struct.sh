@@ -0,0 +1,111 @@
+#! /bin/bash
+
+# Prints a GameFieldInfo table for one typedef'd struct so the platform can
+# tell which fields survived a change to its layout. Structs it holds by
+# value that are typedef'd in the same file get tables of their own, which
+# its fields point at; those that cannot be reflected are left opaque.
+#
+#   scripts/reflect_struct.sh GameState src/game.c > build/game_state_fields.h
+
+if [ $# -ne 2 ]
+then
+    echo "usage: $0 STRUCT FILE" >&2
+    exit 1
+fi
+
+awk -v name="$1" -v file="$2" '
+# Splits a struct body into field_name/field_type/field_array, returns 0 and
+# the offending line in bad_line if some line is not one plain field
+function parse(s, body,    count, lines, i, line, n, array) {
+    n = 0
+    count = split(body, lines, "\n")
+    for (i = 1; i <= count; i++) {
+        line = lines[i]
+        sub(/\/\/.*/, "", line)
+        gsub(/^[ \t]+|[ \t]+$/, "", line)
+        if (line == "" || line == "{") {
+            continue
+        }
+        if (line !~ /;$/ || line ~ /[,(]/) {
+            bad_line = lines[i]
+            return 0
+        }
+        sub(/[ \t]*;$/, "", line)
+        array = ""
+        if (match(line, /(\[[^]]*\])+$/)) {
+            array = substr(line, RSTART)
+            line = substr(line, 1, RSTART - 1)
+        }
+        match(line, /[A-Za-z_][A-Za-z0-9_]*$/)
+        n++
+        field_name[s, n] = substr(line, RSTART)
+        field_type[s, n] = substr(line, 1, RSTART - 1)
+        gsub(/[ \t]+$/, "", field_type[s, n])
+        field_array[s, n] = array
+    }
+    field_count[s] = n
+    return 1
+}
+
+function reflectable(type) {
+    return type != name && (type in bodies) && !(type in opaque)
+}
+
+# Nested tables are printed before the tables that point at them
+function emit(s,    i, type, array, macro, nested) {
+    if (s in emitted) {
+        return
+    }
+    emitted[s] = 1
+    for (i = 1; i <= field_count[s]; i++) {
+        if (reflectable(field_type[s, i])) {
+            emit(field_type[s, i])
+        }
+    }
+    printf("static const GameFieldInfo %sFields[] = {\n", s)
+    for (i = 1; i <= field_count[s]; i++) {
+        type = field_type[s, i]
+        array = field_array[s, i]
+        nested = reflectable(type) ? ", " type "Fields" : ""
+        if (nested) {
+            macro = array ? "REFLECT_STRUCT_ARRAY" : "REFLECT_STRUCT"
+        } else {
+            macro = array ? "REFLECT_ARRAY" : "REFLECT_FIELD"
+        }
+        printf("  %s(%s, %s, \"%s%s\"%s),\n", macro, s, field_name[s, i], type, array, nested)
+    }
+    printf("};\n")
+}
+
+/^typedef struct/ { body = ""; inside = 1; next }
+inside && /^}[ \t]*[A-Za-z_][A-Za-z0-9_]*[ \t]*;/ {
+    struct_name = $0
+    sub(/^}[ \t]*/, "", struct_name)
+    sub(/[ \t]*;.*$/, "", struct_name)
+    bodies[struct_name] = body
+    inside = 0
+    if (struct_name == name) {
+        found = 1
+        exit
+    }
+    next
+}
+inside { body = body $0 "\n" }
+END {
+    if (!found) {
+        printf("%s: no typedef struct %s\n", file, name) > "/dev/stderr"
+        exit 1
+    }
+    if (!parse(name, bodies[name])) {
+        printf("%s: cannot reflect \"%s\" in %s, declare one field per line\n",
+               file, bad_line, name) > "/dev/stderr"
+        exit 1
+    }
+    for (s in bodies) {
+        if (s != name && !parse(s, bodies[s])) {
+            opaque[s] = 1
+        }
+    }
+    printf("// Generated by scripts/reflect_struct.sh from %s, do not edit\n", file)
+    emit(name)
+}' "$2"
@@ -0,0 +1,339 @@
+// Headless throughput benchmark for the game library. Loads libgame.so
+// the way the platform does, hands it a PlatformAPI that draws nowhere,
+// and times GameUpdate and GameRender separately over a sweep of box
+// counts. Built and run by scripts/build_bench.sh.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include "shared.h"
+
+#define DEFAULT_BENCH_LIB "build/bench/libgame.so"
+#define DEFAULT_FRAMES 200
+#define DEFAULT_WARMUP_FRAMES 20
+#define DEFAULT_SEED 37
+#define BENCH_MEMORY_SIZE (2048ULL * 1024 * 1024)
+#define BENCH_MAX_RUNS 16
+#define BENCH_SCREEN_WIDTH 800
+#define BENCH_SCREEN_HEIGHT 600
+#define BENCH_DT (1.0f / 60.0f)
+
+static const uint32_t DEFAULT_BOX_COUNTS[] = {1000, 10000, 100000, 1000000};
+
+typedef struct
+{
+  const char *lib;
+  const char *json_file;
+  uint32_t frames;
+  uint32_t warmup;
+  uint32_t seed;
+  uint32_t box_counts[BENCH_MAX_RUNS];
+  uint32_t run_count;
+} BenchConfig;
+
+typedef struct
+{
+  uint32_t boxes;
+  double *update_ns_per_box;
+  double *render_ns_per_box;
+  double *frame_ms;
+  uint64_t draws;   // per frame, to check the game drew what it was asked to
+} BenchRun;
+
+static struct
+{
+  BenchConfig config;
+  GameMemory memory;
+  const GameAPI *api;
+  BenchRun runs[BENCH_MAX_RUNS];
+  // Everything the offscreen renderer was handed, so none of it is dead
+  uint64_t draws;
+  double checksum;
+} bench;
+
+uint64_t GetNanoseconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Offscreen platform. Draw calls are folded into a checksum instead of
+// reaching a renderer, so the numbers are the game's own cost.
+
+PLATFORM_DRAW_BOX(BenchDrawBox)
+{
+  bench.draws++;
+  bench.checksum += rect->x + rect->y + rect->w + rect->h + r + g + b + a + fill;
+}
+
+PLATFORM_DRAW_BOXES(BenchDrawBoxes)
+{
+  for (unsigned int i = 0; i < count; i++) {
+    BenchDrawBox(&rects[i], r, g, b, a, fill);
+  }
+}
+
+PLATFORM_DRAW_TEXTURE(BenchDrawTexture)
+{
+  bench.draws++;
+  bench.checksum += texture_index + x + y + width + height + sprite_x + sprite_y +
+    sprite_w + sprite_h;
+}
+
+PLATFORM_ENSURE_IMAGE(BenchEnsureImage) {}
+PLATFORM_ENSURE_AUDIO(BenchEnsureAudio) {}
+PLATFORM_PLAY_AUDIO(BenchPlayAudio) {}
+PLATFORM_STOP_AUDIO(BenchStopAudio) {}
+PLATFORM_ENSURE_MUSIC(BenchEnsureMusic) {}
+PLATFORM_PLAY_MUSIC(BenchPlayMusic) {}
+PLATFORM_PAUSE_MUSIC(BenchPauseMusic) {}
+PLATFORM_STOP_MUSIC(BenchStopMusic) {}
+PLATFORM_SAVE_STATE(BenchSaveState) {}
+PLATFORM_LOAD_STATE(BenchLoadState) {}
+
+PLATFORM_GET_MEMORY_STATS(BenchGetMemoryStats)
+{
+  *stats = bench.memory.stats;
+  *used = bench.memory.cursor - bench.memory.ptr;
+  *committed = bench.memory.committed - bench.memory.ptr;
+  *reserved = bench.memory.size;
+}
+
+PlatformAPI GetBenchPlatformAPI()
+{
+  PlatformAPI api = {};
+  // Draw
+  api.PlatformDrawBox = BenchDrawBox;
+  api.PlatformDrawBoxes = BenchDrawBoxes;
+  api.PlatformDrawTexture = BenchDrawTexture;
+  api.PlatformEnsureImage = BenchEnsureImage;
+  // Audio
+  api.PlatformEnsureAudio = BenchEnsureAudio;
+  api.PlatformPlayAudio = BenchPlayAudio;
+  api.PlatformStopAudio = BenchStopAudio;
+  // Music
+  api.PlatformEnsureMusic = BenchEnsureMusic;
+  api.PlatformPlayMusic = BenchPlayMusic;
+  api.PlatformPauseMusic = BenchPauseMusic;
+  api.PlatformStopMusic = BenchStopMusic;
+  // State
+  api.PlatformSaveState = BenchSaveState;
+  api.PlatformLoadState = BenchLoadState;
+  api.PlatformGetMemoryStats = BenchGetMemoryStats;
+  return api;
+}
+
+const GameAPI *LoadBenchGame(const char *path)
+{
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    fprintf(stderr, "%s\n", dlerror());
+    return NULL;
+  }
+  GameGetAPIFn *game_get_api = (GameGetAPIFn *)dlsym(handle, "GameGetAPI");
+  const GameAPI *api = game_get_api ? game_get_api() : NULL;
+  if (!api) {
+    fprintf(stderr, "%s does not export GameGetAPI\n", path);
+  } else if (api->version != GAME_API_VERSION || api->size != sizeof(GameAPI) ||
+             api->platform_hash != GamePlatformLayoutHash()) {
+    fprintf(stderr, "%s was built against a different shared.h\n", path);
+  } else if (!api->game_init || !api->game_update || !api->game_render ||
+             !api->game_bench_setup) {
+    fprintf(stderr, "%s is missing GameInit, GameUpdate, GameRender or GameBenchSetup\n", path);
+  } else {
+    return api;
+  }
+  dlclose(handle);
+  return NULL;
+}
+
+// Committed as the game allocates, like the platform's game memory
+GameMemory ReserveBenchMemory(size_t size)
+{
+  GameMemory result = {};
+  result.ptr = mmap(NULL, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (result.ptr == MAP_FAILED) {
+    fprintf(stderr, "failed to reserve %zu bytes: %s\n", size, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  result.cursor = result.ptr;
+  result.committed = result.ptr;
+  result.size = size;
+  return result;
+}
+
+void RunBench(BenchRun *run)
+{
+  uint32_t frames = bench.config.frames;
+  run->update_ns_per_box = calloc(frames, sizeof(double));
+  run->render_ns_per_box = calloc(frames, sizeof(double));
+  run->frame_ms = calloc(frames, sizeof(double));
+  if (!run->update_ns_per_box || !run->render_ns_per_box || !run->frame_ms) {
+    fprintf(stderr, "out of memory for %u frames\n", frames);
+    exit(EXIT_FAILURE);
+  }
+
+  // No input, the boxes run on their own
+  GameInput input = {};
+  bench.api->game_bench_setup(run->boxes, bench.config.seed);
+  for (uint32_t f = 0; f < bench.config.warmup; f++) {
+    bench.api->game_update(BENCH_DT, &input);
+    bench.api->game_render();
+  }
+  uint64_t draws = bench.draws;
+  for (uint32_t f = 0; f < frames; f++) {
+    uint64_t start = GetNanoseconds();
+    bench.api->game_update(BENCH_DT, &input);
+    uint64_t updated = GetNanoseconds();
+    bench.api->game_render();
+    uint64_t rendered = GetNanoseconds();
+    run->update_ns_per_box[f] = (double)(updated - start) / run->boxes;
+    run->render_ns_per_box[f] = (double)(rendered - updated) / run->boxes;
+    run->frame_ms[f] = (rendered - start) / 1e6;
+  }
+  run->draws = frames ? (bench.draws - draws) / frames : 0;
+}
+
+int CompareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void PrintBenchSeries(FILE *out, const char *name, double *values, uint32_t count, bool last)
+{
+  double total = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    total += values[i];
+  }
+  qsort(values, count, sizeof(double), CompareDoubles);
+  if (count) {
+    fprintf(out, "\"%s\":{\"count\":%u,\"min\":%.4f,\"mean\":%.4f,\"p50\":%.4f,"
+            "\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f}%s", name, count, values[0],
+            total / count, values[count / 2], values[(count * 90) / 100],
+            values[(count * 99) / 100], values[count - 1], last ? "" : ",");
+  } else {
+    fprintf(out, "\"%s\":{\"count\":0}%s", name, last ? "" : ",");
+  }
+}
+
+// One JSON line, so runs can be compared by a script. Sorts the series.
+void ReportBench(FILE *out)
+{
+  fprintf(out, "{\"game_bench\":{\"lib\":\"%s\",\"seed\":%u,\"frames\":%u,"
+          "\"warmup\":%u,\"runs\":[", bench.config.lib, bench.config.seed,
+          bench.config.frames, bench.config.warmup);
+  for (uint32_t r = 0; r < bench.config.run_count; r++) {
+    BenchRun *run = &bench.runs[r];
+    fprintf(out, "%s{\"boxes\":%u,\"draws\":%" PRIu64 ",", r ? "," : "",
+            run->boxes, run->draws);
+    PrintBenchSeries(out, "update_ns_per_box", run->update_ns_per_box, bench.config.frames, false);
+    PrintBenchSeries(out, "render_ns_per_box", run->render_ns_per_box, bench.config.frames, false);
+    PrintBenchSeries(out, "frame_ms", run->frame_ms, bench.config.frames, true);
+    fprintf(out, "}");
+  }
+  fprintf(out, "],\"checksum\":%.0f}}\n", bench.checksum);
+}
+
+void Usage(const char *name)
+{
+  printf("usage: %s [options]\n"
+         "  --lib PATH              game library to load (default " DEFAULT_BENCH_LIB ")\n"
+         "  --boxes N               box count to run, repeatable (default 1000 10000 100000 1000000)\n"
+         "  --frames N              measured frames per box count (default %d)\n"
+         "  --warmup N              unmeasured frames before those (default %d)\n"
+         "  --seed N                seed for laying out the boxes (default %d)\n"
+         "  --json FILE             also write the JSON report to FILE\n",
+         name, DEFAULT_FRAMES, DEFAULT_WARMUP_FRAMES, DEFAULT_SEED);
+  exit(EXIT_FAILURE);
+}
+
+void ParseArgs(BenchConfig *config, int argc, char *argv[])
+{
+  config->lib = DEFAULT_BENCH_LIB;
+  config->frames = DEFAULT_FRAMES;
+  config->warmup = DEFAULT_WARMUP_FRAMES;
+  config->seed = DEFAULT_SEED;
+
+  for (int c = 1; c < argc; c++) {
+    const char *arg = argv[c];
+    const char *value = c + 1 < argc ? argv[c + 1] : NULL;
+    if (!strcmp(arg, "--lib") && value) {
+      config->lib = value;
+      c++;
+    } else if (!strcmp(arg, "--boxes") && value && config->run_count < BENCH_MAX_RUNS) {
+      config->box_counts[config->run_count++] = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--frames") && value) {
+      config->frames = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--warmup") && value) {
+      config->warmup = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--seed") && value) {
+      config->seed = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--json") && value) {
+      config->json_file = value;
+      c++;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (!config->run_count) {
+    memcpy(config->box_counts, DEFAULT_BOX_COUNTS, sizeof(DEFAULT_BOX_COUNTS));
+    config->run_count = sizeof(DEFAULT_BOX_COUNTS) / sizeof(DEFAULT_BOX_COUNTS[0]);
+  }
+  if (config->frames == 0) {
+    Usage(argv[0]);
+  }
+  for (uint32_t r = 0; r < config->run_count; r++) {
+    if (config->box_counts[r] == 0) {
+      Usage(argv[0]);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  ParseArgs(&bench.config, argc, argv);
+  bench.api = LoadBenchGame(bench.config.lib);
+  if (!bench.api) {
+    return EXIT_FAILURE;
+  }
+  bench.memory = ReserveBenchMemory(BENCH_MEMORY_SIZE);
+  bench.api->game_init(&bench.memory, GetBenchPlatformAPI(),
+                       BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT);
+
+  for (uint32_t r = 0; r < bench.config.run_count; r++) {
+    BenchRun *run = &bench.runs[r];
+    run->boxes = bench.config.box_counts[r];
+    RunBench(run);
+    // Frame order is not reported, so sort in place for the medians
+    uint32_t p50 = bench.config.frames / 2;
+    qsort(run->update_ns_per_box, bench.config.frames, sizeof(double), CompareDoubles);
+    qsort(run->render_ns_per_box, bench.config.frames, sizeof(double), CompareDoubles);
+    qsort(run->frame_ms, bench.config.frames, sizeof(double), CompareDoubles);
+    printf("%8u boxes: update %7.2f ns/box, render %7.2f ns/box, frame %8.3f ms (p50)\n",
+           run->boxes, run->update_ns_per_box[p50], run->render_ns_per_box[p50],
+           run->frame_ms[p50]);
+    fflush(stdout);
+  }
+
+  if (bench.config.json_file) {
+    FILE *out = fopen(bench.config.json_file, "w");
+    if (!out) {
+      fprintf(stderr, "failed to write %s: %s\n", bench.config.json_file, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    ReportBench(out);
+    fclose(out);
+  }
+  ReportBench(stdout);
+  return EXIT_SUCCESS;
+}
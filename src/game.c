@@ -30,7 +30,6 @@ typedef struct
 
 #define COLLISION_DEMO_ENABLED true
 #define COLLISION_SPLATTER false
-#define COLLISION_DEMO_MAX_BOXES 10000
 #define COLLISION_DEMO_INITIAL_BOX_COUNT 10000
 
 bool checkCollision(Rect *a, Rect *b){
@@ -177,33 +176,227 @@ enum {
   CONTROLLER_SIZE,
 };
 
-const unsigned int button_map[CONTROLLER_SIZE] = {
-  K_w,
-  K_s,
-  K_a,
-  K_d,
-  K_SPACE,
-  K_ESCAPE,
-  K_p,
-  K_q,
-  K_e,
-  K_UNKNOWN,
+const char *action_names[CONTROLLER_SIZE] = {
+  "up", "down", "left", "right", "jump", "fire", "menu", "pause", "trigger_l", "trigger_r",
 };
 
+#define ACTION_BIT(action) (1u << (action))
+_Static_assert(CONTROLLER_SIZE <= 32, "actions no longer fit a uint32_t mask");
+
+// Devices that can be bound to actions. Codes are scancodes for the
+// keyboard, BUTTON_* for the mouse and CONTROLLER_BUTTON_* for gamepads.
+enum {
+  BIND_KEY = 0,
+  BIND_MOUSE,
+  BIND_PAD,
+  BIND_DEVICE_COUNT,
+};
+
+const char *bind_device_names[BIND_DEVICE_COUNT] = {"key", "mouse", "pad"};
+
+#define MAX_BINDINGS 64
+#define BINDING_NONE 0xff
+#define BINDINGS_FILE "input.bindings"
+#define ACTION_QUEUE_SIZE 64    // power of two
+#define ACTION_QUEUE_MASK (ACTION_QUEUE_SIZE - 1)
+
 typedef struct
 {
+  uint16_t code;
+  uint8_t device;
+  uint8_t action;
+  uint32_t held;    // bit per device instance holding it down
+} ActionBinding;
 
-  unsigned int state[CONTROLLER_SIZE];
-  unsigned int previous[CONTROLLER_SIZE];
-
-  float pointer_x, pointer_y;
+typedef struct
+{
+  uint64_t time_ns;
+  uint8_t action;
+  uint8_t state;    // BUTTON_PRESSED or BUTTON_RELEASED
+  uint16_t device;
+} ActionEvent;
 
-  float action_queue_timer;
-  int action_queue[10];
+typedef struct
+{
+  // Any number of codes on any device can drive the same action; the
+  // lookup table is rebuilt from the bindings whenever they change
+  ActionBinding bindings[MAX_BINDINGS];
+  uint32_t binding_count;
+  uint8_t binding_map[BIND_DEVICE_COUNT][NUM_SCANCODES];
+
+  // ACTION_BIT() masks. pressed and released are kept for one update, so
+  // a tap shorter than a frame still shows up in both.
+  uint32_t held;
+  uint32_t pressed;
+  uint32_t released;
+  uint8_t held_count[CONTROLLER_SIZE];
+
+  float pointer_x;
+  float pointer_y;
+  // Last reading of any gamepad, sticks and triggers from -1 to 1
+  float axes[CONTROLLER_AXIS_COUNT];
+  float accel[3];
+  float gyro[3];
+
+  // Every press and release in order, the oldest overwritten
+  ActionEvent actions[ACTION_QUEUE_SIZE];
+  uint32_t action_head;
 } Controller;
 
 #define AUDIO_DEMO_ENABLED false
 
+// Rebuilds the lookup table. Held state is dropped, as the binding that
+// held an action may be gone.
+void rebuildActionMap(Controller *c)
+{
+  memset(c->binding_map, BINDING_NONE, sizeof(c->binding_map));
+  for (uint32_t i = 0; i < c->binding_count; i++) {
+    c->bindings[i].held = 0;
+    c->binding_map[c->bindings[i].device][c->bindings[i].code] = i;
+  }
+  c->held = 0;
+  memset(c->held_count, 0, sizeof(c->held_count));
+}
+
+// Binds a code to an action, replacing what it was bound to before
+bool bindAction(Controller *c, uint8_t device, uint16_t code, uint8_t action)
+{
+  if (device >= BIND_DEVICE_COUNT || code >= NUM_SCANCODES || action >= CONTROLLER_SIZE) {
+    return false;
+  }
+  uint8_t index = c->binding_map[device][code];
+  if (index == BINDING_NONE) {
+    if (c->binding_count == MAX_BINDINGS) {
+      return false;
+    }
+    index = c->binding_count++;
+  }
+  c->bindings[index] = (ActionBinding){code, device, action, 0};
+  rebuildActionMap(c);
+  return true;
+}
+
+void unbindAction(Controller *c, uint8_t device, uint16_t code)
+{
+  if (device >= BIND_DEVICE_COUNT || code >= NUM_SCANCODES ||
+      c->binding_map[device][code] == BINDING_NONE) {
+    return;
+  }
+  c->bindings[c->binding_map[device][code]] = c->bindings[--c->binding_count];
+  rebuildActionMap(c);
+}
+
+void defaultBindings(Controller *c)
+{
+  static const ActionBinding defaults[] = {
+    {SCANCODE_W, BIND_KEY, CONTROLLER_UP},
+    {SCANCODE_S, BIND_KEY, CONTROLLER_DOWN},
+    {SCANCODE_A, BIND_KEY, CONTROLLER_LEFT},
+    {SCANCODE_D, BIND_KEY, CONTROLLER_RIGHT},
+    {SCANCODE_SPACE, BIND_KEY, CONTROLLER_JUMP},
+    {SCANCODE_ESCAPE, BIND_KEY, CONTROLLER_FIRE},
+    {SCANCODE_P, BIND_KEY, CONTROLLER_MENU},
+    {SCANCODE_Q, BIND_KEY, CONTROLLER_PAUSE},
+    {SCANCODE_E, BIND_KEY, CONTROLLER_TRIGGER_L},
+    {BUTTON_LEFT, BIND_MOUSE, CONTROLLER_FIRE},
+    {CONTROLLER_BUTTON_DPAD_UP, BIND_PAD, CONTROLLER_UP},
+    {CONTROLLER_BUTTON_DPAD_DOWN, BIND_PAD, CONTROLLER_DOWN},
+    {CONTROLLER_BUTTON_DPAD_LEFT, BIND_PAD, CONTROLLER_LEFT},
+    {CONTROLLER_BUTTON_DPAD_RIGHT, BIND_PAD, CONTROLLER_RIGHT},
+    {CONTROLLER_BUTTON_A, BIND_PAD, CONTROLLER_JUMP},
+    {CONTROLLER_BUTTON_X, BIND_PAD, CONTROLLER_FIRE},
+    {CONTROLLER_BUTTON_BACK, BIND_PAD, CONTROLLER_MENU},
+    {CONTROLLER_BUTTON_START, BIND_PAD, CONTROLLER_PAUSE},
+    {CONTROLLER_BUTTON_LEFTSHOULDER, BIND_PAD, CONTROLLER_TRIGGER_L},
+    {CONTROLLER_BUTTON_RIGHTSHOULDER, BIND_PAD, CONTROLLER_TRIGGER_R},
+  };
+  c->binding_count = sizeof(defaults) / sizeof(defaults[0]);
+  memcpy(c->bindings, defaults, sizeof(defaults));
+  rebuildActionMap(c);
+}
+
+int findName(const char **names, int count, const char *name)
+{
+  for (int i = 0; i < count; i++) {
+    if (!strcmp(names[i], name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Replaces the bindings with the lines of a file, "key 26 up" binding
+// scancode 26 (W) to the up action. Lines that do not parse are skipped;
+// a missing file leaves the bindings alone.
+bool loadBindings(Controller *c, const char *file)
+{
+  FILE *in = fopen(file, "r");
+  if (!in) {
+    return false;
+  }
+  c->binding_count = 0;
+  rebuildActionMap(c);
+  char line[128], device[16], action[16];
+  unsigned int code;
+  while (fgets(line, sizeof(line), in)) {
+    if (line[0] == '#' || sscanf(line, "%15s %u %15s", device, &code, action) != 3) {
+      continue;
+    }
+    if (!bindAction(c, findName(bind_device_names, BIND_DEVICE_COUNT, device), code,
+                    findName(action_names, CONTROLLER_SIZE, action))) {
+      printf("game: %s: ignored %s", file, line);
+    }
+  }
+  fclose(in);
+  printf("game: %u bindings from %s\n", c->binding_count, file);
+  return true;
+}
+
+// Turns a press or release of a bound code into action state. Repeats and
+// releases of codes that were never seen going down are ignored, and an
+// action held through several bindings or devices is only released once
+// the last of them lets go.
+void controllerInput(Controller *c, uint8_t device, uint32_t instance, uint16_t code,
+                     uint8_t key_state, uint64_t time_ns)
+{
+  if (code >= NUM_SCANCODES || c->binding_map[device][code] == BINDING_NONE) {
+    return;
+  }
+  ActionBinding *binding = &c->bindings[c->binding_map[device][code]];
+  uint32_t bit = 1u << (instance & 31);
+  bool pressed = key_state == BUTTON_PRESSED;
+  if (pressed == !!(binding->held & bit)) {
+    return;
+  }
+  binding->held ^= bit;
+  uint8_t action = binding->action;
+  if (pressed ? c->held_count[action]++ : --c->held_count[action]) {
+    return;
+  }
+  if (pressed) {
+    c->held |= ACTION_BIT(action);
+    c->pressed |= ACTION_BIT(action);
+  } else {
+    c->held &= ~ACTION_BIT(action);
+    c->released |= ACTION_BIT(action);
+  }
+  c->actions[c->action_head++ & ACTION_QUEUE_MASK] =
+    (ActionEvent){time_ns, action, key_state, device};
+}
+
+// Presses of the action queued since the head was at first, as far back
+// as the queue goes, so two taps inside one update count twice
+uint32_t actionPressesSince(Controller *c, uint8_t action, uint32_t first)
+{
+  uint32_t count = MIN(c->action_head - first, ACTION_QUEUE_SIZE);
+  uint32_t presses = 0;
+  for (uint32_t i = 1; i <= count; i++) {
+    ActionEvent *event = &c->actions[(c->action_head - i) & ACTION_QUEUE_MASK];
+    presses += event->action == action && event->state == BUTTON_PRESSED;
+  }
+  return presses;
+}
+
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 600
 
@@ -218,7 +411,7 @@ typedef struct
 
 typedef struct
 {
-  GameMemory memory;
+  GameMemory *memory;
   PlatformAPI api;
 
   // Window meta
@@ -228,8 +421,9 @@ typedef struct
   
   // Collision Demo
   bool collisionDemoInitialized;
-  Rect boxRects[COLLISION_DEMO_MAX_BOXES];
-  BoxMeta boxes[COLLISION_DEMO_MAX_BOXES];
+  Rect *boxRects;         // boxCapacity of each, in GameMemory
+  BoxMeta *boxes;
+  unsigned int boxCapacity;
   BoxMeta wall;
   Rect wall_rect;
   BoxMeta ground;
@@ -248,10 +442,14 @@ typedef struct
 
   bool showMenu;
   bool paused;
+  bool showMemory;
 } GameState;
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+// Field table for GameState, generated by the build scripts
+#include "game_state_fields.h"
+
+_Static_assert(sizeof(GameState) <= GAME_STATE_RESERVE,
+               "GameState has outgrown GAME_STATE_RESERVE");
 
 static GameState *state;
 
@@ -313,6 +511,24 @@ void newBB(BoxMeta *bb, Rect *r, float x, float y, float w, float h, unsigned in
   bb->a = 0.5f;
 }
 
+// Lays out count boxes, growing the arrays if they are too small. The old
+// arrays are left behind on the memory stack, so grow rarely.
+void newDemoBoxes(unsigned int count)
+{
+  if (count > state->boxCapacity) {
+    state->boxRects = GameAllocateMemory(state->memory, count * sizeof(Rect),
+                                         MEMORY_TAG_ENTITIES);
+    state->boxes = GameAllocateMemory(state->memory, count * sizeof(BoxMeta),
+                                      MEMORY_TAG_ENTITIES);
+    state->boxCapacity = count;
+  }
+  for (unsigned int c=0; c < count; c++) {
+    memset(&state->boxes[c], 0, sizeof(BoxMeta));
+    newBB(&state->boxes[c], &state->boxRects[c], -1, -1, 5.0, 5.0, c);
+  }
+  state->boxCount = count;
+}
+
 func(GAME_WINDOW_RESIZED, GameWindowResized)
 {
   printf("window(%d) resized", window);
@@ -330,17 +546,26 @@ extern GAME_QUIT(GameQuit)
 
 extern GAME_INIT(GameInit)
 { 
-  state = GameAllocateStruct(&memory, GameState);
-  state->api = api;
-  if(state->memory.ptr == 0) {
-    state->memory = memory;
+  // GameState is always the first allocation, so it is found at the
+  // start of the block again after a reload or a restored snapshot. It
+  // gets GAME_STATE_RESERVE bytes so a reload can migrate it in place.
+  if (memory->cursor == memory->ptr) {
+    GameAllocateMemory(memory, GAME_STATE_RESERVE, MEMORY_TAG_STATE);
   }
+  state = (GameState *)memory->ptr;
+  state->api = api;
+  PROFILER_ATTACH(api.profiler);
+  state->memory = memory;
 
   if(!state->onlyOnceInit) {
     state->onlyOnceInit = true;
-    memset(&state->controller, 0, sizeof(Controller));
     state->paused = false;
   }
+  // Also after a reload that changed the Controller, which resets it
+  if (!state->controller.binding_count) {
+    defaultBindings(&state->controller);
+    loadBindings(&state->controller, BINDINGS_FILE);
+  }
   
   state->window.w = screen_w;
   state->window.h = screen_h;
@@ -352,16 +577,13 @@ extern GAME_INIT(GameInit)
     state->api.PlatformEnsureAudio("bird_caw1.wav", 1);
   }
   
-  if (COLLISION_DEMO_ENABLED && !state->collisionDemoInitialized) {
+  // No boxes when migrated from a layout that kept them inline
+  if (COLLISION_DEMO_ENABLED && (!state->collisionDemoInitialized || !state->boxes)) {
     //srand(37);
     state->collisionDemoInitialized = true;
     newBB(&state->wall, &state->wall_rect, 300.0f, 100.0f, 50.0f, 200.0f, 0);
     newBB(&state->ground, &state->ground_rect, 0.0f, 0.0f, 1.0f*state->window.w, 30.0f, 0);
-    for (unsigned int c=0; c < COLLISION_DEMO_INITIAL_BOX_COUNT; c++) {
-      memset(&state->boxes[c], 0, sizeof(BoxMeta));
-      newBB(&state->boxes[c], &state->boxRects[c], -1, -1, 5.0, 5.0, c);
-    }
-    state->boxCount = COLLISION_DEMO_INITIAL_BOX_COUNT;
+    newDemoBoxes(COLLISION_DEMO_INITIAL_BOX_COUNT);
   }
   
   if (CHARACTER_DEMO_ENABLED && !state->characterDemoInitialized) {
@@ -382,6 +604,15 @@ extern GAME_INIT(GameInit)
   }
 }
 
+extern GAME_BENCH_SETUP(GameBenchSetup)
+{
+  srand(seed);
+  state->paused = false;
+  newBB(&state->wall, &state->wall_rect, 300.0f, 100.0f, 50.0f, 200.0f, 0);
+  newBB(&state->ground, &state->ground_rect, 0.0f, 0.0f, 1.0f*state->window.w, 30.0f, 0);
+  newDemoBoxes(box_count);
+}
+
 float speed(float accel, float dt, float velocity)
 {
   return accel * (dt * velocity);
@@ -394,11 +625,21 @@ void shiftColor(float* c, float* accel, float dt)
     *accel *= -1.0f;
 }
 
+void handleInputEvent(const GameInputEvent *event);
+
 extern GAME_UPDATE(GameUpdate)
 {
+  TIMED_FUNCTION();
+
+  state->controller.pressed = 0;
+  state->controller.released = 0;
+  uint32_t first_action = state->controller.action_head;
+  for (uint32_t i = 0; i < input->count; i++) {
+    handleInputEvent(&input->events[i]);
+  }
 
-  if (state->controller.state[CONTROLLER_PAUSE] &&
-      state->controller.state[CONTROLLER_PAUSE] != state->controller.previous[CONTROLLER_PAUSE]) {
+  // Every press toggles, two inside one frame leave it as it was
+  if (actionPressesSince(&state->controller, CONTROLLER_PAUSE, first_action) & 1) {
     state->paused = !state->paused;
   }
 
@@ -415,6 +656,7 @@ extern GAME_UPDATE(GameUpdate)
   }
 
   if (COLLISION_DEMO_ENABLED && !state->paused) {
+    TIMED_BLOCK("collision demo");
     for (unsigned int c=0; c < state->boxCount; c++){
       // Determine the next x and y bounding boxes
       Rect bb_next_x = {
@@ -522,12 +764,36 @@ extern GAME_UPDATE(GameUpdate)
       state->character.current_frame = 0;
     }
   }
-  memcpy(&state->controller.previous, &state->controller.state, sizeof(state->controller.state));
-  memset(&state->controller.state, 0, sizeof(state->controller.state));
+}
+
+#define MEMORY_OVERLAY_WIDTH 300.0f
+
+// Bar of committed game memory, filled with the live bytes of each tag
+void renderMemoryOverlay()
+{
+  GameMemoryStats stats;
+  size_t used, committed, reserved;
+  state->api.PlatformGetMemoryStats(&stats, &used, &committed, &reserved);
+
+  Rect bar = {10.0f, 10.0f, MEMORY_OVERLAY_WIDTH, 12.0f};
+  state->api.PlatformDrawBox(&bar, 255, 255, 255, 255, false);
+  for (int t = 0; t < MEMORY_TAG_COUNT; t++) {
+    if (!stats.live[t]) {
+      continue;
+    }
+    bar.w = MAX(1.0f, MEMORY_OVERLAY_WIDTH * stats.live[t] / committed);
+    state->api.PlatformDrawBox(&bar, 60 + 25 * t, 200 - 20 * t, 40 * t, 255, true);
+    bar.x += bar.w;
+  }
+  // The peak marker shows how close the game came to the committed end
+  Rect peak = {10.0f + MEMORY_OVERLAY_WIDTH * stats.peak_used / committed,
+               6.0f, 2.0f, 20.0f};
+  state->api.PlatformDrawBox(&peak, 255, 0, 0, 255, true);
 }
 
 extern GAME_RENDER(GameRender)
 {
+  TIMED_FUNCTION();
   state->api.PlatformDrawBox(&state->wall_rect,
 			     //x, state->wall.y, state->wall.width, state->wall.height,
 			     state->wall.r, state->wall.g, state->wall.b, state->wall.a, true);
@@ -553,15 +819,58 @@ extern GAME_RENDER(GameRender)
 				   state->character.rect.h,
 				   sf->x, sf->y, sf->width, sf->height);
   }
+  if (state->showMemory) {
+    renderMemoryOverlay();
+  }
 }
 
-extern GAME_KEYBOARD_INPUT(GameKeyboardInput)
+#define QUICKSAVE_FILE "quicksave.state"
+
+void handleInputEvent(const GameInputEvent *event)
 {
-  for (unsigned int i=0; i < CONTROLLER_SIZE; i++) {
-    if (SCANCODE_TO_KEYCODE(symbol) == button_map[i]){
-      state->controller.state[i] = key_state;
-      break;
+  Controller *c = &state->controller;
+  switch (event->type) {
+  case INPUT_KEY:
+    if (event->state == BUTTON_PRESSED && !event->values[0]) {
+      switch (event->code) {
+      case SCANCODE_F5:
+        state->api.PlatformSaveState(QUICKSAVE_FILE);
+        return;
+      case SCANCODE_F9:
+        state->api.PlatformLoadState(QUICKSAVE_FILE);
+        return;
+      case SCANCODE_F3:
+        state->showMemory = !state->showMemory;
+        return;
+      case SCANCODE_F6:
+        loadBindings(c, BINDINGS_FILE);
+        return;
+      }
+    }
+    controllerInput(c, BIND_KEY, 0, event->code, event->state, event->time_ns);
+    break;
+  case INPUT_MOUSE_BUTTON:
+    controllerInput(c, BIND_MOUSE, event->device, event->code, event->state, event->time_ns);
+    break;
+  case INPUT_MOUSE_MOTION:
+    c->pointer_x = event->values[0];
+    c->pointer_y = event->values[1];
+    break;
+  case INPUT_CONTROLLER_BUTTON:
+    controllerInput(c, BIND_PAD, event->device, event->code, event->state, event->time_ns);
+    break;
+  case INPUT_CONTROLLER_AXIS:
+    if (event->code < CONTROLLER_AXIS_COUNT) {
+      c->axes[event->code] = event->values[0];
     }
+    break;
+  case INPUT_SENSOR:
+    if (event->code == SENSOR_ACCEL) {
+      memcpy(c->accel, event->values, sizeof(c->accel));
+    } else if (event->code == SENSOR_GYRO) {
+      memcpy(c->gyro, event->values, sizeof(c->gyro));
+    }
+    break;
   }
 }
 
@@ -571,3 +880,29 @@ extern GAME_CHANNEL_HALTED(GameAudioChannelHalted)
 }
 
 
+
+extern GAME_GET_API(GameGetAPI)
+{
+  static GameAPI api;
+  if (!api.version) {
+    api.size = sizeof(GameAPI);
+    api.platform_hash = GamePlatformLayoutHash();
+    api.state_fields = GameStateFields;
+    api.state_field_count = sizeof(GameStateFields) / sizeof(GameStateFields[0]);
+    api.state_size = sizeof(GameState);
+    api.state_hash = GameHashFields(api.state_fields, api.state_field_count,
+                                    api.state_size);
+    api.input_mask = INPUT_MASK(INPUT_KEY) | INPUT_MASK(INPUT_MOUSE_MOTION) |
+                     INPUT_MASK(INPUT_MOUSE_BUTTON) | INPUT_MASK(INPUT_CONTROLLER_BUTTON) |
+                     INPUT_MASK(INPUT_CONTROLLER_AXIS) | INPUT_MASK(INPUT_SENSOR);
+    api.game_init = GameInit;
+    api.game_update = GameUpdate;
+    api.game_render = GameRender;
+    api.game_quit = GameQuit;
+    api.game_bench_setup = GameBenchSetup;
+    api.game_window_resized = GameWindowResized;
+    api.game_channel_halted = GameAudioChannelHalted;
+    api.version = GAME_API_VERSION;
+  }
+  return &api;
+}
@@ -0,0 +1,168 @@
+// Microbenchmarks for the game's primitives. game.c is compiled into this
+// file rather than loaded, so its functions inline here the way they do
+// in GameUpdate. Built and run by scripts/build_microbench.sh.
+
+#include <errno.h>
+#include <inttypes.h>
+
+#include "game.c"
+#include "microbench.h"
+
+// Inputs are cycled through with a mask so the loop does not add a
+// branch of its own
+#define SAMPLE_COUNT 1024
+#define SAMPLE_MASK (SAMPLE_COUNT - 1)
+#define ALLOCATION_SIZE 64
+#define ALLOCATIONS_PER_RESET 4096
+#define BENCH_MEMORY_SIZE (ALLOCATION_SIZE * ALLOCATIONS_PER_RESET * 2)
+
+typedef struct
+{
+  Rect a[SAMPLE_COUNT];
+  Rect b[SAMPLE_COUNT];
+  float accel[SAMPLE_COUNT];
+  float velocity[SAMPLE_COUNT];
+  BoxMeta boxes[SAMPLE_COUNT];
+  GameInputEvent keys[SAMPLE_COUNT];
+  GameMemory memory;
+} MicroBenchInputs;
+
+static MicroBenchInputs inputs;
+
+float RandomFloat(float low, float high)
+{
+  return low + (high - low) * (rand() / (float)RAND_MAX);
+}
+
+// Laid out like the demo: small boxes around the wall, about a third of
+// the pairs overlap
+void SetupInputs()
+{
+  srand(37);
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    inputs.a[i] = (Rect){RandomFloat(250, 400), RandomFloat(50, 350), 5, 5};
+    inputs.b[i] = (Rect){300, 100, 50, 200};
+    inputs.accel[i] = rand() % 2 ? 1.0f : -1.0f;
+    inputs.velocity[i] = RandomFloat(0, 1200);
+    newDemoBB(&inputs.boxes[i], i);
+  }
+  // Bound and unbound keys going up and down, with the odd repeat
+  unsigned int keys[] = {SCANCODE_W, SCANCODE_A, SCANCODE_S, SCANCODE_D,
+                         SCANCODE_SPACE, SCANCODE_E, SCANCODE_Z, SCANCODE_X};
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    GameInputEvent *key = &inputs.keys[i];
+    key->type = INPUT_KEY;
+    key->code = keys[rand() % (sizeof(keys) / sizeof(keys[0]))];
+    key->state = rand() % 2 ? BUTTON_PRESSED : BUTTON_RELEASED;
+    key->values[0] = rand() % 8 == 0;
+    key->time_ns = i;
+  }
+
+  uint8_t *block = mmap(NULL, BENCH_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED) {
+    fprintf(stderr, "failed to map %d bytes: %s\n", BENCH_MEMORY_SIZE, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  inputs.memory.ptr = inputs.memory.cursor = block;
+  inputs.memory.size = BENCH_MEMORY_SIZE;
+
+  // Input goes to the game's state
+  static GameState game_state;
+  state = &game_state;
+  defaultBindings(&state->controller);
+}
+
+uint64_t BenchEmpty(void *data, uint64_t iterations)
+{
+  uint64_t result = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    __asm__ volatile("" : "+r"(result));
+  }
+  return result;
+}
+
+uint64_t BenchCheckCollision(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  uint64_t hits = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    hits += checkCollision(&in->a[i & SAMPLE_MASK], &in->b[i & SAMPLE_MASK]);
+  }
+  return hits;
+}
+
+uint64_t BenchSpeed(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  float total = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    total += speed(in->accel[i & SAMPLE_MASK], 1.0f / 60.0f, in->velocity[i & SAMPLE_MASK]);
+  }
+  return (uint64_t)total;
+}
+
+uint64_t BenchShiftColor(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  for (uint64_t i = 0; i < iterations; i++) {
+    BoxMeta *box = &in->boxes[i & SAMPLE_MASK];
+    shiftColor(&box->r, &box->accel_r, 1.0f / 60.0f);
+  }
+  return (uint64_t)in->boxes[0].r;
+}
+
+uint64_t BenchAllocateMemory(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&in->memory);
+  uintptr_t total = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    if (i % ALLOCATIONS_PER_RESET == 0) {
+      GameEndTemporaryMemory(temp);
+    }
+    total += (uintptr_t)GameAllocateMemory(&in->memory, ALLOCATION_SIZE, MEMORY_TAG_ENTITIES);
+  }
+  GameEndTemporaryMemory(temp);
+  return total;
+}
+
+uint64_t BenchHandleInputEvent(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  for (uint64_t i = 0; i < iterations; i++) {
+    handleInputEvent(&in->keys[i & SAMPLE_MASK]);
+  }
+  return state->controller.held | state->controller.action_head;
+}
+
+// Counts the presses of one action over the last 16 queued actions, the
+// way GameUpdate counts those of a frame
+uint64_t BenchActionPresses(void *data, uint64_t iterations)
+{
+  MicroBenchInputs *in = data;
+  Controller *c = &state->controller;
+  for (int i = 0; i < SAMPLE_COUNT && c->action_head < ACTION_QUEUE_SIZE; i++) {
+    handleInputEvent(&in->keys[i]);
+  }
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    total += actionPressesSince(c, i % CONTROLLER_SIZE, c->action_head - 16);
+  }
+  return total;
+}
+
+int main(int argc, char *argv[])
+{
+  MicroBenchSuite suite;
+  MicroBenchInit(&suite, argc, argv);
+  SetupInputs();
+  MicroBenchRun(&suite, "empty", BenchEmpty, &inputs);
+  MicroBenchRun(&suite, "game/checkCollision", BenchCheckCollision, &inputs);
+  MicroBenchRun(&suite, "game/speed", BenchSpeed, &inputs);
+  MicroBenchRun(&suite, "game/shiftColor", BenchShiftColor, &inputs);
+  MicroBenchRun(&suite, "game/GameAllocateMemory", BenchAllocateMemory, &inputs);
+  MicroBenchRun(&suite, "game/handleInputEvent", BenchHandleInputEvent, &inputs);
+  MicroBenchRun(&suite, "game/actionPressesSince", BenchActionPresses, &inputs);
+  return MicroBenchFinish(&suite);
+}
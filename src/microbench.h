@@ -0,0 +1,224 @@
+// Microbenchmarks
+//
+// Include after shared.h, which this uses for ProfileTicks(). A benchmark
+// is a function that runs its operation `iterations` times and returns
+// something derived from the results, which is folded into a sink so the
+// compiler cannot drop the work:
+//
+//   uint64_t BenchSpeed(void *data, uint64_t iterations) { ... }
+//   MicroBenchRun(&suite, "game/speed", BenchSpeed, &inputs);
+//
+// Each benchmark is warmed up, calibrated to an iteration count that
+// takes MICROBENCH_SAMPLE_NS, then sampled MICROBENCH_SAMPLES times. The
+// median per call is reported in nanoseconds and in TSC cycles, and can
+// be compared against a baseline file saved by an earlier run.
+
+#define MICROBENCH_MAX_RESULTS 64
+#define MICROBENCH_NAME_SIZE 48
+#define MICROBENCH_SAMPLES 21
+#define MICROBENCH_SAMPLE_NS 2000000ULL    // 2 ms per sample
+#define MICROBENCH_WARMUP_NS 50000000ULL   // 50 ms before calibrating
+#define MICROBENCH_NOISE_PERCENT 5.0       // changes below this are noise
+
+typedef uint64_t MicroBenchFn(void *data, uint64_t iterations);
+
+typedef struct
+{
+  char name[MICROBENCH_NAME_SIZE];
+  double ns;          // median per call
+  double min_ns;      // fastest sample per call
+  double cycles;      // median per call, at the TSC rate
+  uint64_t iterations; // per sample
+} MicroBenchResult;
+
+typedef struct
+{
+  const char *filter;        // only names containing this
+  const char *baseline_file; // compare against
+  const char *save_file;     // write results to, keeping other entries
+  MicroBenchResult results[MICROBENCH_MAX_RESULTS];
+  uint32_t result_count;
+  volatile uint64_t sink;
+} MicroBenchSuite;
+
+uint64_t MicroBenchNanoseconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int MicroBenchCompare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void MicroBenchUsage(const char *name)
+{
+  printf("usage: %s [options]\n"
+         "  --filter TEXT           only run benchmarks whose name contains TEXT\n"
+         "  --baseline FILE         compare against results saved in FILE\n"
+         "  --save FILE             save results to FILE, keeping entries for other benchmarks\n",
+         name);
+  exit(EXIT_FAILURE);
+}
+
+void MicroBenchInit(MicroBenchSuite *suite, int argc, char *argv[])
+{
+  memset(suite, 0, sizeof(*suite));
+  for (int c = 1; c < argc; c++) {
+    const char *arg = argv[c];
+    const char *value = c + 1 < argc ? argv[c + 1] : NULL;
+    if (!strcmp(arg, "--filter") && value) {
+      suite->filter = value;
+      c++;
+    } else if (!strcmp(arg, "--baseline") && value) {
+      suite->baseline_file = value;
+      c++;
+    } else if (!strcmp(arg, "--save") && value) {
+      suite->save_file = value;
+      c++;
+    } else {
+      MicroBenchUsage(argv[0]);
+    }
+  }
+
+  printf("%-32s %10s %10s %10s %12s\n", "benchmark", "ns/call", "min ns",
+         "cycles", "iterations");
+}
+
+void MicroBenchRun(MicroBenchSuite *suite, const char *name, MicroBenchFn *fn, void *data)
+{
+  if (suite->filter && !strstr(name, suite->filter)) {
+    return;
+  }
+  if (suite->result_count == MICROBENCH_MAX_RESULTS) {
+    fprintf(stderr, "more than %d microbenchmarks, %s skipped\n",
+            MICROBENCH_MAX_RESULTS, name);
+    return;
+  }
+
+  // Warm caches, branch predictors and the clock speed, doubling the
+  // iteration count as we go; what it ends on is the calibration
+  uint64_t iterations = 1;
+  uint64_t warmup_start = MicroBenchNanoseconds();
+  for (;;) {
+    uint64_t start = MicroBenchNanoseconds();
+    suite->sink += fn(data, iterations);
+    uint64_t elapsed = MicroBenchNanoseconds() - start;
+    if (elapsed >= MICROBENCH_SAMPLE_NS &&
+        start + elapsed - warmup_start >= MICROBENCH_WARMUP_NS) {
+      break;
+    }
+    if (elapsed < MICROBENCH_SAMPLE_NS) {
+      iterations *= 2;
+    }
+  }
+
+  double ns[MICROBENCH_SAMPLES], ticks[MICROBENCH_SAMPLES];
+  for (int s = 0; s < MICROBENCH_SAMPLES; s++) {
+    uint64_t start_ns = MicroBenchNanoseconds();
+    uint64_t start_ticks = ProfileTicks();
+    suite->sink += fn(data, iterations);
+    ticks[s] = (double)(ProfileTicks() - start_ticks) / iterations;
+    ns[s] = (double)(MicroBenchNanoseconds() - start_ns) / iterations;
+  }
+  qsort(ns, MICROBENCH_SAMPLES, sizeof(double), MicroBenchCompare);
+  qsort(ticks, MICROBENCH_SAMPLES, sizeof(double), MicroBenchCompare);
+
+  MicroBenchResult *result = &suite->results[suite->result_count++];
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->ns = ns[MICROBENCH_SAMPLES / 2];
+  result->min_ns = ns[0];
+  result->cycles = ticks[MICROBENCH_SAMPLES / 2];
+  result->iterations = iterations;
+  printf("%-32s %10.3f %10.3f %10.2f %12" PRIu64 "\n", result->name,
+         result->ns, result->min_ns, result->cycles, result->iterations);
+  fflush(stdout);
+}
+
+// Baseline files have one "name ns cycles" line per benchmark
+bool MicroBenchFindBaseline(const char *file, const char *name, double *ns, double *cycles)
+{
+  FILE *in = fopen(file, "r");
+  if (!in) {
+    return false;
+  }
+  char entry[MICROBENCH_NAME_SIZE];
+  bool found = false;
+  while (!found && fscanf(in, "%47s %lf %lf", entry, ns, cycles) == 3) {
+    found = !strcmp(entry, name);
+  }
+  fclose(in);
+  return found;
+}
+
+void MicroBenchSave(MicroBenchSuite *suite)
+{
+  char temp[256];
+  snprintf(temp, sizeof(temp), "%s.tmp", suite->save_file);
+  FILE *out = fopen(temp, "w");
+  if (!out) {
+    fprintf(stderr, "failed to write %s: %s\n", temp, strerror(errno));
+    return;
+  }
+  // Entries from other binaries or filters are carried over
+  FILE *in = fopen(suite->save_file, "r");
+  if (in) {
+    char entry[MICROBENCH_NAME_SIZE];
+    double ns, cycles;
+    while (fscanf(in, "%47s %lf %lf", entry, &ns, &cycles) == 3) {
+      bool replaced = false;
+      for (uint32_t r = 0; r < suite->result_count; r++) {
+        replaced |= !strcmp(suite->results[r].name, entry);
+      }
+      if (!replaced) {
+        fprintf(out, "%s %.4f %.4f\n", entry, ns, cycles);
+      }
+    }
+    fclose(in);
+  }
+  for (uint32_t r = 0; r < suite->result_count; r++) {
+    fprintf(out, "%s %.4f %.4f\n", suite->results[r].name,
+            suite->results[r].ns, suite->results[r].cycles);
+  }
+  fclose(out);
+  if (rename(temp, suite->save_file) != 0) {
+    fprintf(stderr, "failed to write %s: %s\n", suite->save_file, strerror(errno));
+    return;
+  }
+  printf("saved %u results to %s\n", suite->result_count, suite->save_file);
+}
+
+// Returns the exit status: failure if anything got slower than the
+// baseline by more than the noise
+int MicroBenchFinish(MicroBenchSuite *suite)
+{
+  int status = EXIT_SUCCESS;
+  if (suite->baseline_file) {
+    printf("\n%-32s %10s %10s %8s\n", suite->baseline_file, "was ns", "now ns", "change");
+    for (uint32_t r = 0; r < suite->result_count; r++) {
+      MicroBenchResult *result = &suite->results[r];
+      double ns, cycles;
+      if (!MicroBenchFindBaseline(suite->baseline_file, result->name, &ns, &cycles)) {
+        printf("%-32s %10s %10.3f %8s\n", result->name, "-", result->ns, "new");
+        continue;
+      }
+      double change = 100.0 * (result->ns - ns) / ns;
+      const char *verdict = "";
+      if (change > MICROBENCH_NOISE_PERCENT) {
+        verdict = "slower";
+        status = EXIT_FAILURE;
+      } else if (change < -MICROBENCH_NOISE_PERCENT) {
+        verdict = "faster";
+      }
+      printf("%-32s %10.3f %10.3f %+7.1f%% %s\n", result->name, ns, result->ns,
+             change, verdict);
+    }
+  }
+  if (suite->save_file) {
+    MicroBenchSave(suite);
+  }
+  return status;
+}
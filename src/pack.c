@@ -0,0 +1,219 @@
+// Packs every file under the asset directories into one archive the
+// platform maps with --pack, see pack.h for the layout. Images are decoded
+// and audio converted here so the game does neither at startup. Built and
+// run by scripts/build_pack.sh.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include "pack.h"
+
+#define DEFAULT_PACK_FILE "build/assets.pack"
+#define MAX_PACK_ENTRIES 4096
+
+typedef struct
+{
+  char path[512];
+  uint32_t kind;
+} PackInput;
+
+static struct
+{
+  PackInput inputs[MAX_PACK_ENTRIES];
+  uint32_t input_count;
+  PackEntry *table;
+  uint32_t table_size;
+  FILE *out;
+  uint64_t offset;
+} pack;
+
+void Die(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  exit(EXIT_FAILURE);
+}
+
+// Hidden files are editors' temporaries, and are skipped
+void FindInputs(const char *dir, uint32_t kind)
+{
+  DIR *listing = opendir(dir);
+  if (!listing) {
+    printf("skipping %s: %s\n", dir, strerror(errno));
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(listing))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    if (pack.input_count == MAX_PACK_ENTRIES) {
+      Die("more than %d assets\n", MAX_PACK_ENTRIES);
+    }
+    PackInput *input = &pack.inputs[pack.input_count++];
+    snprintf(input->path, sizeof(input->path), "%s/%s", dir, entry->d_name);
+    input->kind = kind;
+  }
+  closedir(listing);
+}
+
+// Appends a blob at the next PACK_ALIGN boundary and returns its offset
+uint64_t WriteBlob(const void *data, uint64_t size)
+{
+  static const uint8_t padding[PACK_ALIGN];
+  uint64_t aligned = (pack.offset + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+  if (fwrite(padding, 1, aligned - pack.offset, pack.out) != aligned - pack.offset ||
+      fwrite(data, 1, size, pack.out) != size) {
+    Die("failed to write the pack: %s\n", strerror(errno));
+  }
+  pack.offset = aligned + size;
+  return aligned;
+}
+
+bool PackImage(PackEntry *entry, const char *path)
+{
+  SDL_Surface *surface = IMG_Load(path);
+  if (!surface) {
+    printf("skipping %s: %s\n", path, IMG_GetError());
+    return false;
+  }
+  SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+  SDL_FreeSurface(surface);
+  if (!converted) {
+    printf("skipping %s: %s\n", path, SDL_GetError());
+    return false;
+  }
+  entry->width = converted->w;
+  entry->height = converted->h;
+  entry->pitch = converted->pitch;
+  entry->size = (uint64_t)converted->pitch * converted->h;
+  entry->offset = WriteBlob(converted->pixels, entry->size);
+  SDL_FreeSurface(converted);
+  return true;
+}
+
+// Only WAV files are converted, anything else in AUDIO_DIR stays a loose
+// file for SDL_mixer to decode
+bool PackAudio(PackEntry *entry, const char *path)
+{
+  SDL_AudioSpec spec;
+  uint8_t *samples;
+  uint32_t length;
+  if (!SDL_LoadWAV(path, &spec, &samples, &length)) {
+    printf("skipping %s: %s\n", path, SDL_GetError());
+    return false;
+  }
+  SDL_AudioCVT cvt;
+  if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq,
+                        AUDIO_FORMAT, AUDIO_CHANNELS, AUDIO_FREQUENCY) < 0) {
+    printf("skipping %s: %s\n", path, SDL_GetError());
+    SDL_FreeWAV(samples);
+    return false;
+  }
+  cvt.len = length;
+  cvt.buf = malloc((size_t)length * cvt.len_mult);
+  if (!cvt.buf) {
+    Die("out of memory converting %s\n", path);
+  }
+  memcpy(cvt.buf, samples, length);
+  SDL_FreeWAV(samples);
+  if (SDL_ConvertAudio(&cvt) < 0) {
+    printf("skipping %s: %s\n", path, SDL_GetError());
+    free(cvt.buf);
+    return false;
+  }
+  entry->size = cvt.len_cvt;
+  entry->offset = WriteBlob(cvt.buf, cvt.len_cvt);
+  free(cvt.buf);
+  return true;
+}
+
+bool PackMusic(PackEntry *entry, const char *path)
+{
+  size_t size;
+  void *data = SDL_LoadFile(path, &size);
+  if (!data) {
+    printf("skipping %s: %s\n", path, SDL_GetError());
+    return false;
+  }
+  entry->size = size;
+  entry->offset = WriteBlob(data, size);
+  SDL_free(data);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *file = argc > 1 ? argv[1] : DEFAULT_PACK_FILE;
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+    printf("usage: %s [FILE]\n"
+           "packs %s, %s and %s into FILE (default %s)\n",
+           argv[0], IMAGES_DIR, AUDIO_DIR, MUSIC_DIR, DEFAULT_PACK_FILE);
+    return EXIT_FAILURE;
+  }
+  FindInputs(IMAGES_DIR, PACK_IMAGE);
+  FindInputs(AUDIO_DIR, PACK_AUDIO);
+  FindInputs(MUSIC_DIR, PACK_MUSIC);
+
+  pack.table_size = 16;
+  while (pack.table_size < pack.input_count * 2) {
+    pack.table_size *= 2;
+  }
+  pack.table = calloc(pack.table_size, sizeof(PackEntry));
+  char temp[256];
+  snprintf(temp, sizeof(temp), "%s.tmp", file);
+  pack.out = fopen(temp, "wb");
+  if (!pack.table || !pack.out) {
+    Die("failed to write %s: %s\n", temp, strerror(errno));
+  }
+  // The header and table are written last, once the offsets are known
+  PackHeader header = {
+    .magic = PACK_MAGIC,
+    .version = PACK_VERSION,
+    .table_size = pack.table_size,
+    .audio_frequency = AUDIO_FREQUENCY,
+    .audio_format = AUDIO_FORMAT,
+    .audio_channels = AUDIO_CHANNELS,
+  };
+  pack.offset = sizeof(PackHeader) + (uint64_t)pack.table_size * sizeof(PackEntry);
+  fseek(pack.out, pack.offset, SEEK_SET);
+
+  for (uint32_t i = 0; i < pack.input_count; i++) {
+    PackInput *input = &pack.inputs[i];
+    uint64_t hash = PackHash(input->path);
+    PackEntry *slot = PackSlot(pack.table, pack.table_size, hash);
+    if (slot->hash) {
+      Die("%s hashes the same as an earlier asset, rename it\n", input->path);
+    }
+    PackEntry entry = {.hash = hash, .kind = input->kind};
+    bool packed = input->kind == PACK_IMAGE ? PackImage(&entry, input->path) :
+                  input->kind == PACK_AUDIO ? PackAudio(&entry, input->path) :
+                  PackMusic(&entry, input->path);
+    if (packed) {
+      *slot = entry;
+      header.entry_count++;
+    }
+  }
+
+  header.size = pack.offset;
+  fseek(pack.out, 0, SEEK_SET);
+  if (fwrite(&header, sizeof(header), 1, pack.out) != 1 ||
+      fwrite(pack.table, sizeof(PackEntry), pack.table_size, pack.out) != pack.table_size ||
+      fclose(pack.out) != 0 || rename(temp, file) != 0) {
+    Die("failed to write %s: %s\n", file, strerror(errno));
+  }
+  printf("packed %u assets into %s, %.1f KiB\n", header.entry_count, file,
+         header.size / 1024.0);
+  return EXIT_SUCCESS;
+}
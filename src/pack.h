@@ -0,0 +1,75 @@
+// Asset packs
+//
+// Include after SDL.h. A pack is every image, audio and music file under
+// the asset directories in one file, laid out to be mapped and used in
+// place by the platform:
+//
+//   PackHeader
+//   PackEntry[table_size]   open addressed on the hash of the loose path
+//   blobs                   each starting on a PACK_ALIGN boundary
+//
+// Images are stored as ARGB8888 pixels, the format the platform's decoders
+// convert to, and audio as PCM in the mixer's device format, so neither is
+// decoded at run time. Music is streamed by SDL_mixer, its files are
+// stored as they are. Written by src/pack.c, see scripts/build_pack.sh.
+
+// Where the platform loads assets from, and what the packer packs
+#define IMAGES_DIR "assets/images"
+#define AUDIO_DIR "assets/audio"
+#define MUSIC_DIR "assets/music"
+
+// What the mixer is opened with, and what the packer converts audio to
+#define AUDIO_FREQUENCY 44100
+#define AUDIO_FORMAT AUDIO_S16SYS
+#define AUDIO_CHANNELS 2
+
+#define PACK_MAGIC 0x4b434150 // "PACK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 16
+
+enum { PACK_EMPTY = 0, PACK_IMAGE, PACK_AUDIO, PACK_MUSIC };
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t table_size;      // a power of two, at least twice entry_count
+  uint32_t audio_frequency; // what audio entries were converted to
+  uint16_t audio_format;
+  uint16_t audio_channels;
+  uint64_t size;            // of the whole file
+} PackHeader;
+
+typedef struct
+{
+  uint64_t hash;    // PackHash() of the loose path, 0 when empty
+  uint64_t offset;  // from the start of the file
+  uint64_t size;
+  uint32_t kind;
+  uint32_t width;   // images only
+  uint32_t height;
+  uint32_t pitch;
+} PackEntry;
+
+// FNV-1a of the path the file is loaded from without a pack, such as
+// "assets/images/box.png". Never 0, which marks an empty entry.
+uint64_t PackHash(const char *path)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *c = path; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+// The entry for hash, or where it would go
+PackEntry *PackSlot(PackEntry *table, uint32_t table_size, uint64_t hash)
+{
+  uint32_t mask = table_size - 1;
+  uint32_t i = hash & mask;
+  while (table[i].hash && table[i].hash != hash) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
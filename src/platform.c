@@ -9,6 +9,14 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <spawn.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_events.h>
@@ -22,63 +30,447 @@
 #include <SDL2/SDL_net.h>
 
 #include "shared.h"
+#include "pack.h"
 
 
 #define MAX_WINDOWS 2
 
 #define BUILD_DIR "build"
-#define GAME_LIB "build/libgame.so"
-#define GAME_LIB_TEMP "build/libgame_temp.so"
+#define SOURCE_DIR "src"
+#define DEFAULT_REBUILD_COMMAND "scripts/build_game.sh"
+#define REBUILD_LOG BUILD_DIR "/rebuild.log"
+#define GAME_LIB_NAME "libgame.so"
+#define GAME_LIB BUILD_DIR "/" GAME_LIB_NAME
+// Each load dlopens a private copy so the linker can overwrite GAME_LIB
+#define GAME_LIB_TEMP BUILD_DIR "/libgame_temp"
 
-#define IMAGES_DIR "assets/images"
-#define AUDIO_DIR "assets/audio"
-#define MUSIC_DIR "assets/music"
 #define SHADERS_DIR "assets/shaders"
 #define SCREENSHOTS_DIR "screenshots"
+#define SNAPSHOTS_DIR "snapshots"
 
+#define DEFAULT_MEMORY_SIZE 1200000000
+// Fixed so pointers stored inside game memory stay valid across runs
+#define DEFAULT_MEMORY_BASE 0x200000000000ULL
+#define DEFAULT_HOT_MEMORY_SIZE (64 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// The platform's own memory, reserved up front and committed lazily
+#define PLATFORM_MEMORY_SIZE (64 * 1024 * 1024)
+#define SCRATCH_MEMORY_SIZE (256 * 1024 * 1024)
+#define MALLOC_REPORT_FRAMES 600
+// Frame pacing: the last stretch before a deadline is spun instead of slept
+// through, as sleeps tend to overshoot by up to a scheduler tick
+#define DEFAULT_TARGET_FPS 60
+#define PACER_SPIN_NS 1000000ULL
+#define PACER_REPORT_FRAMES 600
+// While the window is hidden the loop sleeps in SDL_WaitEventTimeout. A
+// paused game still wakes this often so reloads and rebuilds get through.
+#define DEFAULT_BACKGROUND_FPS 5
+// Input events buffered for the game between two updates
+#define MAX_INPUT_EVENTS 1024
+#define BACKGROUND_PAUSED_WAIT_MS 250
+// Controllers are sampled on their own thread at --input-rate into a ring
+// the frame loop drains before each update. With no controllers the thread
+// only checks back this often.
+#define MAX_CONTROLLERS 8
+#define DEFAULT_INPUT_RATE 1000
+#define INPUT_SAMPLE_RING 4096
+#define INPUT_SAMPLE_MASK (INPUT_SAMPLE_RING - 1)
+#define INPUT_SAMPLER_IDLE_MS 100
+// Images are decoded on a pool of threads and uploaded on the frame loop, at
+// most --texture-uploads a frame so a burst of loads does not stall it. The
+// same threads reload audio and music that changed on disk.
+#define MAX_ASSET_JOBS 128
+#define MAX_ASSET_THREADS 16
+#define DEFAULT_TEXTURE_UPLOADS 4
+// Images up to ATLAS_MAX_IMAGE on a side share atlas pages, with a gap so
+// filtering never pulls in a neighbour
+#define DEFAULT_ATLAS_SIZE 2048
+#define ATLAS_MAX_IMAGE 512
+#define ATLAS_PADDING 1
+#define MAX_ATLAS_PAGES 8
+#define MAX_SKYLINE_NODES 512
+#define MAX_ASSET_CHANGES 64
+#define ASSET_NAME_SIZE 64
+// --input-latency histograms have log2 buckets from 0.25 ms up to 64 ms
+#define LATENCY_BUCKETS 10
+#define LATENCY_BUCKET_MS 0.25
+#define LATENCY_REPORT_SAMPLES 1000
+// --input-latency-test pushes key events with this window ID bit set and
+// the probe's index in the rest, a key nothing is bound to, at random
+// intervals so they land anywhere in the frame
+#define LATENCY_PROBE_WINDOW 0x80000000u
+#define LATENCY_PROBE_SCANCODE SCANCODE_F24
+#define LATENCY_PROBE_MIN_MS 2
+#define LATENCY_PROBE_MAX_MS 20
+// The library is reloaded once it has been quiet for this long
+#define DEFAULT_RELOAD_DEBOUNCE_NS (10 * 1000000ULL)
+// --reload-bench waits this long between reloads so frame times settle,
+// and keeps looking for hitches this many frames after each one
+#define BENCH_RELOAD_INTERVAL_MS 250
+#define BENCH_HITCH_FRAMES 10
+#define BENCH_MAX_FRAMES 65536
+
+enum { HUGE_PAGES_OFF = 0, HUGE_PAGES_MADVISE, HUGE_PAGES_HUGETLB };
+enum { PACING_TARGET = 0, PACING_VSYNC, PACING_UNLIMITED };
+enum { BACKGROUND_THROTTLE = 0, BACKGROUND_PAUSE, BACKGROUND_RUN };
+
+// Settings that can be changed from the command line
 typedef struct
 {
-  GameInitFn *game_init;
-  GameUpdateFn *game_update;
-  GameRenderFn *game_render;
-
-  GameQuitFn *game_quit;
-  GameLowMemoryFn *game_low_memory;
-
-  GameWindowShownFn *game_window_shown;
-  GameWindowMovedFn *game_window_moved;
-  GameWindowResizedFn *game_window_resized;
-  GameWindowMinMaxedFn *game_window_minmaxed;
-  GameWindowMousedFn *game_window_moused;
-  GameWindowFocusedFn *game_window_focused;
-  GameWindowClosedFn *game_window_closed;
-
-  GameKeyboardInputFn *game_keyboard_input;
-  GameMouseMotionFn *game_mouse_motion;
-  GameMouseButtonFn *game_mouse_button;
-  GameMouseWheelFn *game_mouse_wheel;
-  GameJoyDeviceEventFn *game_joy_device_event;
-  GameJoyButtonEventFn *game_joy_button_event;
-  GameJoyHatEventFn *game_joy_hat_event;
-  GameJoyAxisEventFn *game_joy_axis_event;
-  GameJoyBallEventFn *game_joy_ball_event;
-  GameControllerEventFn *game_controller_device_event;
-  GameControllerButtonEventFn *game_controller_button_event;
-  GameControllerAxisEventFn *game_controller_axis_event;
-  GameControllerSensorEventFn *game_controller_sensor_event;
-  GameControllerTouchpadEventFn *game_controller_touchpad_event;
-  GameAudioDeviceEventFn *game_audio_device_event;
-  GameChannelHaltedFn *game_channel_halted;
-  GameMusicHaltedFn *game_music_halted;
-  GameTouchFingerEventFn *game_touch_finger_event;
-  GameDropEventFn *game_drop_event;
-  GameSensorEventFn *game_sensor_event;
-  GameUserEventFn *game_user_event;
-  
+  uintptr_t memory_base;   // fixed address of GameMemory, 0 for anywhere
+  size_t memory_size;      // bytes reserved for GameMemory
+  size_t hot_memory_size;  // bytes committed up front, huge page backed
+  uint8_t huge_pages;
+  const char *restore_file; // snapshot to load before the first frame
+  const char *record_name;  // record input to snapshots/<name>.*
+  const char *playback_name;
+  uint32_t playback_loops;
+  bool headless;            // dummy video and audio drivers
+  uint64_t reload_debounce_ns;
+  uint32_t reload_bench;         // reloads to time, 0 to run normally
+  const char *reload_bench_command; // relinks the library, NULL to touch it
+  const char *rebuild_command; // run when SOURCE_DIR changes, NULL to not watch it
+  const char *profile_file; // Chrome trace written on quit, PROFILE builds only
+  uint8_t frame_pacing;
+  uint32_t target_fps;
+  bool frame_stats;         // print frame time and jitter percentiles
+  uint8_t background;       // what to do while the window is hidden
+  uint32_t background_fps;  // update rate when throttled
+  uint32_t input_rate;      // controller samples per second, 0 for SDL's events
+  uint32_t asset_threads;   // decoders, 0 for one less than the cores
+  uint32_t texture_uploads; // per frame
+  uint32_t atlas_size;      // atlas page side, 0 for a texture per image
+  const char *pack_file;    // assets archive to map, NULL for loose files only
+  bool input_latency;       // print input to present latency histograms
+  uint32_t input_latency_test; // synthetic key events to time, then quit
+} PlatformConfig;
+
+#define SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+#define SNAPSHOT_VERSION 4
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t base;  // address the memory was saved from
+  uint64_t used;  // bytes between ptr and cursor
+  uint64_t data_offset; // where the memory starts, a multiple of the page size
+  GameMemoryStats stats;
+} SnapshotHeader;
+
+#define RECORDING_MAGIC 0x43455249 // "IREC"
+#define RECORDING_VERSION 1
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seed;    // rand() seed at the first frame
+  uint32_t frames;  // number of frames recorded
+} RecordingHeader;
+
+// An input event and the frame it was dispatched on
+typedef struct
+{
+  uint32_t frame;
+  SDL_Event event;
+} RecordedEvent;
+
+enum { RECORDER_OFF = 0, RECORDER_RECORDING, RECORDER_PLAYING };
+
+// Records the game memory at the first frame plus every input event
+// dispatched after it, and plays them back in a loop. Each loop starts
+// from the same memory and rand() seed and sees the same events on the
+// same frames, so runs of different builds are directly comparable.
+typedef struct
+{
+  uint8_t mode;
+  char state_file[256];
+  char input_file[256];
+  uint32_t seed;
+  uint32_t frame;
+  // Recording
+  FILE *file;
+  // Playback
+  RecordedEvent *events;
+  uint32_t event_count;
+  uint32_t next_event;
+  uint32_t frames;
+  uint32_t loop;
+  uint32_t loops;        // 0 plays forever
+  double *frame_times;   // milliseconds, one per recorded frame
+} Recorder;
+
+typedef struct
+{
+  GameAPI api;
   void* handle;
-  time_t last_file_time;
+  uint64_t last_write_ns;
 } GameCode;
 
+// Written by the watch thread, taken by the frame loop once it has been
+// quiet for the debounce interval
+typedef struct
+{
+  uint64_t changed_ns;       // last change, 0 once handled
+  uint64_t first_changed_ns; // first change since it was last handled
+} FileChange;
+
+enum { ASSET_IMAGE = 0, ASSET_AUDIO, ASSET_MUSIC, ASSET_KIND_COUNT };
+
+// A file written in one of the asset directories, waiting out the debounce
+typedef struct
+{
+  uint8_t kind;
+  char name[ASSET_NAME_SIZE];
+  uint64_t changed_ns;
+} AssetChange;
+
+// Watches BUILD_DIR, SOURCE_DIR when rebuilding and the asset directories
+// from its own thread so the frame loop never has to ask the file system
+// whether anything changed
+typedef struct
+{
+  int fd;                // inotify instance, -1 to fall back to stat()
+  int source_wd;
+  int asset_wd[ASSET_KIND_COUNT];
+  SDL_Thread *thread;
+  FileChange library;
+  FileChange source;
+  uint64_t seen_write_ns; // stat() fallback: last modification noticed
+  // One entry per changed file, under asset_lock
+  SDL_mutex *asset_lock;
+  AssetChange asset_changes[MAX_ASSET_CHANGES];
+  uint32_t asset_change_count;
+} LibraryWatch;
+
+// Ends each frame: waits for vsync in present, sleeps and spins up to the
+// next deadline, or not at all
+typedef struct
+{
+  uint8_t mode;
+  uint64_t period_ns;    // target frame length, 0 when unlimited
+  uint64_t deadline_ns;  // when the current frame should end
+  uint64_t frame_ns;     // when the last frame ended
+  double times[PACER_REPORT_FRAMES]; // frame lengths, milliseconds
+  double jitter[PACER_REPORT_FRAMES]; // distance from the target, milliseconds
+  uint32_t count;
+  uint64_t busy_ns;      // time not spent sleeping since the last report
+} FramePacer;
+
+// Hidden or minimized windows are not rendered, and the game is updated
+// at the background rate or not at all
+typedef struct
+{
+  bool hidden;
+  bool minimized;
+  bool active;           // was in the background last frame
+  uint64_t next_update_ns;
+} Background;
+
+// Input collected for the next GameUpdate
+typedef struct
+{
+  GameInputEvent events[MAX_INPUT_EVENTS];
+  uint32_t count;
+  uint32_t dropped;
+  uint64_t last_update_ns;
+  uint64_t ticks_offset_ns; // GetNanoseconds() at SDL_GetTicks() == 0
+} InputBuffer;
+
+typedef struct
+{
+  SDL_GameController *controller;
+  SDL_JoystickID id;
+  bool sensors[SENSOR_GYRO + 1];        // enabled, by SENSOR_*
+  int16_t axes[CONTROLLER_AXIS_COUNT];  // last sampled
+  float sensor_data[SENSOR_GYRO + 1][3];
+} OpenController;
+
+// Lock free between one producer and one consumer: the sampler thread only
+// writes head and the frame loop only writes tail. The controller table is
+// changed and read under SDL_LockJoysticks().
+typedef struct
+{
+  GameInputEvent samples[INPUT_SAMPLE_RING];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t dropped;      // ring was full
+  int running;
+  SDL_Thread *thread;
+  OpenController controllers[MAX_CONTROLLERS];
+  uint32_t controller_count;
+} InputSampler;
+
+// TEXTURE_* plus the state between decoding and uploading
+enum { IMAGE_DECODED = TEXTURE_FAILED + 1 };
+
+// One per texture id. Status, generation and surface are shared with the
+// decoders under the loader's lock; the texture belongs to the frame loop.
+typedef struct
+{
+  int status;
+  uint32_t generation;   // bumped by each PlatformEnsureImage
+  SDL_Surface *surface;  // decoded, waiting to be uploaded, NULL if it failed
+  SDL_Texture *texture;  // the last one uploaded, drawn until replaced
+  // Frame loop only
+  char filename[ASSET_NAME_SIZE]; // reloaded when it changes
+  SDL_Rect region;       // the image within texture
+  bool in_atlas;         // texture is atlas_page's, not the image's own
+  uint8_t atlas_page;
+} TextureSlot;
+
+// The top edge of what has been packed into a page so far, left to right
+typedef struct
+{
+  int x;
+  int y;
+  int width;
+} SkylineNode;
+
+typedef struct
+{
+  SDL_Texture *texture;
+  SkylineNode nodes[MAX_SKYLINE_NODES];
+  uint32_t node_count;
+} AtlasPage;
+
+// Frame loop only, pages are added as they fill and never freed
+typedef struct
+{
+  AtlasPage pages[MAX_ATLAS_PAGES];
+  uint32_t page_count;
+} Atlas;
+
+// An image for a texture slot, or a reload for an audio or music index
+typedef struct
+{
+  uint8_t kind;
+  uint32_t index;
+  uint32_t generation;
+  char path[256];
+} AssetJob;
+
+// Audio or music loaded by a decoder, swapped in by the frame loop
+typedef struct
+{
+  uint8_t kind;
+  uint32_t index;
+  uint32_t generation;
+  void *data;           // Mix_Chunk or Mix_Music, NULL if it failed
+} AssetReload;
+
+typedef struct
+{
+  SDL_mutex *lock;
+  SDL_cond *work;
+  SDL_Thread *threads[MAX_ASSET_THREADS];
+  uint32_t thread_count;
+  bool running;
+  AssetJob jobs[MAX_ASSET_JOBS];
+  uint32_t job_head;
+  uint32_t job_tail;
+  uint32_t decoded;      // slots waiting for an upload
+  TextureSlot slots[MAX_SURFACES];
+  AssetReload reloads[MAX_ASSET_JOBS];
+  uint32_t reload_count;
+  uint32_t reloads_queued; // not yet swapped in, keeps reloads from filling up
+  // Frame loop only: reports how long each burst of loads took
+  uint32_t outstanding;
+  uint32_t burst_count;
+  uint64_t burst_start_ns;
+} AssetLoader;
+
+// --pack, mapped read only for as long as the platform runs. Textures and
+// chunks are made straight from its bytes; anything not in it is loaded
+// from the loose files.
+typedef struct
+{
+  uint8_t *base;
+  size_t size;
+  PackEntry *table;
+  uint32_t table_size;
+  bool audio;  // converted to the format the mixer was opened with
+} Pack;
+
+enum {
+  LATENCY_QUEUE = 0,  // SDL timestamp to DispatchEvent
+  LATENCY_UPDATE,     // DispatchEvent to the GameUpdate that got it
+  LATENCY_RENDER,     // GameUpdate to the end of the GameRender after it
+  LATENCY_PRESENT,    // end of GameRender to SDL_RenderPresent returning
+  LATENCY_TOTAL,
+  LATENCY_STAGE_COUNT
+};
+
+// Follows buffered input from SDL to the frame that shows it. Stamps are
+// kept for the events since the last present, in buffer order.
+typedef struct
+{
+  uint64_t delivered_ns[MAX_INPUT_EVENTS];
+  uint64_t dispatched_ns[MAX_INPUT_EVENTS];
+  uint32_t pending;      // stamped
+  uint32_t updated;      // of those, handed to the last GameUpdate
+  uint64_t update_ns;
+  uint64_t render_ns;
+  double *samples[LATENCY_STAGE_COUNT]; // milliseconds, since the last report
+  uint32_t sample_count;
+  uint32_t sample_capacity;
+  // --input-latency-test
+  SDL_Thread *thread;
+  uint64_t *probe_ns;    // when each probe was pushed
+  uint32_t probes_seen;  // dispatched, kept or dropped
+  uint32_t probes_lost;  // failed to push, written by the probe thread
+} InputLatency;
+
+// Rebuilds the game in a child process when its source changes, the new
+// library reaches the game through the normal reload path
+typedef struct
+{
+  pid_t pid;             // running build, 0 when idle
+  uint64_t edit_ns;      // first source change the running build picked up
+  uint64_t start_ns;
+  uint64_t built_edit_ns; // edit behind the last good build, 0 once reported
+  uint64_t built_ns;
+} Rebuilder;
+
+enum { LIBRARY_IDLE = 0, LIBRARY_LOADING, LIBRARY_READY, LIBRARY_FAILED };
+
+// A new library is copied, opened and resolved off the main thread, the
+// frame loop only swaps it in once it is READY
+typedef struct
+{
+  SDL_Thread *thread;
+  int status;            // written by the loader, read by the frame loop
+  uint32_t generation;   // numbers the temporary copies
+  // Timeline of the current reload
+  uint64_t change_ns;    // the library changed
+  uint64_t start_ns;     // debounced, loader started
+  uint64_t ready_ns;     // loader done
+  uint64_t swap_start_ns; // frame loop picked it up
+  uint64_t swap_ns;      // new code initialized, old code unloaded
+  bool first_frame;      // the next presented frame is the new code's first
+  GameCode code;
+} LibraryLoader;
+
+// --reload-bench: a thread keeps changing the library while the frame loop
+// times each reload, then prints a JSON summary and quits
+typedef struct
+{
+  SDL_Thread *thread;
+  uint32_t completed;    // reloads measured or failed, the thread waits on it
+  uint32_t failed;
+  uint32_t measured;
+  double *latency;       // change to first frame presented with the new code
+  double *load;          // copy, dlopen and validation on the loader thread
+  double *swap;          // migration, GameInit and unloading the old code
+  double *worst_frame;   // longest frame from the change to BENCH_HITCH_FRAMES after
+  double *frames;        // frame times outside of reloads, for reference
+  uint32_t frame_count;
+  bool in_reload;
+  double worst;
+  uint32_t frames_after;
+} ReloadBench;
+
 #define MAX_AUDIOS 500
 #define MAX_MUSIC 100
 
@@ -86,12 +478,16 @@ typedef struct
 {
   Mix_Chunk *chunk;
   int channel;  // This is "int" because SDL_mixer uses it
+  uint32_t generation;  // bumped by each load, stale reloads are dropped
+  char filename[ASSET_NAME_SIZE];
 } Audio;
 
 typedef struct
 {
   Mix_Music *music;
   int track;
+  uint32_t generation;
+  char filename[ASSET_NAME_SIZE];
 } Music;
 
 #define MAX_SOCKETS 25
@@ -124,17 +520,23 @@ typedef struct {
 
 static struct
 {
+  PlatformConfig config;
   // Game
   GameCode game_code;
   GameMemory game_memory;
+  // Platform memory: long lived allocations and a scratch stack for
+  // anything that only lives for the duration of a call
+  GameMemory platform_memory;
+  GameMemory scratch;
   // App
   Screen screen;
   Projection projection;
   SDL_Window *windows[MAX_WINDOWS];
   int8_t window_count;
   SDL_Renderer *renderer;
-  SDL_Texture *textures[MAX_SURFACES];
-  int texture_count;
+  AssetLoader assets;
+  Atlas atlas;
+  Pack pack;
   // Video
   // Audio
   Audio audio[MAX_AUDIOS];
@@ -142,16 +544,76 @@ static struct
   // Music
   Music music[MAX_MUSIC];
   int track_count;
-  // Net
-  Connection sockets[MAX_SOCKETS];
-  int socket_count;
+  Music *playing_music;  // last played, restarted if it is reloaded
+  int playing_loops;
+  // Net, handles given to the game are block indices
+  GamePool sockets;
 
   int program_set;
+
+  // Snapshots requested by the game, handled at the end of the frame
+  char save_state_file[256];
+  char load_state_file[256];
+
+  Recorder recorder;
+  LibraryWatch library_watch;
+  LibraryLoader library_loader;
+  ReloadBench reload_bench;
+  Rebuilder rebuilder;
+  FramePacer pacer;
+  Background background;
+  InputBuffer input;
+  InputSampler sampler;
+  InputLatency latency;
+  Profiler *profiler;
 } state;
 
 
+#ifdef DEBUG
+// Every malloc in the process, the platform aims for none per frame
+static uint64_t malloc_count;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+  __atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  __atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  __atomic_fetch_add(&malloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+void StopRecording();
+void WriteProfile();
+void ReportInputLatency();
+void StopInputSampler();
+void StopAssetLoader();
+
 void Quit()
 {
+    StopInputSampler();
+    StopAssetLoader();
+    StopRecording();
+    WriteProfile();
+    if (state.latency.sample_count && !state.config.input_latency_test) {
+      ReportInputLatency();
+    }
+    if (state.game_memory.ptr) {
+      GameMemoryReport(&state.game_memory, stdout);
+    }
     SDL_Quit();
     exit(0);
 }
@@ -173,220 +635,218 @@ void Die(const char *fmt, ...)
     Quit();
 }
 
-time_t GetFileWriteTime(const char *file)
+uint64_t GetNanoseconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t GetFileWriteTime(const char *file)
 {
     struct stat buf;
     if(stat(file, &buf) == 0) {
-        return buf.st_mtime;
+        return (uint64_t)buf.st_mtim.tv_sec * 1000000000ULL + buf.st_mtim.tv_nsec;
     }
     return 0;
 }
 
+// Resident set size of this process in bytes
+size_t GetResidentMemory()
+{
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+double GetSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The library's one exported symbol hands back its table of callbacks,
+// checked against what this platform was built with before anything in
+// it is called
 GameCode LoadGameCode(const char *path)
 {
     GameCode result = {};
-    result.last_file_time = GetFileWriteTime(path);
-    char *error;
-
-    result.handle = dlopen(path, RTLD_LAZY);
-    dlerror();    /* Clear any existing error */
-    
-    if(result.handle) {
-	result.game_init = (GameInitFn *)dlsym(result.handle, "GameInit");
-	if ((error = dlerror()) != NULL)  {
-	  fprintf(stderr, "%s\n", error);
-	  exit(EXIT_FAILURE);
-	}
-	result.game_update = (GameUpdateFn *)dlsym(result.handle, "GameUpdate");
-	if ((error = dlerror()) != NULL)  {
-	    fprintf(stderr, "%s\n", error);
-	    exit(EXIT_FAILURE);
-	}
-	result.game_render = (GameRenderFn *)dlsym(result.handle, "GameRender");
-	if ((error = dlerror()) != NULL)  {
-	    fprintf(stderr, "%s\n", error);
-	    exit(EXIT_FAILURE);
-	}
-	
-	result.game_window_shown = (GameWindowShownFn *)dlsym(result.handle, "GameWindowShown");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_shown = NULL;
-	}
-	
-	result.game_window_moved = (GameWindowMovedFn *)dlsym(result.handle, "GameWindowMoved");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_shown = NULL;
-	}
-	
-	result.game_window_resized = (GameWindowResizedFn *)dlsym(result.handle, "GameWindowResized");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_resized = NULL;
-	}
-	
-	result.game_window_minmaxed = (GameWindowMinMaxedFn *)dlsym(result.handle, "GameWindowMinMaxed");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_minmaxed = NULL;
-	}
 
-	result.game_window_moused = (GameWindowMousedFn *)dlsym(result.handle, "GameWindowMoused");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_moused = NULL;
-	}
-	
-	result.game_window_focused = (GameWindowFocusedFn *)dlsym(result.handle, "GameWindowFocused");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_focused = NULL;
-	}
-	
-	result.game_window_closed = (GameWindowClosedFn *)dlsym(result.handle, "GameWindowClosed");
-	if ((error = dlerror()) != NULL) {
-	  result.game_window_closed = NULL;
-	}
-	
-	result.game_quit = (GameQuitFn *)dlsym(result.handle, "GameQuit");
-	if ((error = dlerror()) != NULL) {
-	  result.game_quit = NULL;
-	}
-	
-	result.game_keyboard_input = (GameKeyboardInputFn *)dlsym(result.handle, "GameKeyboardInput");
-	if ((error = dlerror()) != NULL) {
-	  result.game_keyboard_input = NULL;
-	}
-	
-	result.game_mouse_button = (GameMouseButtonFn *)dlsym(result.handle, "GameMouseButton");
-	if ((error = dlerror()) != NULL) {
-	  result.game_mouse_button = NULL;
-	}
-	result.game_mouse_motion = (GameMouseMotionFn *)dlsym(result.handle, "GameMouseMotion");
-	if ((error = dlerror()) != NULL) {
-	  result.game_mouse_motion = NULL;
-	}
-	result.game_mouse_wheel = (GameMouseWheelFn *)dlsym(result.handle, "GameMouseWheel");
-	if ((error = dlerror()) != NULL) {
-	  result.game_mouse_wheel = NULL;
-	}
-	
-	result.game_joy_device_event = (GameJoyDeviceEventFn *)dlsym(result.handle, "GameJoyDeviceEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_joy_device_event = NULL;
-	}
-	result.game_joy_button_event = (GameJoyButtonEventFn *)dlsym(result.handle, "GameJoyButtonEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_joy_button_event = NULL;
-	}
-	result.game_joy_axis_event = (GameJoyAxisEventFn *)dlsym(result.handle, "GameJoyAxisEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_joy_axis_event = NULL;
-	}
-	result.game_joy_hat_event = (GameJoyHatEventFn *)dlsym(result.handle, "GameJoyHatEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_joy_hat_event = NULL;
-	}
-	result.game_joy_ball_event = (GameJoyBallEventFn *)dlsym(result.handle, "GameJoyBallEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_joy_ball_event = NULL;
-	}
+    // Resolve everything up front so a library with missing symbols is
+    // rejected here instead of crashing the session later
+    result.handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!result.handle) {
+      fprintf(stderr, "%s\n", dlerror());
+      return result;
+    }
+    GameGetAPIFn *game_get_api = (GameGetAPIFn *)dlsym(result.handle, "GameGetAPI");
+    const GameAPI *api = game_get_api ? game_get_api() : NULL;
+    if (!api) {
+      fprintf(stderr, "%s does not export GameGetAPI\n", path);
+    } else if (api->version != GAME_API_VERSION || api->size != sizeof(GameAPI)) {
+      fprintf(stderr, "%s has game API version %u (%u bytes), expected %u (%zu bytes)\n",
+              path, api->version, api->size, GAME_API_VERSION, sizeof(GameAPI));
+    } else if (api->platform_hash != GamePlatformLayoutHash()) {
+      fprintf(stderr, "%s was built against a different shared.h (layout %016" PRIx64
+              ", expected %016" PRIx64 ")\n", path, api->platform_hash, GamePlatformLayoutHash());
+    } else if (!api->game_init || !api->game_update || !api->game_render) {
+      fprintf(stderr, "%s is missing GameInit, GameUpdate or GameRender\n", path);
+    } else {
+      result.api = *api;
+      return result;
+    }
+    dlclose(result.handle);
+    return (GameCode){};
+}
 
-	result.game_controller_device_event = (GameControllerEventFn *)dlsym(result.handle, "GameControllerEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_controller_device_event = NULL;
-	}
-	result.game_controller_button_event = (GameControllerButtonEventFn *)dlsym(result.handle, "GameControllerButtonEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_controller_button_event = NULL;
-	}
-	result.game_controller_axis_event = (GameControllerAxisEventFn *)dlsym(result.handle, "GameControllerAxisEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_controller_axis_event = NULL;
-	}
-	result.game_controller_touchpad_event = (GameControllerTouchpadEventFn *)dlsym(result.handle, "GameControllerTouchpadEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_controller_touchpad_event = NULL;
-	}
-	result.game_controller_sensor_event = (GameControllerSensorEventFn *)dlsym(result.handle, "GameControllerSensorEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_controller_sensor_event = NULL;
-	}
+void UnloadGameCode(GameCode *game_code)
+{
+  dlclose(game_code->handle);
+  *game_code = (GameCode){};
+}
 
-	result.game_audio_device_event = (GameAudioDeviceEventFn *)dlsym(result.handle, "GameAudioDeviceEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_audio_device_event = NULL;
-	}
- 
-	result.game_channel_halted = (GameChannelHaltedFn *)dlsym(result.handle, "GameChannelHalted");
-	if ((error = dlerror()) != NULL) {
-	  result.game_channel_halted = NULL;
-	}
-	
-	result.game_music_halted = (GameMusicHaltedFn *)dlsym(result.handle, "GameMusicHalted");
-	if ((error = dlerror()) != NULL) {
-	  result.game_music_halted = NULL;
-	}
+// Copy the library to a unique name and load the copy. Returns an empty
+// GameCode if the library is incomplete or fails to load.
+GameCode LoadGameCodeCopy(const char *path, uint32_t generation)
+{
+  GameCode result = {};
+  char temp_path[256];
+  snprintf(temp_path, sizeof(temp_path), "%s_%d_%u.so", GAME_LIB_TEMP, getpid(), generation);
 
-	result.game_touch_finger_event = (GameTouchFingerEventFn *)dlsym(result.handle, "GameTouchFingerEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_touch_finger_event = NULL;
-	}
+  int source = open(path, O_RDONLY | O_CLOEXEC);
+  if (source < 0) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return result;
+  }
+  struct stat before;
+  if (fstat(source, &before) != 0 || before.st_size == 0) {
+    fprintf(stderr, "%s is empty\n", path);
+    close(source);
+    return result;
+  }
+  int target = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+  if (target < 0) {
+    fprintf(stderr, "failed to create %s: %s\n", temp_path, strerror(errno));
+    close(source);
+    return result;
+  }
+  off_t offset = 0;
+  while (offset < before.st_size) {
+    ssize_t copied = sendfile(target, source, &offset, before.st_size - offset);
+    if (copied <= 0) {
+      break;
+    }
+  }
+  close(target);
+  // The linker may still be writing, a copy that does not match what we
+  // started with is thrown away and picked up by the next change event
+  struct stat after;
+  bool complete = offset == before.st_size && fstat(source, &after) == 0 &&
+                  after.st_size == before.st_size &&
+                  after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+                  after.st_mtim.tv_nsec == before.st_mtim.tv_nsec;
+  close(source);
+  if (complete) {
+    result = LoadGameCode(temp_path);
+    result.last_write_ns = (uint64_t)before.st_mtim.tv_sec * 1000000000ULL + before.st_mtim.tv_nsec;
+  } else {
+    fprintf(stderr, "%s changed while copying\n", path);
+  }
+  // The mapping keeps the copy alive, nothing is left behind in BUILD_DIR
+  unlink(temp_path);
+  return result;
+}
 
-	result.game_drop_event = (GameDropEventFn *)dlsym(result.handle, "GameDropEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_drop_event = NULL;
-	}
+int LoadGameCodeAsync(void *data)
+{
+  TIMED_FUNCTION();
+  LibraryLoader *loader = data;
+  loader->code = LoadGameCodeCopy(GAME_LIB, loader->generation);
+  loader->ready_ns = GetNanoseconds();
+  __atomic_store_n(&loader->status, loader->code.handle ? LIBRARY_READY : LIBRARY_FAILED,
+                   __ATOMIC_RELEASE);
+  return 0;
+}
 
-	result.game_sensor_event = (GameSensorEventFn *)dlsym(result.handle, "GameSensorEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_sensor_event = NULL;
-	}
+// Element type of a declared type, "Rect[N]" and "Rect[M]" are both "Rect"
+size_t FieldElementTypeLength(const char *type)
+{
+  const char *extent = strchr(type, '[');
+  return extent ? (size_t)(extent - type) : strlen(type);
+}
 
-	result.game_user_event = (GameUserEventFn *)dlsym(result.handle, "GameUserEvent");
-	if ((error = dlerror()) != NULL) {
-	  result.game_user_event = NULL;
-	}
-	
-    }	
-    return result;
+// Hash of what one element of a field holds, so a struct whose own fields
+// moved around no longer matches even at the same size
+uint64_t FieldElementLayout(const GameFieldInfo *field)
+{
+  return GameHashFields(field->fields, field->fields ? field->field_count : 0,
+                        field->element_size);
 }
 
-void UnloadGameCode(GameCode *game_code)
+// Rewrite the GameState at the start of game memory from the running
+// library's layout to the new one. Fields are matched by name, declared type
+// and the layout of their elements; arrays that only changed length keep as
+// many elements as fit. Anything else in the new layout starts out zeroed.
+bool MigrateGameState(GameMemory *memory, const GameAPI *from, const GameAPI *to)
 {
-  dlclose(game_code->handle);
-  game_code->handle = 0;
-  
-  game_code->game_init = 0;
-  game_code->game_update = 0;
-  game_code->game_render = 0;
-  
-  game_code->game_quit = 0;
-  game_code->game_low_memory = 0;
-  
-  game_code->game_window_shown = 0;
-  game_code->game_window_moved = 0;       
-  game_code->game_window_resized = 0;  
-  game_code->game_window_minmaxed = 0;
-  game_code->game_window_moused = 0;
-  game_code->game_window_focused = 0;
-  game_code->game_window_closed = 0;	   
-  game_code->game_keyboard_input = 0;
-  game_code->game_mouse_motion = 0;
-  game_code->game_mouse_button = 0;
-  game_code->game_mouse_wheel = 0;
-  game_code->game_joy_device_event = 0;
-  game_code->game_joy_button_event = 0;
-  game_code->game_joy_hat_event = 0;
-  game_code->game_joy_axis_event = 0;
-  game_code->game_joy_ball_event = 0;
-  game_code->game_controller_device_event = 0;
-  game_code->game_controller_button_event = 0;
-  game_code->game_controller_axis_event = 0;
-  game_code->game_controller_sensor_event = 0;
-  game_code->game_controller_touchpad_event = 0;
-  game_code->game_audio_device_event = 0;
-  game_code->game_channel_halted = 0;
-  game_code->game_music_halted = 0;
-  game_code->game_touch_finger_event = 0;
-  game_code->game_drop_event = 0;
-  game_code->game_sensor_event = 0;
-  game_code->game_user_event = 0;
+  if (!from->state_fields || !to->state_fields ||
+      from->state_size > GAME_STATE_RESERVE || to->state_size > GAME_STATE_RESERVE ||
+      (size_t)(memory->cursor - memory->ptr) < GAME_STATE_RESERVE) {
+    return false;
+  }
+  uint64_t start = GetNanoseconds();
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  uint8_t *old_state = GameAllocateMemory(&state.scratch, from->state_size, MEMORY_TAG_SCRATCH);
+  memcpy(old_state, memory->ptr, from->state_size);
+  memset(memory->ptr, 0, MAX(from->state_size, to->state_size));
+
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < to->state_field_count; i++) {
+    const GameFieldInfo *field = &to->state_fields[i];
+    const GameFieldInfo *old_field = NULL;
+    for (uint32_t j = 0; j < from->state_field_count && !old_field; j++) {
+      if (!strcmp(from->state_fields[j].name, field->name)) {
+        old_field = &from->state_fields[j];
+      }
+    }
+    if (!old_field) {
+      printf("  GameState.%s added\n", field->name);
+      continue;
+    }
+    size_t length = FieldElementTypeLength(field->type);
+    bool same_layout = FieldElementLayout(old_field) == FieldElementLayout(field);
+    bool same_type = !strcmp(old_field->type, field->type) && old_field->size == field->size;
+    bool resized_array = field->type[length] == '[' &&
+                         length == FieldElementTypeLength(old_field->type) &&
+                         !strncmp(old_field->type, field->type, length);
+    if (!same_layout && (same_type || resized_array)) {
+      printf("  GameState.%s reset, the layout of %.*s changed\n", field->name,
+             (int)length, field->type);
+    } else if (same_type || resized_array) {
+      memcpy(memory->ptr + field->offset, old_state + old_field->offset,
+             MIN(field->size, old_field->size));
+      kept++;
+      if (!same_type) {
+        printf("  GameState.%s resized %u -> %u bytes\n", field->name,
+               old_field->size, field->size);
+      }
+    } else {
+      printf("  GameState.%s reset, %s (%u bytes) -> %s (%u bytes)\n", field->name,
+             old_field->type, old_field->size, field->type, field->size);
+    }
+  }
+  GameEndTemporaryMemory(temp);
+  printf("migrated GameState: %u of %u fields kept, %u -> %u bytes in %.3f ms\n",
+         kept, to->state_field_count, from->state_size, to->state_size,
+         (GetNanoseconds() - start) / 1e6);
+  return true;
 }
 
 #define FILE_OK 0
@@ -468,102 +928,669 @@ PLATFORM_DRAW_BOXES(DrawBoxes)
   SDL_SetRenderDrawColor(state.renderer, 0, 0, 0, 0);
 }
 
-void sdl_create_texture(char *image_path, unsigned int texture_id) {
-  SDL_Surface* surface = IMG_Load(image_path);
-  if (texture_id >= MAX_SURFACES) {
-    printf("texture ID exceeds range: 0 < %d < %d", texture_id, MAX_SURFACES);
-  }
-  if (state.textures[texture_id] != NULL) {
-    // free this texture
-    SDL_DestroyTexture(state.textures[texture_id]);
-    state.textures[texture_id] = NULL;
-  }
-  state.textures[texture_id] = SDL_CreateTextureFromSurface(state.renderer, surface);
-  SDL_FreeSurface(surface);
+// Join a directory and a file name on the scratch stack. Call between
+// GameBeginTemporaryMemory and GameEndTemporaryMemory.
+char *ScratchPath(const char *dir, const char *filename)
+{
+  size_t size = strlen(dir) + 1 + strlen(filename) + 1; // "/" and terminator
+  char *path = (char *)GameAllocateMemory(&state.scratch, size,
+                                          MEMORY_TAG_SCRATCH);
+  snprintf(path, size, "%s/%s", dir, filename);
+  return path;
 }
 
-PLATFORM_ENSURE_IMAGE(EnsureImage)
+// Decode to the renderer's usual format here, so the upload on the frame
+// loop is a copy
+SDL_Surface *DecodeImage(const char *path)
 {
-  int imagePathLength = strlen(IMAGES_DIR)+strlen(filename) + 1; // +1 for the "/"
-  size_t imagePathSize = imagePathLength * sizeof(char)+ 1; // +1 for null terminator
-  char *imagePath = (char *) malloc(imagePathSize);
-  snprintf(imagePath, imagePathSize, "%s/%s", IMAGES_DIR, filename);
-  sdl_create_texture(imagePath, texture_id);
-  free(imagePath);
-  return ;
+  SDL_Surface *surface = IMG_Load(path);
+  if (!surface) {
+    fprintf(stderr, "failed to load %s: %s\n", path, IMG_GetError());
+    return NULL;
+  }
+  SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+  SDL_FreeSurface(surface);
+  return converted;
 }
 
-PLATFORM_DRAW_TEXTURE(DrawTexture)
+void *LoadSound(uint8_t kind, const char *path)
 {
-  SDL_Rect srcrect = {sprite_x, sprite_y, sprite_w, sprite_h};
-  SDL_Rect dstrect = {x, y, width, height};
-  SDL_RenderCopy(state.renderer, state.textures[texture_index], &srcrect, &dstrect);
+  return kind == ASSET_AUDIO ? (void *)Mix_LoadWAV(path) : (void *)Mix_LoadMUS(path);
 }
 
-PLATFORM_CREATE_WINDOW(CreateWindow) {
-  int index = MAX_WINDOWS;
-  if (state.window_count > MAX_WINDOWS) {
-    return index;
+void OpenPack(const char *file)
+{
+  Pack *pack = &state.pack;
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    Die("failed to open %s: %s\n", file, strerror(errno));
   }
-  
-  SDL_Window *new_win = SDL_CreateWindow(title,
-					 x, y, width, height,
-					 SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-  if(!new_win) {
-    Die("Failed to create window: %s\n", SDL_GetError());
+  void *base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    Die("failed to map %s: %s\n", file, strerror(errno));
   }
-  state.windows[state.window_count] = new_win;
-  
-  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-  index = state.window_count;
-  state.window_count++;
-  state.renderer = SDL_CreateRenderer(new_win, -1, SDL_RENDERER_ACCELERATED);
-  return index;
-}
-
-void sdl_load_audio(int audioIndex, const char *audioPath)
-{
-  Mix_Chunk *chunk = Mix_LoadWAV(audioPath);
-  if (!chunk) {
-    Die("failed to load audio %s: %s\n", audioPath, Mix_GetError());
+  const PackHeader *header = base;
+  size_t size = info.st_size;
+  bool valid = size >= sizeof(PackHeader) && header->magic == PACK_MAGIC &&
+               header->version == PACK_VERSION && header->size == size &&
+               header->table_size && !(header->table_size & (header->table_size - 1)) &&
+               header->entry_count * 2 <= header->table_size &&
+               sizeof(PackHeader) + (uint64_t)header->table_size * sizeof(PackEntry) <= size;
+  PackEntry *table = (PackEntry *)(header + 1);
+  for (uint32_t e = 0; valid && e < header->table_size; e++) {
+    valid = !table[e].hash || (table[e].offset % PACK_ALIGN == 0 &&
+                               table[e].offset <= size && table[e].size <= size - table[e].offset);
   }
-  if (NULL != state.audio[audioIndex].chunk) {
-    Mix_FreeChunk(state.audio[audioIndex].chunk);
-  } else {
-    state.audio[audioIndex].channel = state.channel_count++;
+  if (!valid) {
+    Die("%s is not a version %d pack, rebuild it with scripts/build_pack.sh\n",
+        file, PACK_VERSION);
   }
-  state.audio[audioIndex].chunk = chunk;
-}
+  pack->base = base;
+  pack->size = size;
+  pack->table = table;
+  pack->table_size = header->table_size;
 
-void sdl_load_music(int musicIndex, const char *musicPath)
-{
-  Mix_Music *music;
-  music = Mix_LoadMUS(musicPath);
-  if(!music) {
-    Die("failed to load music %s: %s\n", musicPath, Mix_GetError());
-  }
-  if (NULL != state.music[musicIndex].music) {
-    Mix_FreeMusic(state.music[musicIndex].music);
-  } else {
-    state.music[musicIndex].track = state.track_count++;
+  // Audio is only usable as it is if the device gave us the format asked for
+  int frequency, channels;
+  Uint16 format;
+  pack->audio = Mix_QuerySpec(&frequency, &format, &channels) &&
+                frequency == (int)header->audio_frequency &&
+                format == header->audio_format && channels == header->audio_channels;
+  printf("mapped %u assets from %s\n", header->entry_count, file);
+  if (!pack->audio) {
+    printf("the mixer is not in %s's audio format, loading audio from %s\n", file, AUDIO_DIR);
   }
-  state.music[musicIndex].music = music;
 }
 
-PLATFORM_ENSURE_AUDIO(EnsureAudio)
+// The entry for a loose path, NULL if there is no pack or it is not in it
+const PackEntry *FindPacked(uint32_t kind, const char *path)
 {
-  printf("file(%s), channel(%d)\n", filename, channel);
-  int audioPathLength = strlen(AUDIO_DIR)+strlen(filename) + 1;
-  char *audioPath = (char *) malloc(audioPathLength * sizeof(char));
-  snprintf(audioPath, audioPathLength*sizeof(char), "%s/%s", AUDIO_DIR, filename);
-  sdl_load_audio(channel, audioPath);
-  free(audioPath);
+  Pack *pack = &state.pack;
+  if (!pack->base) {
+    return NULL;
+  }
+  const PackEntry *entry = PackSlot(pack->table, pack->table_size, PackHash(path));
+  return entry->hash && entry->kind == kind ? entry : NULL;
 }
 
-PLATFORM_PLAY_AUDIO(PlayAudio)
+int RunAssetDecoder(void *data)
 {
-  int result = 0;
-  printf("channel(%d), fade(%d), loops(%d), volume(%d), duration(%d)\n",
+  AssetLoader *loader = data;
+  SDL_LockMutex(loader->lock);
+  for (;;) {
+    while (loader->running && loader->job_head == loader->job_tail) {
+      SDL_CondWait(loader->work, loader->lock);
+    }
+    if (!loader->running) {
+      break;
+    }
+    AssetJob job = loader->jobs[loader->job_tail++ % MAX_ASSET_JOBS];
+    if (job.kind != ASSET_IMAGE) {
+      // The frame loop checks the generation when it swaps it in
+      SDL_UnlockMutex(loader->lock);
+      void *sound = LoadSound(job.kind, job.path);
+      SDL_LockMutex(loader->lock);
+      loader->reloads[loader->reload_count++] =
+        (AssetReload){job.kind, job.index, job.generation, sound};
+      continue;
+    }
+    if (loader->slots[job.index].generation != job.generation) {
+      continue;
+    }
+    SDL_UnlockMutex(loader->lock);
+    SDL_Surface *surface = DecodeImage(job.path);
+    SDL_LockMutex(loader->lock);
+    TextureSlot *slot = &loader->slots[job.index];
+    if (slot->generation != job.generation) {
+      // Ensured again while decoding, a newer job has it
+      SDL_FreeSurface(surface);
+      continue;
+    }
+    slot->surface = surface;
+    slot->status = IMAGE_DECODED;
+    loader->decoded++;
+  }
+  SDL_UnlockMutex(loader->lock);
+  return 0;
+}
+
+void StartAssetLoader()
+{
+  AssetLoader *loader = &state.assets;
+  loader->lock = SDL_CreateMutex();
+  loader->work = SDL_CreateCond();
+  if (!loader->lock || !loader->work) {
+    Die("failed to create the asset loader's lock: %s\n", SDL_GetError());
+  }
+  uint32_t threads = state.config.asset_threads;
+  if (!threads) {
+    threads = MAX(1, SDL_GetCPUCount() - 1);
+  }
+  loader->running = true;
+  for (uint32_t t = 0; t < MIN(threads, MAX_ASSET_THREADS); t++) {
+    SDL_Thread *thread = SDL_CreateThread(RunAssetDecoder, "asset decoder", loader);
+    if (thread) {
+      loader->threads[loader->thread_count++] = thread;
+    }
+  }
+  if (!loader->thread_count) {
+    printf("failed to start asset decoders, loading assets on the frame loop: %s\n",
+           SDL_GetError());
+  }
+}
+
+void StopAssetLoader()
+{
+  AssetLoader *loader = &state.assets;
+  if (!loader->thread_count) {
+    return;
+  }
+  SDL_LockMutex(loader->lock);
+  loader->running = false;
+  SDL_CondBroadcast(loader->work);
+  SDL_UnlockMutex(loader->lock);
+  for (uint32_t t = 0; t < loader->thread_count; t++) {
+    SDL_WaitThread(loader->threads[t], NULL);
+  }
+  loader->thread_count = 0;
+}
+
+// Reloads of files changed on disk skip the pack
+void LoadImage(const char *filename, uint32_t texture_id, bool use_pack)
+{
+  AssetLoader *loader = &state.assets;
+  if (texture_id >= MAX_SURFACES) {
+    printf("texture ID exceeds range: 0 < %d < %d\n", texture_id, MAX_SURFACES);
+    return;
+  }
+  if (!loader->outstanding++) {
+    loader->burst_start_ns = GetNanoseconds();
+    loader->burst_count = 0;
+  }
+  loader->burst_count++;
+
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  const char *path = ScratchPath(IMAGES_DIR, filename);
+  const PackEntry *packed = use_pack ? FindPacked(PACK_IMAGE, path) : NULL;
+  SDL_LockMutex(loader->lock);
+  TextureSlot *slot = &loader->slots[texture_id];
+  if (slot->status == IMAGE_DECODED) {
+    // Superseded before it was uploaded
+    SDL_FreeSurface(slot->surface);
+    slot->surface = NULL;
+    loader->decoded--;
+    loader->outstanding--;
+    loader->burst_count--;
+  } else if (slot->status == TEXTURE_PENDING) {
+    loader->outstanding--;
+    loader->burst_count--;
+  }
+  slot->generation++;
+  slot->status = TEXTURE_PENDING;
+  snprintf(slot->filename, sizeof(slot->filename), "%s", filename);
+  bool queued = !packed && loader->thread_count &&
+                loader->job_head - loader->job_tail < MAX_ASSET_JOBS;
+  if (queued) {
+    AssetJob *job = &loader->jobs[loader->job_head++ % MAX_ASSET_JOBS];
+    job->kind = ASSET_IMAGE;
+    job->index = texture_id;
+    job->generation = slot->generation;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    SDL_CondSignal(loader->work);
+  }
+  SDL_UnlockMutex(loader->lock);
+
+  if (!queued) {
+    // Packed images are already in the texture format and only need a
+    // surface around them. Otherwise there are no decoders or too many
+    // loads at once, so it is decoded here instead.
+    SDL_Surface *surface = packed ?
+      SDL_CreateRGBSurfaceWithFormatFrom(state.pack.base + packed->offset, packed->width,
+                                         packed->height, 32, packed->pitch,
+                                         SDL_PIXELFORMAT_ARGB8888) :
+      DecodeImage(path);
+    SDL_LockMutex(loader->lock);
+    slot->surface = surface;
+    slot->status = IMAGE_DECODED;
+    loader->decoded++;
+    SDL_UnlockMutex(loader->lock);
+  }
+  GameEndTemporaryMemory(temp);
+}
+
+PLATFORM_ENSURE_IMAGE(EnsureImage)
+{
+  LoadImage(filename, texture_id, true);
+}
+
+PLATFORM_GET_TEXTURE_STATE(GetTextureState)
+{
+  if (texture_id >= MAX_SURFACES) {
+    return TEXTURE_EMPTY;
+  }
+  int status = __atomic_load_n(&state.assets.slots[texture_id].status, __ATOMIC_ACQUIRE);
+  return status == IMAGE_DECODED ? TEXTURE_PENDING : status;
+}
+
+// Lowest y a w by h rect can sit at with its left edge on node i, -1 if it
+// does not fit. The nodes always span the whole page.
+int SkylineFit(AtlasPage *page, uint32_t i, int w, int h, int size)
+{
+  if (page->nodes[i].x + w > size) {
+    return -1;
+  }
+  int y = 0;
+  for (int left = w; left > 0; left -= page->nodes[i++].width) {
+    y = MAX(y, page->nodes[i].y);
+    if (y + h > size) {
+      return -1;
+    }
+  }
+  return y;
+}
+
+// Bottom left skyline packing: the rect goes where its top ends up lowest,
+// on the narrowest node on a tie
+bool SkylinePlace(AtlasPage *page, int w, int h, int size, SDL_Rect *rect)
+{
+  int best = -1;
+  int best_top = INT32_MAX;
+  int best_width = INT32_MAX;
+  for (uint32_t i = 0; i < page->node_count; i++) {
+    int y = SkylineFit(page, i, w, h, size);
+    if (y >= 0 && (y + h < best_top ||
+                   (y + h == best_top && page->nodes[i].width < best_width))) {
+      best = i;
+      best_top = y + h;
+      best_width = page->nodes[i].width;
+    }
+  }
+  if (best < 0 || page->node_count == MAX_SKYLINE_NODES) {
+    return false;
+  }
+  SkylineNode *nodes = page->nodes;
+  *rect = (SDL_Rect){nodes[best].x, best_top - h, w, h};
+  memmove(&nodes[best + 1], &nodes[best], (page->node_count - best) * sizeof(SkylineNode));
+  nodes[best] = (SkylineNode){rect->x, best_top, w};
+  page->node_count++;
+
+  // Cut back what the new node covers
+  int right = rect->x + w;
+  uint32_t i = best + 1;
+  while (i < page->node_count && nodes[i].x < right) {
+    int covered = right - nodes[i].x;
+    if (covered < nodes[i].width) {
+      nodes[i].x += covered;
+      nodes[i].width -= covered;
+      break;
+    }
+    memmove(&nodes[i], &nodes[i + 1], (page->node_count - i - 1) * sizeof(SkylineNode));
+    page->node_count--;
+  }
+  // And join neighbours at the same height
+  for (i = 0; i + 1 < page->node_count;) {
+    if (nodes[i].y == nodes[i + 1].y) {
+      nodes[i].width += nodes[i + 1].width;
+      memmove(&nodes[i + 1], &nodes[i + 2], (page->node_count - i - 2) * sizeof(SkylineNode));
+      page->node_count--;
+    } else {
+      i++;
+    }
+  }
+  return true;
+}
+
+AtlasPage *AddAtlasPage()
+{
+  Atlas *atlas = &state.atlas;
+  int size = state.config.atlas_size;
+  if (atlas->page_count == MAX_ATLAS_PAGES) {
+    return NULL;
+  }
+  SDL_Texture *texture = SDL_CreateTexture(state.renderer, SDL_PIXELFORMAT_ARGB8888,
+                                           SDL_TEXTUREACCESS_STATIC, size, size);
+  if (!texture) {
+    printf("failed to create a %dx%d atlas page: %s\n", size, size, SDL_GetError());
+    return NULL;
+  }
+  SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+  // The gaps between images are transparent
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  size_t bytes = (size_t)size * size * 4;
+  void *clear = GameAllocateMemory(&state.scratch, bytes, MEMORY_TAG_SCRATCH);
+  memset(clear, 0, bytes);
+  SDL_UpdateTexture(texture, NULL, clear, size * 4);
+  GameEndTemporaryMemory(temp);
+
+  AtlasPage *page = &atlas->pages[atlas->page_count++];
+  page->texture = texture;
+  page->nodes[0] = (SkylineNode){0, 0, size};
+  page->node_count = 1;
+  printf("added atlas page %u, %dx%d\n", atlas->page_count - 1, size, size);
+  return page;
+}
+
+// Copies a decoded image into an atlas page. A reload the same size goes
+// back where it was; otherwise the old space is not reused.
+bool AddToAtlas(TextureSlot *slot, SDL_Surface *surface)
+{
+  Atlas *atlas = &state.atlas;
+  int size = state.config.atlas_size;
+  if (!size || surface->w > MIN(ATLAS_MAX_IMAGE, size) ||
+      surface->h > MIN(ATLAS_MAX_IMAGE, size)) {
+    return false;
+  }
+  SDL_Rect rect = slot->region;
+  uint32_t p = slot->atlas_page;
+  if (!slot->in_atlas || rect.w != surface->w || rect.h != surface->h) {
+    for (p = 0; p < atlas->page_count; p++) {
+      if (SkylinePlace(&atlas->pages[p], surface->w + ATLAS_PADDING,
+                       surface->h + ATLAS_PADDING, size, &rect)) {
+        break;
+      }
+    }
+    if (p == atlas->page_count) {
+      AtlasPage *page = AddAtlasPage();
+      if (!page || !SkylinePlace(page, surface->w + ATLAS_PADDING,
+                                 surface->h + ATLAS_PADDING, size, &rect)) {
+        return false;
+      }
+    }
+    rect.w = surface->w;
+    rect.h = surface->h;
+  }
+  if (SDL_UpdateTexture(atlas->pages[p].texture, &rect, surface->pixels, surface->pitch) != 0) {
+    return false;
+  }
+  if (slot->texture && !slot->in_atlas) {
+    SDL_DestroyTexture(slot->texture);
+  }
+  slot->texture = atlas->pages[p].texture;
+  slot->region = rect;
+  slot->in_atlas = true;
+  slot->atlas_page = p;
+  return true;
+}
+
+bool UploadOwnTexture(TextureSlot *slot, SDL_Surface *surface)
+{
+  SDL_Texture *texture = SDL_CreateTextureFromSurface(state.renderer, surface);
+  if (!texture) {
+    return false;
+  }
+  if (slot->texture && !slot->in_atlas) {
+    SDL_DestroyTexture(slot->texture);
+  }
+  slot->texture = texture;
+  slot->region = (SDL_Rect){0, 0, surface->w, surface->h};
+  slot->in_atlas = false;
+  return true;
+}
+
+// Upload up to --texture-uploads decoded images. Called once a frame,
+// before rendering.
+void UploadTextures()
+{
+  AssetLoader *loader = &state.assets;
+  if (!__atomic_load_n(&loader->decoded, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  TIMED_FUNCTION();
+  uint32_t ids[MAX_SURFACES];
+  SDL_Surface *surfaces[MAX_SURFACES];
+  uint32_t count = 0;
+  SDL_LockMutex(loader->lock);
+  for (uint32_t id = 0; id < MAX_SURFACES && count < state.config.texture_uploads; id++) {
+    TextureSlot *slot = &loader->slots[id];
+    if (slot->status == IMAGE_DECODED) {
+      ids[count] = id;
+      surfaces[count++] = slot->surface;
+      slot->surface = NULL;
+      slot->status = TEXTURE_PENDING;
+      loader->decoded--;
+    }
+  }
+  SDL_UnlockMutex(loader->lock);
+
+  // Only the frame loop ensures images, so nothing can replace these
+  // while they upload
+  for (uint32_t i = 0; i < count; i++) {
+    TextureSlot *slot = &loader->slots[ids[i]];
+    bool uploaded = surfaces[i] &&
+      (AddToAtlas(slot, surfaces[i]) || UploadOwnTexture(slot, surfaces[i]));
+    SDL_FreeSurface(surfaces[i]);
+    __atomic_store_n(&slot->status, uploaded ? TEXTURE_READY : TEXTURE_FAILED, __ATOMIC_RELEASE);
+    loader->outstanding--;
+  }
+  if (count && !loader->outstanding) {
+    printf("loaded %u images on %u threads in %.1f ms\n", loader->burst_count,
+           loader->thread_count, (GetNanoseconds() - loader->burst_start_ns) / 1e6);
+  }
+}
+
+// Textures that are not in yet are drawn as a grey box, failed ones as a
+// magenta one
+PLATFORM_GET_TEXTURE_REGION(GetTextureRegion)
+{
+  if (GetTextureState(texture_id) != TEXTURE_READY) {
+    return false;
+  }
+  TextureSlot *slot = &state.assets.slots[texture_id];
+  float width = slot->region.w;
+  float height = slot->region.h;
+  if (slot->in_atlas) {
+    width = height = state.config.atlas_size;
+  }
+  region->atlas = slot->in_atlas ? slot->atlas_page : ATLAS_NONE;
+  region->u0 = slot->region.x / width;
+  region->v0 = slot->region.y / height;
+  region->u1 = (slot->region.x + slot->region.w) / width;
+  region->v1 = (slot->region.y + slot->region.h) / height;
+  region->width = slot->region.w;
+  region->height = slot->region.h;
+  return true;
+}
+
+PLATFORM_DRAW_TEXTURE(DrawTexture)
+{
+  TextureSlot *slot = texture_index < MAX_SURFACES ? &state.assets.slots[texture_index] : NULL;
+  SDL_Texture *texture = slot ? slot->texture : NULL;
+  if (!texture) {
+    bool failed = GetTextureState(texture_index) == TEXTURE_FAILED;
+    SDL_FRect placeholder = {x, y, width, height};
+    SDL_SetRenderDrawColor(state.renderer, failed ? 255 : 96, failed ? 0 : 96,
+                           failed ? 255 : 96, 255);
+    SDL_RenderFillRectF(state.renderer, &placeholder);
+    SDL_SetRenderDrawColor(state.renderer, 0, 0, 0, 0);
+    return;
+  }
+  SDL_Rect sprite = {slot->region.x + sprite_x, slot->region.y + sprite_y, sprite_w, sprite_h};
+  SDL_Rect srcrect = sprite;
+  SDL_FRect dstrect = {x, y, width, height};
+  if (slot->in_atlas) {
+    if (!SDL_IntersectRect(&sprite, &slot->region, &srcrect)) {
+      // Nothing of this image, and its neighbours are not to be drawn
+      return;
+    }
+    // What was cut off the sprite is cut off the destination too, so the
+    // rest draws at the same scale and place as with a texture of its own
+    float scale_x = width / sprite.w;
+    float scale_y = height / sprite.h;
+    dstrect.x += (srcrect.x - sprite.x) * scale_x;
+    dstrect.y += (srcrect.y - sprite.y) * scale_y;
+    dstrect.w = srcrect.w * scale_x;
+    dstrect.h = srcrect.h * scale_y;
+  }
+  SDL_RenderCopyF(state.renderer, texture, &srcrect, &dstrect);
+}
+
+PLATFORM_CREATE_WINDOW(CreateWindow) {
+  int index = MAX_WINDOWS;
+  if (state.window_count > MAX_WINDOWS) {
+    return index;
+  }
+  
+  uint32_t window_flags = SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE;
+  uint32_t renderer_flags = SDL_RENDERER_ACCELERATED;
+  if (state.config.headless) {
+    window_flags = SDL_WINDOW_HIDDEN;
+    renderer_flags = SDL_RENDERER_SOFTWARE;
+  } else {
+    window_flags |= SDL_WINDOW_SHOWN;
+  }
+  SDL_Window *new_win = SDL_CreateWindow(title,
+					 x, y, width, height,
+					 window_flags);
+  if(!new_win) {
+    Die("Failed to create window: %s\n", SDL_GetError());
+  }
+  state.windows[state.window_count] = new_win;
+  
+  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  index = state.window_count;
+  state.window_count++;
+  if (state.config.frame_pacing == PACING_VSYNC) {
+    renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+  }
+  state.renderer = SDL_CreateRenderer(new_win, -1, renderer_flags);
+  return index;
+}
+
+void sdl_load_audio(int audioIndex, const char *audioPath)
+{
+  // Packed audio is played from the mapping, which outlives the chunk
+  const PackEntry *packed = state.pack.audio ? FindPacked(PACK_AUDIO, audioPath) : NULL;
+  Mix_Chunk *chunk = packed ?
+    Mix_QuickLoad_RAW(state.pack.base + packed->offset, packed->size) :
+    Mix_LoadWAV(audioPath);
+  if (!chunk) {
+    Die("failed to load audio %s: %s\n", audioPath, Mix_GetError());
+  }
+  if (NULL != state.audio[audioIndex].chunk) {
+    Mix_FreeChunk(state.audio[audioIndex].chunk);
+  } else {
+    state.audio[audioIndex].channel = state.channel_count++;
+  }
+  state.audio[audioIndex].chunk = chunk;
+}
+
+void sdl_load_music(int musicIndex, const char *musicPath)
+{
+  const PackEntry *packed = FindPacked(PACK_MUSIC, musicPath);
+  Mix_Music *music = packed ?
+    Mix_LoadMUS_RW(SDL_RWFromConstMem(state.pack.base + packed->offset, packed->size), 1) :
+    Mix_LoadMUS(musicPath);
+  if(!music) {
+    Die("failed to load music %s: %s\n", musicPath, Mix_GetError());
+  }
+  if (NULL != state.music[musicIndex].music) {
+    Mix_FreeMusic(state.music[musicIndex].music);
+  } else {
+    state.music[musicIndex].track = state.track_count++;
+  }
+  state.music[musicIndex].music = music;
+}
+
+// Frees the old chunk or track, which SDL_mixer stops first if it is
+// playing. Music that was playing starts over with the new track.
+void SwapSound(uint8_t kind, uint32_t index, uint32_t generation, void *sound)
+{
+  if (kind == ASSET_AUDIO) {
+    Audio *audio = &state.audio[index];
+    if (generation != audio->generation) {
+      Mix_FreeChunk(sound);
+    } else if (!sound) {
+      printf("failed to reload %s/%s, keeping the one loaded\n", AUDIO_DIR, audio->filename);
+    } else {
+      Mix_FreeChunk(audio->chunk);
+      audio->chunk = sound;
+      printf("reloaded %s/%s into channel %u\n", AUDIO_DIR, audio->filename, index);
+    }
+    return;
+  }
+  Music *music = &state.music[index];
+  if (generation != music->generation) {
+    Mix_FreeMusic(sound);
+  } else if (!sound) {
+    printf("failed to reload %s/%s, keeping the one loaded\n", MUSIC_DIR, music->filename);
+  } else {
+    bool playing = state.playing_music == music && Mix_PlayingMusic();
+    Mix_FreeMusic(music->music);
+    music->music = sound;
+    if (playing) {
+      Mix_PlayMusic(music->music, state.playing_loops);
+    }
+    printf("reloaded %s/%s into track %u\n", MUSIC_DIR, music->filename, index);
+  }
+}
+
+// Loads a changed audio or music file on the decoders, or here if they
+// are busy or missing; what is loaded now keeps playing until the swap
+void QueueSoundReload(uint8_t kind, uint32_t index, const char *filename)
+{
+  AssetLoader *loader = &state.assets;
+  const char *dir = kind == ASSET_AUDIO ? AUDIO_DIR : MUSIC_DIR;
+  uint32_t generation = kind == ASSET_AUDIO ?
+    ++state.audio[index].generation : ++state.music[index].generation;
+  SDL_LockMutex(loader->lock);
+  bool queued = loader->thread_count && loader->reloads_queued < MAX_ASSET_JOBS &&
+                loader->job_head - loader->job_tail < MAX_ASSET_JOBS;
+  if (queued) {
+    AssetJob *job = &loader->jobs[loader->job_head++ % MAX_ASSET_JOBS];
+    job->kind = kind;
+    job->index = index;
+    job->generation = generation;
+    snprintf(job->path, sizeof(job->path), "%s/%s", dir, filename);
+    loader->reloads_queued++;
+    SDL_CondSignal(loader->work);
+  }
+  SDL_UnlockMutex(loader->lock);
+
+  if (!queued) {
+    GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+    void *sound = LoadSound(kind, ScratchPath(dir, filename));
+    GameEndTemporaryMemory(temp);
+    SwapSound(kind, index, generation, sound);
+  }
+}
+
+// Swaps in the audio and music the decoders have finished. Called between
+// frames.
+void SwapReloadedSounds()
+{
+  AssetLoader *loader = &state.assets;
+  if (!__atomic_load_n(&loader->reload_count, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  AssetReload reloads[MAX_ASSET_JOBS];
+  SDL_LockMutex(loader->lock);
+  uint32_t count = loader->reload_count;
+  memcpy(reloads, loader->reloads, count * sizeof(AssetReload));
+  loader->reload_count = 0;
+  loader->reloads_queued -= count;
+  SDL_UnlockMutex(loader->lock);
+  for (uint32_t r = 0; r < count; r++) {
+    SwapSound(reloads[r].kind, reloads[r].index, reloads[r].generation, reloads[r].data);
+  }
+}
+
+PLATFORM_ENSURE_AUDIO(EnsureAudio)
+{
+  printf("file(%s), channel(%d)\n", filename, channel);
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  sdl_load_audio(channel, ScratchPath(AUDIO_DIR, filename));
+  GameEndTemporaryMemory(temp);
+  // Supersedes a reload still in flight
+  state.audio[channel].generation++;
+  snprintf(state.audio[channel].filename, ASSET_NAME_SIZE, "%s", filename);
+}
+
+PLATFORM_PLAY_AUDIO(PlayAudio)
+{
+  int result = 0;
+  printf("channel(%d), fade(%d), loops(%d), volume(%d), duration(%d)\n",
 	 channel, fade, loops, volume, duration);
   if (volume) {
     Mix_Volume(channel, volume);
@@ -610,29 +1637,31 @@ PLATFORM_STOP_AUDIO(StopAudio)
 }
 
 void channelDone(int channel) {
-  if (state.game_code.game_channel_halted)
-    state.game_code.game_channel_halted(channel);
+  if (state.game_code.api.game_channel_halted)
+    state.game_code.api.game_channel_halted(channel);
 }
 
 PLATFORM_ENSURE_MUSIC(EnsureMusic)
 {
   printf("file(%s), channel(%d)\n", filename, track);
-  int audioPathLength = strlen(MUSIC_DIR)+strlen(filename) + 1;
-  char *audioPath = (char *) malloc(audioPathLength * sizeof(char));
-  snprintf(audioPath, audioPathLength*sizeof(char), "%s/%s", MUSIC_DIR, filename);
-  sdl_load_music(track, audioPath);
-  free(audioPath);
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  sdl_load_music(track, ScratchPath(MUSIC_DIR, filename));
+  GameEndTemporaryMemory(temp);
+  state.music[track].generation++;
+  snprintf(state.music[track].filename, ASSET_NAME_SIZE, "%s", filename);
 }
 
 void musicDone() {
-  if (state.game_code.game_music_halted)
-    state.game_code.game_music_halted();
+  if (state.game_code.api.game_music_halted)
+    state.game_code.api.game_music_halted();
 }
 
 PLATFORM_PLAY_MUSIC(PlayMusic)
 {
   printf("play %d fade(%d), loops(%d), position(%f), volume(%d), resume(%d)\n",
 	 track, fade, loops, position, volume, resume);
+  state.playing_music = &state.music[track];
+  state.playing_loops = loops;
   Mix_VolumeMusic(volume);
   if (fade) {
     if (position > 0) {
@@ -686,9 +1715,14 @@ PLATFORM_SCREENSHOT(Screenshot)
   char output_file_path[40];
   snprintf(output_file_path, sizeof(output_file_path), "%s/screenshot_%d.png",
 	   SCREENSHOTS_DIR, (int)time(NULL));
-  // Allocate storage for the screen bytes
-  screen_bytes = (unsigned char *)malloc(image_data_size);
-  image_bytes = (unsigned char *)malloc(image_data_size);
+  // Storage for the screen bytes comes from the scratch stack
+  GameTemporaryMemory temp = GameBeginTemporaryMemory(&state.scratch);
+  screen_bytes = (unsigned char *)GameAllocateMemory(&state.scratch,
+                                                     image_data_size,
+                                                     MEMORY_TAG_SCRATCH);
+  image_bytes = (unsigned char *)GameAllocateMemory(&state.scratch,
+                                                    image_data_size,
+                                                    MEMORY_TAG_SCRATCH);
   // Store the screen contents to a byte array
   // TODO: had to disable this for now as the opengl support was removed
   //glReadPixels(x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, screen_bytes);
@@ -711,44 +1745,64 @@ PLATFORM_SCREENSHOT(Screenshot)
   }
   printf("screenshot taken of window(%d): %s\n", window, output_file_path);
   SDL_FreeSurface(surface);
-  free(image_bytes);
-  free(screen_bytes);
+  GameEndTemporaryMemory(temp);
+}
+
+
+
+// A handle is the connection's block in the pool, MAX_SOCKETS for none
+unsigned int ConnectionHandle(Connection *connection)
+{
+  return ((uint8_t *)connection - state.sockets.blocks) / state.sockets.block_size;
 }
 
+Connection *GetConnection(unsigned int socket)
+{
+  if (socket >= state.sockets.used) {
+    printf("no socket %u\n", socket);
+    return NULL;
+  }
+  return (Connection *)(state.sockets.blocks + state.sockets.block_size * socket);
+}
 
+Connection *OpenConnection(uint8_t socket_type)
+{
+  Connection *connection = GamePoolAllocStruct(&state.sockets, Connection);
+  if (!connection) {
+    printf("socket count cannot exceed %d\n", MAX_SOCKETS);
+    return NULL;
+  }
+  memset(connection, 0, sizeof(*connection));
+  connection->socket_type = socket_type;
+  return connection;
+}
 
 PLATFORM_LISTEN_AND_SERVE(ListenAndServe)
 {
-  if (MAX_SOCKETS <= state.socket_count) {
-    printf("server count cannot exceed %d\n", MAX_SOCKETS);
+  Connection *connection = OpenConnection(socket_type);
+  if (!connection) {
+    return MAX_SOCKETS;
   }
-  unsigned int index = state.socket_count;
-  
-  memset(&state.sockets[index].address, 0, sizeof(IPaddress));
   for (int c=0; c<5; c++){
     switch(socket_type){
     case SOCKET_TCP:
-      if(SDLNet_ResolveHost(&state.sockets[index].address,NULL,port)==-1) {
+      if(SDLNet_ResolveHost(&connection->address,NULL,port)==-1) {
 	printf("SDLNet_ResolveHost: %s\n", SDLNet_GetError());
       }
-      state.sockets[index].socket.tcp = SDLNet_TCP_Open(&state.sockets[index].address);
-      if (state.sockets[index].socket.tcp) {
-	state.socket_count++;
-	return index;
+      connection->socket.tcp = SDLNet_TCP_Open(&connection->address);
+      if (connection->socket.tcp) {
+	return ConnectionHandle(connection);
       }
       break;
     case SOCKET_UDP:
-      state.sockets[index].socket.udp = SDLNet_UDP_Open(port);
-      if (state.sockets[index].socket.udp) {
-	int channel = SDLNet_UDP_Bind(state.sockets[index].socket.udp,
-				      -1, &state.sockets[index].address);
-	if(channel==-1) {
+      connection->socket.udp = SDLNet_UDP_Open(port);
+      if (connection->socket.udp) {
+	connection->channel = SDLNet_UDP_Bind(connection->socket.udp,
+					      -1, &connection->address);
+	if(connection->channel==-1) {
 	  printf("SDLNet_UDP_Bind: %s\n", SDLNet_GetError());
-	  return index;
 	}
-	state.sockets[index].channel = channel;
-	state.socket_count++;
-	return index;
+	return ConnectionHandle(connection);
       }
       break;
     default:
@@ -757,96 +1811,249 @@ PLATFORM_LISTEN_AND_SERVE(ListenAndServe)
   }
   printf("failed to create %s server socket listening on port %d\n",
 	 socket_type == SOCKET_TCP ? "TCP" : "UDP", port);
+  GamePoolFree(&state.sockets, connection);
   return MAX_SOCKETS;
 }
 
 PLATFORM_CONNECT_TO_SERVER(ConnectToServer)
 {
-  unsigned int index = state.socket_count;
-  memset(&state.sockets[index].address, 0, sizeof(IPaddress));
+  Connection *connection = OpenConnection(socket_type);
+  if (!connection) {
+    return MAX_SOCKETS;
+  }
   switch(socket_type){
   case SOCKET_TCP:
     if (host != NULL) {
-      if(SDLNet_ResolveHost(&state.sockets[index].address,host,port)==-1) {
+      if(SDLNet_ResolveHost(&connection->address,host,port)==-1) {
 	printf("SDLNet_ResolveHost: %s\n", SDLNet_GetError());
       }
     }
-    state.sockets[index].socket.tcp = SDLNet_TCP_Open(&state.sockets[index].address);
-    if (state.sockets[index].socket.tcp) {
-      state.socket_count++;
-      return index;
+    connection->socket.tcp = SDLNet_TCP_Open(&connection->address);
+    if (connection->socket.tcp) {
+      return ConnectionHandle(connection);
     }
     break;
   case SOCKET_UDP:
-    state.sockets[index].socket.udp = SDLNet_UDP_Open(port);
-    if (state.sockets[index].socket.udp) {
-      state.socket_count++;
-      return index;
+    if (host != NULL &&
+        SDLNet_ResolveHost(&connection->address, host, port) == -1) {
+      printf("SDLNet_ResolveHost: %s\n", SDLNet_GetError());
+    }
+    connection->socket.udp = SDLNet_UDP_Open(0);
+    if (connection->socket.udp) {
+      // No bound channel, packets are addressed individually
+      connection->channel = -1;
+      return ConnectionHandle(connection);
     }
     break;
   }
+  GamePoolFree(&state.sockets, connection);
   return MAX_SOCKETS;
 }
 
+// UDP packets wrap the caller's buffer, nothing is allocated per call
 PLATFORM_NET_SEND(NetSend)
 {
-  UDPpacket *packet = NULL;
-  switch(state.sockets[socket].socket_type) {
+  UDPpacket packet;
+  Connection *connection = GetConnection(socket);
+  if (!connection) {
+    return;
+  }
+  switch(connection->socket_type) {
   case SOCKET_TCP:
-    if(SDLNet_TCP_Send(state.sockets[socket].socket.tcp, message, length) <= length) {
+    if(SDLNet_TCP_Send(connection->socket.tcp, message, length) < length) {
       printf("tcp send: %s\n", SDLNet_GetError());
     }
     break;
   case SOCKET_UDP:
-    packet = SDLNet_AllocPacket(length);
-    if(!packet) {
-      printf("failed to allocate packet: %s\n", SDLNet_GetError());
-    } else {
-      packet->data = (Uint8*)message;
-      if (!SDLNet_UDP_Send(state.sockets[socket].socket.udp, packet->channel, packet)){
-	printf("failed to send packet: no data sent\n");
-      }
+    memset(&packet, 0, sizeof(packet));
+    packet.channel = connection->channel;
+    packet.data = (Uint8*)message;
+    packet.len = length;
+    packet.maxlen = length;
+    packet.address = connection->address;
+    if (!SDLNet_UDP_Send(connection->socket.udp, packet.channel, &packet)){
+      printf("failed to send packet: no data sent\n");
     }
-    SDLNet_FreePacket(packet);
     break;
   }
 }
 
 PLATFORM_NET_RECV(NetRecv)
 {
-  UDPpacket *packet;
-
-  switch(state.sockets[socket].socket_type){
+  UDPpacket packet;
+  Connection *connection = GetConnection(socket);
+  if (!connection) {
+    return;
+  }
+  switch(connection->socket_type){
   case SOCKET_TCP:
-    if ( 0 >= SDLNet_TCP_Recv(state.sockets[socket].socket.tcp, received, length)) {
+    if ( 0 >= SDLNet_TCP_Recv(connection->socket.tcp, received, length)) {
       printf("no data received\n");
     }
     break;
   case SOCKET_UDP:  
-    packet = SDLNet_AllocPacket(length);
-    if(!packet) {
-      printf("failed to allocate packet: %s\n", SDLNet_GetError());
-    } else {
-      packet->data = (Uint8*)received;
-      if (!SDLNet_UDP_Recv(state.sockets[socket].socket.udp, packet)){
-	printf("failed to send packet: no data sent\n");
-      }
+    memset(&packet, 0, sizeof(packet));
+    packet.data = (Uint8*)received;
+    packet.maxlen = length;
+    if (SDLNet_UDP_Recv(connection->socket.udp, &packet) <= 0){
+      printf("no packet received\n");
     }
-    SDLNet_FreePacket(packet);
     break;
   }
 }
 
+// The handle may be given out again by the next open
 PLATFORM_CLOSE_CONNECTION(CloseConnection)
 {
-  switch(state.sockets[socket].socket_type) {
+  Connection *connection = GetConnection(socket);
+  if (!connection) {
+    return;
+  }
+  switch(connection->socket_type) {
   case SOCKET_TCP:
-    SDLNet_TCP_Close(state.sockets[socket].socket.tcp);
+    SDLNet_TCP_Close(connection->socket.tcp);
     break;
   case SOCKET_UDP:
-    SDLNet_UDP_Close(state.sockets[socket].socket.udp);
+    SDLNet_UDP_Close(connection->socket.udp);
     break;
   };
+  GamePoolFree(&state.sockets, connection);
+}
+
+// Write everything the game has allocated to a file. The file is
+// written through a shared mapping into a temporary name and renamed,
+// so a restored snapshot that is still mapped from the old file is
+// never modified underneath the game.
+bool SaveGameMemory(GameMemory *memory, const char *path)
+{
+  char temp_path[300];
+  double start = GetSeconds();
+  size_t used = memory->cursor - memory->ptr;
+  // Memory is stored page aligned after the header so it can be mapped
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t data_offset = (sizeof(SnapshotHeader) + page_size - 1) & ~(page_size - 1);
+  size_t file_size = data_offset + used;
+  SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                           (uintptr_t)memory->ptr, used, data_offset, memory->stats};
+
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("unable to open snapshot %s: %s\n", temp_path, strerror(errno));
+    return false;
+  }
+  if (ftruncate(fd, file_size) != 0) {
+    printf("unable to size snapshot %s: %s\n", temp_path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  uint8_t *file = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    printf("unable to map snapshot %s: %s\n", temp_path, strerror(errno));
+    return false;
+  }
+  memcpy(file, &header, sizeof(header));
+  memcpy(file + data_offset, memory->ptr, used);
+  munmap(file, file_size);
+
+  if (rename(temp_path, path) != 0) {
+    printf("unable to rename snapshot to %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  printf("saved %zu bytes of game memory to %s in %.3f ms\n",
+         used, path, (GetSeconds() - start) * 1000.0);
+  return true;
+}
+
+// Replace the used game memory with a snapshot. The file is mapped
+// copy-on-write over the block, so restoring costs a few page table
+// updates and the pages are read in as the game touches them.
+bool LoadGameMemory(GameMemory *memory, const char *path)
+{
+  SnapshotHeader header;
+  double start = GetSeconds();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("unable to open snapshot %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+    printf("%s is not a snapshot\n", path);
+    close(fd);
+    return false;
+  }
+  if (header.base != (uintptr_t)memory->ptr || header.used > memory->size) {
+    printf("snapshot %s was saved from %p (%zu bytes), game memory is at "
+           "%p (%zu bytes)\n", path, (void *)(uintptr_t)header.base,
+           (size_t)header.used, memory->ptr, memory->size);
+    close(fd);
+    return false;
+  }
+  // Pages of a mapping past the end of the file fault with SIGBUS when the
+  // game touches them, so a truncated snapshot is refused here
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || header.data_offset % page_size != 0 ||
+      header.data_offset < sizeof(header) ||
+      (uint64_t)file_stat.st_size < header.data_offset + header.used) {
+    printf("snapshot %s is truncated or was saved with another page size\n", path);
+    close(fd);
+    return false;
+  }
+
+  size_t mapped = (header.used + page_size - 1) & ~(page_size - 1);
+  uint8_t *end = memory->ptr + mapped;
+  if (end < memory->committed) {
+    end = memory->committed;
+  }
+  // Return the committed range to the reservation first, so it reads as
+  // zero past the snapshot and any huge page mapping is replaced whole
+  mmap(memory->ptr, end - memory->ptr, PROT_NONE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if (mapped &&
+      mmap(memory->ptr, mapped, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, header.data_offset) == MAP_FAILED) {
+    Die("failed to map snapshot %s: %s\n", path, strerror(errno));
+  }
+  close(fd);
+  memory->cursor = memory->ptr + header.used;
+  memory->committed = memory->ptr + mapped;
+  GameCommitMemory(memory);
+  // Live numbers come from the snapshot, peaks stay the highest seen
+  for (int t = 0; t < MEMORY_TAG_COUNT; t++) {
+    header.stats.peak[t] = MAX(header.stats.peak[t], memory->stats.peak[t]);
+  }
+  header.stats.peak_used = MAX(header.stats.peak_used, memory->stats.peak_used);
+  memory->stats = header.stats;
+  GameForgetMemorySites(&memory->stats);
+
+  printf("restored %zu bytes of game memory from %s in %.3f ms\n",
+         (size_t)header.used, path, (GetSeconds() - start) * 1000.0);
+  return true;
+}
+
+PLATFORM_SAVE_STATE(SaveState)
+{
+  snprintf(state.save_state_file, sizeof(state.save_state_file), "%s/%s",
+           SNAPSHOTS_DIR, filename);
+}
+
+PLATFORM_LOAD_STATE(LoadState)
+{
+  snprintf(state.load_state_file, sizeof(state.load_state_file), "%s/%s",
+           SNAPSHOTS_DIR, filename);
+}
+
+PLATFORM_GET_MEMORY_STATS(GetMemoryStats)
+{
+  GameMemory *memory = &state.game_memory;
+  *stats = memory->stats;
+  *used = memory->cursor - memory->ptr;
+  *committed = memory->committed - memory->ptr;
+  *reserved = memory->size;
 }
 
 PlatformAPI GetPlatformAPI()
@@ -857,6 +2064,8 @@ PlatformAPI GetPlatformAPI()
     api.PlatformDrawBoxes = DrawBoxes;
     api.PlatformDrawTexture = DrawTexture;
     api.PlatformEnsureImage = EnsureImage;
+    api.PlatformGetTextureState = GetTextureState;
+    api.PlatformGetTextureRegion = GetTextureRegion;
     api.PlatformScreenshot = Screenshot;
     // App
     api.PlatformQuit = QuitGame;
@@ -878,42 +2087,711 @@ PlatformAPI GetPlatformAPI()
     api.PlatformNetSend = NetSend;
     api.PlatformNetRecv = NetRecv;
     api.PlatformCloseConnection = CloseConnection;
+    // State
+    api.PlatformSaveState = SaveState;
+    api.PlatformLoadState = LoadState;
+    api.PlatformGetMemoryStats = GetMemoryStats;
+    // Debug
+    api.profiler = state.profiler;
     return api;
 }
 
-GameMemory AllocateGameMemory()
+// Reserve address space for the whole block without committing any
+// of it, then commit the hot region where GameState lives. The rest
+// is committed by GameAllocateMemory as the game grows into it.
+GameMemory AllocateGameMemory(PlatformConfig *config)
 {
     GameMemory result = {};
+    size_t hot_size = config->hot_memory_size;
+    // Whole huge pages are mapped even when the block ends part way into
+    // one, so the hot region can be rounded up and still fit
+    size_t mapped_size = (config->memory_size + HUGE_PAGE_SIZE - 1) &
+      ~((size_t)HUGE_PAGE_SIZE - 1);
+    size_t reserve_size = mapped_size + HUGE_PAGE_SIZE;
+    uint8_t *reservation;
+
+    if (hot_size > config->memory_size) {
+      hot_size = config->memory_size;
+    }
+    // Round the hot region up to whole huge pages
+    hot_size = (hot_size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
 
-    result.ptr = (uint8_t *)calloc(1, 1200000000);
-    result.size = 1200000000;
+    reservation = MAP_FAILED;
+    if (config->memory_base) {
+      // The base is huge page aligned already, no slack is needed
+      reservation = mmap((void *)config->memory_base, mapped_size,
+                         PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+                         MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+      if (reservation != MAP_FAILED &&
+          reservation != (uint8_t *)config->memory_base) {
+        // Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint
+        munmap(reservation, mapped_size);
+        reservation = MAP_FAILED;
+      }
+      if (reservation == MAP_FAILED) {
+        printf("unable to place game memory at %p, snapshots will not "
+               "be portable across runs\n", (void *)config->memory_base);
+      }
+    }
+    if (reservation == MAP_FAILED) {
+      reservation = mmap(NULL, reserve_size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (reservation == MAP_FAILED) {
+      Die("failed to reserve %zu bytes of game memory: %s\n",
+          config->memory_size, strerror(errno));
+    }
+    // Align the start to a huge page so the hot region can be backed by them
+    result.ptr = (uint8_t *)(((uintptr_t)reservation + HUGE_PAGE_SIZE - 1) &
+                             ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+    result.size = config->memory_size;
     result.cursor = result.ptr;
+    result.committed = result.ptr;
+
+    if (config->huge_pages == HUGE_PAGES_HUGETLB) {
+      void *hot = mmap(result.ptr, hot_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+                       -1, 0);
+      if (hot == MAP_FAILED) {
+        printf("MAP_HUGETLB unavailable (%s), falling back to madvise\n",
+               strerror(errno));
+        // MAP_FIXED may have already dropped the range; reserve it again
+        mmap(result.ptr, hot_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        config->huge_pages = HUGE_PAGES_MADVISE;
+      } else {
+        result.committed = result.ptr + hot_size;
+      }
+    }
+
+    if (result.committed == result.ptr) {
+      if (mprotect(result.ptr, hot_size, PROT_READ | PROT_WRITE) != 0) {
+        Die("failed to commit game memory: %s\n", strerror(errno));
+      }
+      result.committed = result.ptr + hot_size;
+      if (config->huge_pages == HUGE_PAGES_MADVISE &&
+          madvise(result.ptr, hot_size, MADV_HUGEPAGE) != 0) {
+        printf("MADV_HUGEPAGE failed: %s\n", strerror(errno));
+      }
+    }
 
     return result;
 }
 
-void GameLoop()
+// Reserve a block anywhere in the address space, it is committed as
+// it is allocated from
+GameMemory ReserveMemory(size_t size)
 {
-  for(;;) {
-    SDL_Event event;
-    while(SDL_PollEvent(&event)) {
-      switch (event.type) {
+  GameMemory result = {};
+  result.ptr = mmap(NULL, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (result.ptr == MAP_FAILED) {
+    Die("failed to reserve %zu bytes: %s\n", size, strerror(errno));
+  }
+  result.cursor = result.ptr;
+  result.committed = result.ptr;
+  result.size = size;
+  return result;
+}
 
-      // App closing
-      case SDL_QUIT:
-      case SDL_APP_TERMINATING:
-	if (state.game_code.game_quit)
-	  state.game_code.game_quit();
-	Quit();
-	break;
+size_t ParseSize(const char *value)
+{
+  char *end;
+  size_t size = strtoull(value, &end, 10);
+  switch (*end) {
+  case 'g': case 'G': size *= 1024; /* fall through */
+  case 'm': case 'M': size *= 1024; /* fall through */
+  case 'k': case 'K': size *= 1024;
+  }
+  return size;
+}
+
+void Usage(const char *name)
+{
+  printf("usage: %s [options]\n"
+         "  --memory-size SIZE      game memory to reserve (default %d, accepts K/M/G)\n"
+         "  --hot-memory-size SIZE  game memory committed at startup (default %d)\n"
+         "  --huge-pages MODE       off, madvise or hugetlb for the hot region (default off)\n"
+         "  --memory-base ADDR      fixed address of game memory, 0 for anywhere (default %#llx)\n"
+         "  --restore FILE          load a game memory snapshot before the first frame\n"
+         "  --record NAME           record input from the first frame to snapshots/NAME.*\n"
+         "  --playback NAME         play a recording back in a loop\n"
+         "  --playback-loops N      quit after N loops of playback (default 0, forever)\n"
+         "  --reload-debounce MS    quiet time before reloading the game or an asset (default %llu)\n"
+         "  --reload-bench N        time N reloads of the game library, print JSON and quit\n"
+         "  --reload-bench-command CMD  rebuild with CMD for each reload instead of touching it\n"
+         "  --rebuild               run " DEFAULT_REBUILD_COMMAND " whenever " SOURCE_DIR "/ changes\n"
+         "  --rebuild-command CMD   rebuild with CMD instead\n"
+         "  --frame-pacing MODE     target, vsync or unlimited (default target)\n"
+         "  --target-fps N          frame rate for target pacing (default %d)\n"
+         "  --frame-stats           print frame time and jitter percentiles every %d frames\n"
+         "  --background MODE       throttle, pause or run while hidden (default throttle)\n"
+         "  --background-fps N      update rate while hidden and throttled (default %d)\n"
+         "  --input-rate HZ         sample controllers HZ times a second on a thread, 0 to\n"
+         "                          take SDL's events each frame (default %d)\n"
+         "  --asset-threads N       asset loading threads, 0 for one less than the cores\n"
+         "  --texture-uploads N     decoded images uploaded per frame at most (default %d)\n"
+         "  --atlas-size N          side of the atlas pages small images share, 0 to give\n"
+         "                          every image its own texture (default %d)\n"
+         "  --pack FILE             load assets from FILE, see scripts/build_pack.sh, falling\n"
+         "                          back to loose files for anything not in it\n"
+         "  --input-latency         print input to present latency every %d events\n"
+         "  --input-latency-test N  time N synthetic key presses, print JSON and quit\n"
+         "  --profile FILE          write a Chrome trace of the last frames on quit (-DPROFILE)\n"
+         "  --headless              run without a visible window or audio device\n",
+         name, DEFAULT_MEMORY_SIZE, DEFAULT_HOT_MEMORY_SIZE, DEFAULT_MEMORY_BASE,
+         DEFAULT_RELOAD_DEBOUNCE_NS / 1000000ULL, DEFAULT_TARGET_FPS, PACER_REPORT_FRAMES,
+         DEFAULT_BACKGROUND_FPS, DEFAULT_INPUT_RATE, DEFAULT_TEXTURE_UPLOADS,
+         DEFAULT_ATLAS_SIZE, LATENCY_REPORT_SAMPLES);
+  exit(EXIT_FAILURE);
+}
+
+void ParseArgs(PlatformConfig *config, int argc, char *argv[])
+{
+  config->memory_base = DEFAULT_MEMORY_BASE;
+  config->memory_size = DEFAULT_MEMORY_SIZE;
+  config->hot_memory_size = DEFAULT_HOT_MEMORY_SIZE;
+  config->huge_pages = HUGE_PAGES_OFF;
+  config->reload_debounce_ns = DEFAULT_RELOAD_DEBOUNCE_NS;
+  config->frame_pacing = PACING_TARGET;
+  config->target_fps = DEFAULT_TARGET_FPS;
+  config->background = BACKGROUND_THROTTLE;
+  config->background_fps = DEFAULT_BACKGROUND_FPS;
+  config->input_rate = DEFAULT_INPUT_RATE;
+  config->texture_uploads = DEFAULT_TEXTURE_UPLOADS;
+  config->atlas_size = DEFAULT_ATLAS_SIZE;
+
+  for (int c = 1; c < argc; c++) {
+    const char *arg = argv[c];
+    const char *value = c + 1 < argc ? argv[c + 1] : NULL;
+    if (!strcmp(arg, "--memory-size") && value) {
+      config->memory_size = ParseSize(value);
+      c++;
+    } else if (!strcmp(arg, "--hot-memory-size") && value) {
+      config->hot_memory_size = ParseSize(value);
+      c++;
+    } else if (!strcmp(arg, "--memory-base") && value) {
+      config->memory_base = strtoull(value, NULL, 0);
+      c++;
+    } else if (!strcmp(arg, "--restore") && value) {
+      config->restore_file = value;
+      c++;
+    } else if (!strcmp(arg, "--record") && value) {
+      config->record_name = value;
+      c++;
+    } else if (!strcmp(arg, "--playback") && value) {
+      config->playback_name = value;
+      c++;
+    } else if (!strcmp(arg, "--playback-loops") && value) {
+      config->playback_loops = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--reload-debounce") && value) {
+      config->reload_debounce_ns = strtoull(value, NULL, 10) * 1000000ULL;
+      c++;
+    } else if (!strcmp(arg, "--reload-bench") && value) {
+      config->reload_bench = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--reload-bench-command") && value) {
+      config->reload_bench_command = value;
+      c++;
+    } else if (!strcmp(arg, "--rebuild")) {
+      config->rebuild_command = DEFAULT_REBUILD_COMMAND;
+    } else if (!strcmp(arg, "--rebuild-command") && value) {
+      config->rebuild_command = value;
+      c++;
+    } else if (!strcmp(arg, "--frame-pacing") && value) {
+      if (!strcmp(value, "target")) {
+        config->frame_pacing = PACING_TARGET;
+      } else if (!strcmp(value, "vsync")) {
+        config->frame_pacing = PACING_VSYNC;
+      } else if (!strcmp(value, "unlimited")) {
+        config->frame_pacing = PACING_UNLIMITED;
+      } else {
+        Usage(argv[0]);
+      }
+      c++;
+    } else if (!strcmp(arg, "--target-fps") && value) {
+      config->target_fps = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--frame-stats")) {
+      config->frame_stats = true;
+    } else if (!strcmp(arg, "--background") && value) {
+      if (!strcmp(value, "throttle")) {
+        config->background = BACKGROUND_THROTTLE;
+      } else if (!strcmp(value, "pause")) {
+        config->background = BACKGROUND_PAUSE;
+      } else if (!strcmp(value, "run")) {
+        config->background = BACKGROUND_RUN;
+      } else {
+        Usage(argv[0]);
+      }
+      c++;
+    } else if (!strcmp(arg, "--background-fps") && value) {
+      config->background_fps = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--input-rate") && value) {
+      config->input_rate = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--asset-threads") && value) {
+      config->asset_threads = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--texture-uploads") && value) {
+      config->texture_uploads = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--atlas-size") && value) {
+      config->atlas_size = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--pack") && value) {
+      config->pack_file = value;
+      c++;
+    } else if (!strcmp(arg, "--input-latency")) {
+      config->input_latency = true;
+    } else if (!strcmp(arg, "--input-latency-test") && value) {
+      config->input_latency = true;
+      config->input_latency_test = strtoul(value, NULL, 10);
+      c++;
+    } else if (!strcmp(arg, "--profile") && value) {
+      config->profile_file = value;
+      c++;
+    } else if (!strcmp(arg, "--headless")) {
+      config->headless = true;
+    } else if (!strcmp(arg, "--huge-pages") && value) {
+      if (!strcmp(value, "off")) {
+        config->huge_pages = HUGE_PAGES_OFF;
+      } else if (!strcmp(value, "madvise")) {
+        config->huge_pages = HUGE_PAGES_MADVISE;
+      } else if (!strcmp(value, "hugetlb")) {
+        config->huge_pages = HUGE_PAGES_HUGETLB;
+      } else {
+        Usage(argv[0]);
+      }
+      c++;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (config->memory_size == 0 || config->target_fps == 0 ||
+      config->background_fps == 0 || config->texture_uploads == 0 ||
+      config->memory_base % HUGE_PAGE_SIZE != 0 ||
+      (config->record_name && config->playback_name)) {
+    Usage(argv[0]);
+  }
+}
+
+// SDL stamps events in milliseconds of SDL_GetTicks()
+void StartInputBuffer()
+{
+  InputBuffer *input = &state.input;
+  input->ticks_offset_ns = GetNanoseconds() - SDL_GetTicks64() * 1000000ULL;
+  input->last_update_ns = GetNanoseconds();
+}
+
+// Switch off everything the loaded game would ignore, so SDL does not
+// queue it. Called whenever the game code changes.
+void UpdateEventState()
+{
+  GameAPI *api = &state.game_code.api;
+  uint32_t mask = api->input_mask;
+  // The sampler reads sticks and sensors itself
+  uint32_t events_mask = state.sampler.thread ?
+    mask & ~(INPUT_MASK(INPUT_CONTROLLER_AXIS) | INPUT_MASK(INPUT_SENSOR)) : mask;
+  bool touch = api->game_touch_finger_event || (mask & INPUT_MASK(INPUT_TOUCH));
+  struct { uint32_t type; bool wanted; } types[] = {
+    {SDL_KEYDOWN, api->game_keyboard_input || (mask & INPUT_MASK(INPUT_KEY))},
+    {SDL_KEYUP, api->game_keyboard_input || (mask & INPUT_MASK(INPUT_KEY))},
+    {SDL_TEXTEDITING, false},
+    {SDL_TEXTINPUT, false},
+    {SDL_MOUSEMOTION, api->game_mouse_motion || (mask & INPUT_MASK(INPUT_MOUSE_MOTION))},
+    {SDL_MOUSEBUTTONDOWN, api->game_mouse_button || (mask & INPUT_MASK(INPUT_MOUSE_BUTTON))},
+    {SDL_MOUSEBUTTONUP, api->game_mouse_button || (mask & INPUT_MASK(INPUT_MOUSE_BUTTON))},
+    {SDL_MOUSEWHEEL, api->game_mouse_wheel || (mask & INPUT_MASK(INPUT_MOUSE_WHEEL))},
+    {SDL_CONTROLLERAXISMOTION, api->game_controller_axis_event ||
+                               (events_mask & INPUT_MASK(INPUT_CONTROLLER_AXIS))},
+    {SDL_CONTROLLERBUTTONDOWN, api->game_controller_button_event ||
+                               (mask & INPUT_MASK(INPUT_CONTROLLER_BUTTON))},
+    {SDL_CONTROLLERBUTTONUP, api->game_controller_button_event ||
+                             (mask & INPUT_MASK(INPUT_CONTROLLER_BUTTON))},
+    {SDL_CONTROLLERTOUCHPADDOWN, api->game_controller_touchpad_event},
+    {SDL_CONTROLLERTOUCHPADMOTION, api->game_controller_touchpad_event},
+    {SDL_CONTROLLERTOUCHPADUP, api->game_controller_touchpad_event},
+    {SDL_CONTROLLERSENSORUPDATE, api->game_controller_sensor_event ||
+                                 (events_mask & INPUT_MASK(INPUT_SENSOR))},
+    {SDL_FINGERDOWN, touch},
+    {SDL_FINGERUP, touch},
+    {SDL_FINGERMOTION, touch},
+    {SDL_DOLLARGESTURE, false},
+    {SDL_DOLLARRECORD, false},
+    {SDL_MULTIGESTURE, false},
+    {SDL_SENSORUPDATE, api->game_sensor_event || (mask & INPUT_MASK(INPUT_SENSOR))},
+  };
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+    SDL_EventState(types[t].type, types[t].wanted ? SDL_ENABLE : SDL_IGNORE);
+  }
+}
+
+bool IsLatencyProbe(SDL_Event *event)
+{
+  return (event->type == SDL_KEYDOWN || event->type == SDL_KEYUP) &&
+    (event->key.windowID & LATENCY_PROBE_WINDOW) && state.latency.probe_ns;
+}
+
+// Stamp a buffered event with when SDL got it and when it was dispatched
+void StampInputLatency(SDL_Event *event)
+{
+  InputLatency *latency = &state.latency;
+  if (latency->pending == MAX_INPUT_EVENTS) {
+    return;
+  }
+  uint64_t now = GetNanoseconds();
+  // Clamped like the event's time_ns, as played back events carry the
+  // stamps of the session that recorded them
+  uint64_t delivered = state.input.ticks_offset_ns + event->common.timestamp * 1000000ULL;
+  delivered = MAX(state.input.last_update_ns, delivered);
+  if (IsLatencyProbe(event)) {
+    // Probes know when they were pushed to the nanosecond
+    delivered = latency->probe_ns[event->key.windowID & ~LATENCY_PROBE_WINDOW];
+  }
+  latency->delivered_ns[latency->pending] = MIN(delivered, now);
+  latency->dispatched_ns[latency->pending++] = now;
+}
+
+// Queue an event for the next GameUpdate if the game asked for its type.
+// Returns whether the game takes it from there, events dropped off a full
+// buffer included, so it is not handed to a callback as well.
+bool BufferInputEvent(SDL_Event *event)
+{
+  GameInputEvent input = {};
+  // Counted before anything can drop it, --input-latency-test runs until
+  // every probe has come through
+  if (IsLatencyProbe(event)) {
+    state.latency.probes_seen++;
+  }
+  switch (event->type) {
+  case SDL_KEYDOWN:
+  case SDL_KEYUP:
+    input.type = INPUT_KEY;
+    input.state = event->type == SDL_KEYDOWN ? BUTTON_PRESSED : BUTTON_RELEASED;
+    input.code = event->key.keysym.scancode;
+    input.values[0] = event->key.repeat;
+    break;
+  case SDL_MOUSEMOTION:
+    input.type = INPUT_MOUSE_MOTION;
+    input.device = event->motion.which;
+    input.values[0] = event->motion.x;
+    input.values[1] = event->motion.y;
+    input.values[2] = event->motion.xrel;
+    input.values[3] = event->motion.yrel;
+    break;
+  case SDL_MOUSEBUTTONDOWN:
+  case SDL_MOUSEBUTTONUP:
+    input.type = INPUT_MOUSE_BUTTON;
+    input.state = event->type == SDL_MOUSEBUTTONDOWN ? BUTTON_PRESSED : BUTTON_RELEASED;
+    input.device = event->button.which;
+    input.code = event->button.button;
+    input.values[0] = event->button.x;
+    input.values[1] = event->button.y;
+    input.values[2] = event->button.clicks;
+    break;
+  case SDL_MOUSEWHEEL: {
+    float direction = event->wheel.direction == SDL_MOUSEWHEEL_FLIPPED ? -1.0f : 1.0f;
+    input.type = INPUT_MOUSE_WHEEL;
+    input.device = event->wheel.which;
+    input.values[0] = event->wheel.x * direction;
+    input.values[1] = event->wheel.y * direction;
+    break;
+  }
+  case SDL_CONTROLLERBUTTONDOWN:
+  case SDL_CONTROLLERBUTTONUP:
+    input.type = INPUT_CONTROLLER_BUTTON;
+    input.state = event->type == SDL_CONTROLLERBUTTONDOWN ? BUTTON_PRESSED : BUTTON_RELEASED;
+    input.device = event->cbutton.which;
+    input.code = event->cbutton.button;
+    break;
+  case SDL_CONTROLLERAXISMOTION:
+    if (state.sampler.thread) {
+      return false;
+    }
+    input.type = INPUT_CONTROLLER_AXIS;
+    input.device = event->caxis.which;
+    input.code = event->caxis.axis;
+    input.values[0] = MAX(-1.0f, event->caxis.value / 32767.0f);
+    break;
+  case SDL_FINGERDOWN:
+  case SDL_FINGERUP:
+  case SDL_FINGERMOTION:
+    input.type = INPUT_TOUCH;
+    input.state = event->type == SDL_FINGERDOWN ? TOUCHPAD_DOWN :
+                  event->type == SDL_FINGERUP ? TOUCHPAD_UP : TOUCHPAD_MOTION;
+    input.device = event->tfinger.fingerId;
+    input.values[0] = event->tfinger.x;
+    input.values[1] = event->tfinger.y;
+    input.values[2] = event->tfinger.dx;
+    input.values[3] = event->tfinger.dy;
+    break;
+  case SDL_CONTROLLERSENSORUPDATE:
+    if (state.sampler.thread) {
+      return false;
+    }
+    input.type = INPUT_SENSOR;
+    input.device = event->csensor.which;
+    input.code = event->csensor.sensor;
+    memcpy(input.values, event->csensor.data, 3 * sizeof(float));
+    break;
+  case SDL_SENSORUPDATE:
+    input.type = INPUT_SENSOR;
+    input.device = event->sensor.which;
+    input.code = SENSOR_UNKNOWN;
+    memcpy(input.values, event->sensor.data, 3 * sizeof(float));
+    break;
+  default:
+    return false;
+  }
+  if (!(state.game_code.api.input_mask & INPUT_MASK(input.type))) {
+    return false;
+  }
+
+  InputBuffer *buffer = &state.input;
+  if (buffer->count == MAX_INPUT_EVENTS) {
+    buffer->dropped++;
+    return true;
+  }
+  // Millisecond stamps, kept inside the batch; recorded events carry the
+  // stamps of the session that recorded them. The end of the batch is
+  // clamped in UpdateGame so no clock is read per event.
+  input.time_ns = buffer->ticks_offset_ns + event->common.timestamp * 1000000ULL;
+  input.time_ns = MAX(buffer->last_update_ns, input.time_ns);
+  if (buffer->count && input.time_ns < buffer->events[buffer->count - 1].time_ns) {
+    input.time_ns = buffer->events[buffer->count - 1].time_ns;
+  }
+  buffer->events[buffer->count++] = input;
+  if (state.config.input_latency) {
+    StampInputLatency(event);
+  }
+  return true;
+}
+
+void OpenGameController(int index)
+{
+  InputSampler *sampler = &state.sampler;
+  if (sampler->controller_count == MAX_CONTROLLERS) {
+    printf("more than %d controllers, ignoring controller %d\n", MAX_CONTROLLERS, index);
+    return;
+  }
+  SDL_GameController *controller = SDL_GameControllerOpen(index);
+  if (!controller) {
+    fprintf(stderr, "failed to open controller %d: %s\n", index, SDL_GetError());
+    return;
+  }
+  OpenController open;
+  memset(&open, 0, sizeof(open));
+  open.controller = controller;
+  open.id = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(controller));
+  for (int sensor = SENSOR_ACCEL; sensor <= SENSOR_GYRO; sensor++) {
+    open.sensors[sensor] = SDL_GameControllerHasSensor(controller, sensor) &&
+      SDL_GameControllerSetSensorEnabled(controller, sensor, SDL_TRUE) == 0;
+  }
+  SDL_LockJoysticks();
+  sampler->controllers[sampler->controller_count++] = open;
+  SDL_UnlockJoysticks();
+  const char *name = SDL_GameControllerName(controller);
+  printf("controller %d connected: %s%s%s\n", open.id, name ? name : "unknown",
+         open.sensors[SENSOR_ACCEL] ? ", accelerometer" : "",
+         open.sensors[SENSOR_GYRO] ? ", gyro" : "");
+}
+
+void CloseGameController(SDL_JoystickID id)
+{
+  InputSampler *sampler = &state.sampler;
+  for (uint32_t c = 0; c < sampler->controller_count; c++) {
+    if (sampler->controllers[c].id == id) {
+      SDL_GameController *controller = sampler->controllers[c].controller;
+      SDL_LockJoysticks();
+      sampler->controllers[c] = sampler->controllers[--sampler->controller_count];
+      SDL_UnlockJoysticks();
+      SDL_GameControllerClose(controller);
+      printf("controller %d disconnected\n", id);
+      return;
+    }
+  }
+}
+
+void PushInputSample(InputSampler *sampler, const GameInputEvent *sample)
+{
+  uint32_t head = sampler->head;
+  if (head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE) == INPUT_SAMPLE_RING) {
+    __atomic_fetch_add(&sampler->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  sampler->samples[head & INPUT_SAMPLE_MASK] = *sample;
+  __atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Pushes whatever changed since the last sample
+void SampleController(InputSampler *sampler, OpenController *open, uint64_t now)
+{
+  GameInputEvent sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.time_ns = now;
+  sample.device = open->id;
+  sample.type = INPUT_CONTROLLER_AXIS;
+  for (int axis = 0; axis < CONTROLLER_AXIS_COUNT; axis++) {
+    int16_t value = SDL_GameControllerGetAxis(open->controller, axis);
+    if (value != open->axes[axis]) {
+      open->axes[axis] = value;
+      sample.code = axis;
+      sample.values[0] = MAX(-1.0f, value / 32767.0f);
+      PushInputSample(sampler, &sample);
+    }
+  }
+  sample.type = INPUT_SENSOR;
+  for (int sensor = SENSOR_ACCEL; sensor <= SENSOR_GYRO; sensor++) {
+    float data[3];
+    if (open->sensors[sensor] &&
+        SDL_GameControllerGetSensorData(open->controller, sensor, data, 3) == 0 &&
+        memcmp(data, open->sensor_data[sensor], sizeof(data))) {
+      memcpy(open->sensor_data[sensor], data, sizeof(data));
+      sample.code = sensor;
+      memcpy(sample.values, data, sizeof(data));
+      PushInputSample(sampler, &sample);
+    }
+  }
+}
+
+// Samples every open controller on a fixed schedule, independent of the
+// frame rate. SDL_GameControllerUpdate() reads the devices, under the same
+// lock SDL takes when the frame loop pumps events.
+int RunInputSampler(void *data)
+{
+  InputSampler *sampler = data;
+  uint64_t period_ns = 1000000000ULL / state.config.input_rate;
+  uint64_t deadline_ns = GetNanoseconds();
+  while (__atomic_load_n(&sampler->running, __ATOMIC_ACQUIRE)) {
+    SDL_LockJoysticks();
+    uint32_t count = sampler->controller_count;
+    if (count) {
+      SDL_GameControllerUpdate();
+      uint64_t now = GetNanoseconds();
+      for (uint32_t c = 0; c < count; c++) {
+        SampleController(sampler, &sampler->controllers[c], now);
+      }
+    }
+    SDL_UnlockJoysticks();
+    if (!count) {
+      SDL_Delay(INPUT_SAMPLER_IDLE_MS);
+      deadline_ns = GetNanoseconds();
+      continue;
+    }
+    deadline_ns += period_ns;
+    uint64_t now = GetNanoseconds();
+    if (deadline_ns < now) {
+      // Fell behind, start a new schedule from here
+      deadline_ns = now;
+      continue;
+    }
+    struct timespec wake = { deadline_ns / 1000000000ULL, deadline_ns % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+    }
+  }
+  return 0;
+}
+
+void StartInputSampler()
+{
+  InputSampler *sampler = &state.sampler;
+  sampler->running = 1;
+  sampler->thread = SDL_CreateThread(RunInputSampler, "input sampler", sampler);
+  if (!sampler->thread) {
+    fprintf(stderr, "failed to start the input sampler, using SDL's events: %s\n",
+            SDL_GetError());
+  }
+}
+
+void StopInputSampler()
+{
+  InputSampler *sampler = &state.sampler;
+  if (sampler->thread) {
+    __atomic_store_n(&sampler->running, 0, __ATOMIC_RELEASE);
+    SDL_WaitThread(sampler->thread, NULL);
+    sampler->thread = NULL;
+  }
+}
+
+// Moves the sampler's ring into the input buffer. Samples carry their own
+// nanosecond stamps, so they are inserted among the frame's SDL events to
+// keep the batch in time order.
+void DrainInputSamples()
+{
+  InputSampler *sampler = &state.sampler;
+  InputBuffer *buffer = &state.input;
+  uint32_t wanted = state.game_code.api.input_mask;
+  uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+  for (uint32_t tail = sampler->tail; tail != head; tail++) {
+    GameInputEvent sample = sampler->samples[tail & INPUT_SAMPLE_MASK];
+    if (!(wanted & INPUT_MASK(sample.type))) {
+      continue;
+    }
+    if (buffer->count == MAX_INPUT_EVENTS) {
+      buffer->dropped++;
+      continue;
+    }
+    sample.time_ns = MAX(buffer->last_update_ns, sample.time_ns);
+    uint32_t e = buffer->count++;
+    for (; e > 0 && buffer->events[e - 1].time_ns > sample.time_ns; e--) {
+      buffer->events[e] = buffer->events[e - 1];
+    }
+    buffer->events[e] = sample;
+  }
+  __atomic_store_n(&sampler->tail, head, __ATOMIC_RELEASE);
+  buffer->dropped += __atomic_exchange_n(&sampler->dropped, 0, __ATOMIC_RELAXED);
+}
+
+// Hands the buffered input to the game and starts a new batch
+void UpdateGame(float dt)
+{
+  InputBuffer *buffer = &state.input;
+  if (state.sampler.thread) {
+    DrainInputSamples();
+  }
+  GameInput input = {};
+  input.events = buffer->events;
+  input.count = buffer->count;
+  input.dropped = buffer->dropped;
+  input.last_update_ns = buffer->last_update_ns;
+  input.now_ns = GetNanoseconds();
+  for (uint32_t e = buffer->count; e > 0 && buffer->events[e - 1].time_ns > input.now_ns; e--) {
+    buffer->events[e - 1].time_ns = input.now_ns;
+  }
+  state.latency.update_ns = input.now_ns;
+  state.latency.updated = state.latency.pending;
+  state.game_code.api.game_update(dt, &input);
+  buffer->count = 0;
+  buffer->dropped = 0;
+  buffer->last_update_ns = input.now_ns;
+}
 
-      case SDL_APP_LOWMEMORY:
-	if (state.game_code.game_low_memory)
-	  state.game_code.game_low_memory();
+// Forward one SDL event to the game
+void DispatchEvent(SDL_Event *event)
+{
+  if (BufferInputEvent(event)) {
+    return;
+  }
+  switch (event->type) {
+
+  // App closing
+  case SDL_QUIT:
+  case SDL_APP_TERMINATING:
+	if (state.game_code.api.game_quit)
+	  state.game_code.api.game_quit();
+	Quit();
 	break;
 
-      case SDL_DISPLAYEVENT:
-	switch (event.display.event) {
+  case SDL_APP_LOWMEMORY:
+	if (state.game_code.api.game_low_memory)
+	  state.game_code.api.game_low_memory();
+	break;
+
+  case SDL_DISPLAYEVENT:
+	switch (event->display.event) {
 	case SDL_DISPLAYEVENT_CONNECTED:
 	  break;
 	case SDL_DISPLAYEVENT_DISCONNECTED:
@@ -923,377 +2801,1500 @@ void GameLoop()
 	}
 	break;
 	
-      case SDL_WINDOWEVENT:
-	switch (event.window.event) {
-        case SDL_WINDOWEVENT_SHOWN:
-	  if (state.game_code.game_window_shown)
-	    state.game_code.game_window_shown(event.window.windowID, 1);
+  case SDL_WINDOWEVENT:
+	switch (event->window.event) {
+    case SDL_WINDOWEVENT_SHOWN:
+	  state.background.hidden = false;
+	  if (state.game_code.api.game_window_shown)
+	    state.game_code.api.game_window_shown(event->window.windowID, 1);
 	  break;
-        case SDL_WINDOWEVENT_HIDDEN:
-	  if (state.game_code.game_window_shown)
-	    state.game_code.game_window_shown(event.window.windowID, 0);
+    case SDL_WINDOWEVENT_HIDDEN:
+	  state.background.hidden = true;
+	  if (state.game_code.api.game_window_shown)
+	    state.game_code.api.game_window_shown(event->window.windowID, 0);
 	  break;
-        case SDL_WINDOWEVENT_MOVED:
-	  if (state.game_code.game_window_moved) {
-	    state.screen.x = event.window.data1;
-	    state.screen.y = event.window.data2;
-	    state.game_code.game_window_moved(event.window.windowID,
-					      event.window.data1,
-					      event.window.data2);
+    case SDL_WINDOWEVENT_MOVED:
+	  state.screen.x = event->window.data1;
+	  state.screen.y = event->window.data2;
+	  if (state.game_code.api.game_window_moved) {
+	    state.game_code.api.game_window_moved(event->window.windowID,
+					      event->window.data1,
+					      event->window.data2);
 	  }
 	  break;
-        case SDL_WINDOWEVENT_RESIZED:
-	  if (state.game_code.game_window_resized){
-	    state.screen.w = event.window.data1;
-	    state.screen.h = event.window.data2;
-	    state.game_code.game_window_resized(event.window.windowID,
-						event.window.data1,
-						event.window.data2);
+    case SDL_WINDOWEVENT_RESIZED:
+	  // Kept whether or not the game listens, game_init gets it on
+	  // restores and playback restarts
+	  state.screen.w = event->window.data1;
+	  state.screen.h = event->window.data2;
+	  if (state.game_code.api.game_window_resized){
+	    state.game_code.api.game_window_resized(event->window.windowID,
+						event->window.data1,
+						event->window.data2);
 	  }
 	  break;
-        case SDL_WINDOWEVENT_MINIMIZED:
-	  if (state.game_code.game_window_minmaxed)
-	    state.game_code.game_window_minmaxed(event.window.windowID, 1);
+    case SDL_WINDOWEVENT_MINIMIZED:
+	  state.background.minimized = true;
+	  if (state.game_code.api.game_window_minmaxed)
+	    state.game_code.api.game_window_minmaxed(event->window.windowID, 1);
+	  break;
+    case SDL_WINDOWEVENT_MAXIMIZED:
+	  state.background.minimized = false;
+	  if (state.game_code.api.game_window_minmaxed)
+	    state.game_code.api.game_window_minmaxed(event->window.windowID, 0);
 	  break;
-        case SDL_WINDOWEVENT_MAXIMIZED:
-	  if (state.game_code.game_window_minmaxed)
-	    state.game_code.game_window_minmaxed(event.window.windowID, 0);
+    case SDL_WINDOWEVENT_RESTORED:
+	  state.background.minimized = false;
 	  break;
-        case SDL_WINDOWEVENT_ENTER:
-	  if (state.game_code.game_window_moused)
-	    state.game_code.game_window_moused(event.window.windowID, 1);
+    case SDL_WINDOWEVENT_ENTER:
+	  if (state.game_code.api.game_window_moused)
+	    state.game_code.api.game_window_moused(event->window.windowID, 1);
 	  break;
-        case SDL_WINDOWEVENT_LEAVE:
-	  if (state.game_code.game_window_moused)
-	    state.game_code.game_window_moused(event.window.windowID, 0);
+    case SDL_WINDOWEVENT_LEAVE:
+	  if (state.game_code.api.game_window_moused)
+	    state.game_code.api.game_window_moused(event->window.windowID, 0);
 	  break;
-        case SDL_WINDOWEVENT_FOCUS_GAINED:
-	  if (state.game_code.game_window_focused)
-	    state.game_code.game_window_focused(event.window.windowID, 1);
+    case SDL_WINDOWEVENT_FOCUS_GAINED:
+	  if (state.game_code.api.game_window_focused)
+	    state.game_code.api.game_window_focused(event->window.windowID, 1);
 	  break;
-        case SDL_WINDOWEVENT_FOCUS_LOST:
-	  if (state.game_code.game_window_focused)
-	    state.game_code.game_window_focused(event.window.windowID, 0);
+    case SDL_WINDOWEVENT_FOCUS_LOST:
+	  if (state.game_code.api.game_window_focused)
+	    state.game_code.api.game_window_focused(event->window.windowID, 0);
 	  break;
-        case SDL_WINDOWEVENT_CLOSE:
-	  if (state.game_code.game_window_closed)
-	    state.game_code.game_window_closed(event.window.windowID);
+    case SDL_WINDOWEVENT_CLOSE:
+	  if (state.game_code.api.game_window_closed)
+	    state.game_code.api.game_window_closed(event->window.windowID);
 	  break;
-        default:
+    default:
 	  //SDL_Log("Window %d got unknown event %d",
-	  //        event.window.windowID, event.window.event);
+	  //        event->window.windowID, event->window.event);
 	  break;
-        }
+    }
 	break;
 
 	// Keyboard
-      case SDL_KEYDOWN:
-	if (state.game_code.game_keyboard_input)
-	  state.game_code.game_keyboard_input(event.key.windowID,
+  case SDL_KEYDOWN:
+	if (state.game_code.api.game_keyboard_input)
+	  state.game_code.api.game_keyboard_input(event->key.windowID,
 					      BUTTON_PRESSED,
-					      event.key.repeat,
-					      event.key.keysym.scancode);
+					      event->key.repeat,
+					      event->key.keysym.scancode);
 	break;
-      case SDL_KEYUP:
-	if (state.game_code.game_keyboard_input)
-	  state.game_code.game_keyboard_input(event.key.windowID,
+  case SDL_KEYUP:
+	if (state.game_code.api.game_keyboard_input)
+	  state.game_code.api.game_keyboard_input(event->key.windowID,
 					      BUTTON_RELEASED,
-					      event.key.repeat,
-					      event.key.keysym.scancode);
+					      event->key.repeat,
+					      event->key.keysym.scancode);
 	break;
 	// Unsupported Keyboard-related
-      case SDL_TEXTEDITING:
-      case SDL_TEXTINPUT:
+  case SDL_TEXTEDITING:
+  case SDL_TEXTINPUT:
 	break;
-      case SDL_KEYMAPCHANGED:
+  case SDL_KEYMAPCHANGED:
 	break;
 
 	// Mouse
-      case SDL_MOUSEMOTION:
-	if (state.game_code.game_mouse_motion)
-	  state.game_code.game_mouse_motion(event.motion.windowID,
-					    event.motion.which,
-					    event.motion.x,
-					    event.motion.y,
-					    event.motion.xrel,
-					    event.motion.yrel);
+  case SDL_MOUSEMOTION:
+	if (state.game_code.api.game_mouse_motion)
+	  state.game_code.api.game_mouse_motion(event->motion.windowID,
+					    event->motion.which,
+					    event->motion.x,
+					    event->motion.y,
+					    event->motion.xrel,
+					    event->motion.yrel);
 	break;
-      case SDL_MOUSEBUTTONDOWN:
-	if (state.game_code.game_mouse_button)
-	  state.game_code.game_mouse_button(event.button.windowID,
-					    event.button.which,
-					    event.button.button,
+  case SDL_MOUSEBUTTONDOWN:
+	if (state.game_code.api.game_mouse_button)
+	  state.game_code.api.game_mouse_button(event->button.windowID,
+					    event->button.which,
+					    event->button.button,
 					    BUTTON_PRESSED,
-					    event.button.clicks,
-					    event.button.x,
-					    event.button.y);
+					    event->button.clicks,
+					    event->button.x,
+					    event->button.y);
 	break;
-      case SDL_MOUSEBUTTONUP:
-	if (state.game_code.game_mouse_button)
-	  state.game_code.game_mouse_button(event.button.windowID,
-					    event.button.which,
-					    event.button.button,
+  case SDL_MOUSEBUTTONUP:
+	if (state.game_code.api.game_mouse_button)
+	  state.game_code.api.game_mouse_button(event->button.windowID,
+					    event->button.which,
+					    event->button.button,
 					    BUTTON_RELEASED,
-					    event.button.clicks,
-					    event.button.x,
-					    event.button.y);
+					    event->button.clicks,
+					    event->button.x,
+					    event->button.y);
 	break;
-      case SDL_MOUSEWHEEL:
-	if (state.game_code.game_mouse_wheel)
-	  state.game_code.game_mouse_wheel(event.wheel.windowID,
-					   event.wheel.which,
-					   event.wheel.x,
-					   event.wheel.y,
-					   event.wheel.direction);
+  case SDL_MOUSEWHEEL:
+	if (state.game_code.api.game_mouse_wheel)
+	  state.game_code.api.game_mouse_wheel(event->wheel.windowID,
+					   event->wheel.which,
+					   event->wheel.x,
+					   event->wheel.y,
+					   event->wheel.direction);
 	break;
 
 	// Joystick
-      case SDL_JOYAXISMOTION:
-	if (state.game_code.game_joy_axis_event)
-	  state.game_code.game_joy_axis_event(event.jaxis.which,
-					      event.jaxis.axis,
-					      event.jaxis.value);
+  case SDL_JOYAXISMOTION:
+	if (state.game_code.api.game_joy_axis_event)
+	  state.game_code.api.game_joy_axis_event(event->jaxis.which,
+					      event->jaxis.axis,
+					      event->jaxis.value);
 	break;
-      case SDL_JOYBALLMOTION:
-	if (state.game_code.game_joy_ball_event)
-	  state.game_code.game_joy_ball_event(event.jball.which,
-					      event.jball.ball,
-					      event.jball.xrel,
-					      event.jball.yrel);
+  case SDL_JOYBALLMOTION:
+	if (state.game_code.api.game_joy_ball_event)
+	  state.game_code.api.game_joy_ball_event(event->jball.which,
+					      event->jball.ball,
+					      event->jball.xrel,
+					      event->jball.yrel);
 	break;
-      case SDL_JOYHATMOTION:
-	if (state.game_code.game_joy_hat_event)
-	  state.game_code.game_joy_hat_event(event.jhat.which,
-					     event.jhat.hat,
-					     event.jhat.value);
+  case SDL_JOYHATMOTION:
+	if (state.game_code.api.game_joy_hat_event)
+	  state.game_code.api.game_joy_hat_event(event->jhat.which,
+					     event->jhat.hat,
+					     event->jhat.value);
 	break;
-      case SDL_JOYBUTTONDOWN:
-	if (state.game_code.game_joy_button_event)
-	  state.game_code.game_joy_button_event(event.jbutton.which,
-						event.jbutton.button,
+  case SDL_JOYBUTTONDOWN:
+	if (state.game_code.api.game_joy_button_event)
+	  state.game_code.api.game_joy_button_event(event->jbutton.which,
+						event->jbutton.button,
 						BUTTON_PRESSED);
 	break;
-      case SDL_JOYBUTTONUP:
-	if (state.game_code.game_joy_button_event)
-	  state.game_code.game_joy_button_event(event.jbutton.which,
-						event.jbutton.button,
+  case SDL_JOYBUTTONUP:
+	if (state.game_code.api.game_joy_button_event)
+	  state.game_code.api.game_joy_button_event(event->jbutton.which,
+						event->jbutton.button,
 						BUTTON_RELEASED);
 	break;
-      case SDL_JOYDEVICEADDED:
-	if (state.game_code.game_joy_device_event)
-	  state.game_code.game_joy_device_event(event.jdevice.which, CONNECT);
+  case SDL_JOYDEVICEADDED:
+	if (state.game_code.api.game_joy_device_event)
+	  state.game_code.api.game_joy_device_event(event->jdevice.which, CONNECT);
 	break;
-      case SDL_JOYDEVICEREMOVED:
-	if (state.game_code.game_joy_device_event)
-	  state.game_code.game_joy_device_event(event.jdevice.which, DISCONNECT);
+  case SDL_JOYDEVICEREMOVED:
+	if (state.game_code.api.game_joy_device_event)
+	  state.game_code.api.game_joy_device_event(event->jdevice.which, DISCONNECT);
 	break;
 
 	// Controller
-      case SDL_CONTROLLERAXISMOTION:
-	if (state.game_code.game_controller_axis_event)
-	  state.game_code.game_controller_axis_event(event.caxis.which,
-						     event.caxis.axis,
-						     event.caxis.value);
+  case SDL_CONTROLLERAXISMOTION:
+	if (state.game_code.api.game_controller_axis_event)
+	  state.game_code.api.game_controller_axis_event(event->caxis.which,
+						     event->caxis.axis,
+						     event->caxis.value);
 	break;
-      case SDL_CONTROLLERBUTTONDOWN:
-	if (state.game_code.game_controller_button_event)
-	  state.game_code.game_controller_button_event(event.cbutton.which,
-						       event.cbutton.button,
+  case SDL_CONTROLLERBUTTONDOWN:
+	if (state.game_code.api.game_controller_button_event)
+	  state.game_code.api.game_controller_button_event(event->cbutton.which,
+						       event->cbutton.button,
 						       BUTTON_PRESSED);
 	break;
-      case SDL_CONTROLLERBUTTONUP:
-	if (state.game_code.game_controller_button_event)
-	  state.game_code.game_controller_button_event(event.cbutton.which,
-						       event.cbutton.button,
+  case SDL_CONTROLLERBUTTONUP:
+	if (state.game_code.api.game_controller_button_event)
+	  state.game_code.api.game_controller_button_event(event->cbutton.which,
+						       event->cbutton.button,
 						       BUTTON_RELEASED);
 	break;
-      case SDL_CONTROLLERDEVICEADDED:
-	if (state.game_code.game_controller_device_event)
-	  state.game_code.game_controller_device_event(event.cdevice.which, CONNECT);
+  case SDL_CONTROLLERDEVICEADDED:
+	OpenGameController(event->cdevice.which);
+	if (state.game_code.api.game_controller_device_event)
+	  state.game_code.api.game_controller_device_event(event->cdevice.which, CONNECT);
 	break;
-      case SDL_CONTROLLERDEVICEREMOVED:
-	if (state.game_code.game_controller_device_event)
-	  state.game_code.game_controller_device_event(event.cdevice.which, DISCONNECT);
+  case SDL_CONTROLLERDEVICEREMOVED:
+	CloseGameController(event->cdevice.which);
+	if (state.game_code.api.game_controller_device_event)
+	  state.game_code.api.game_controller_device_event(event->cdevice.which, DISCONNECT);
 	break;
-      case SDL_CONTROLLERDEVICEREMAPPED:
+  case SDL_CONTROLLERDEVICEREMAPPED:
 	break;
-      case SDL_CONTROLLERTOUCHPADDOWN:
-	if (state.game_code.game_controller_touchpad_event)
-	  state.game_code.game_controller_touchpad_event(event.ctouchpad.which,
+  case SDL_CONTROLLERTOUCHPADDOWN:
+	if (state.game_code.api.game_controller_touchpad_event)
+	  state.game_code.api.game_controller_touchpad_event(event->ctouchpad.which,
 							 TOUCHPAD_DOWN,
-							 event.ctouchpad.finger,
-							 event.ctouchpad.x,
-							 event.ctouchpad.y,
-							 event.ctouchpad.pressure);
+							 event->ctouchpad.finger,
+							 event->ctouchpad.x,
+							 event->ctouchpad.y,
+							 event->ctouchpad.pressure);
 	break;
-      case SDL_CONTROLLERTOUCHPADMOTION:
-	if (state.game_code.game_controller_touchpad_event)
-	  state.game_code.game_controller_touchpad_event(event.ctouchpad.which,
+  case SDL_CONTROLLERTOUCHPADMOTION:
+	if (state.game_code.api.game_controller_touchpad_event)
+	  state.game_code.api.game_controller_touchpad_event(event->ctouchpad.which,
 							 TOUCHPAD_MOTION,
-							 event.ctouchpad.finger,
-							 event.ctouchpad.x,
-							 event.ctouchpad.y,
-							 event.ctouchpad.pressure);
+							 event->ctouchpad.finger,
+							 event->ctouchpad.x,
+							 event->ctouchpad.y,
+							 event->ctouchpad.pressure);
 	break;
-      case SDL_CONTROLLERTOUCHPADUP:
-	if (state.game_code.game_controller_touchpad_event)
-	  state.game_code.game_controller_touchpad_event(event.ctouchpad.which,
+  case SDL_CONTROLLERTOUCHPADUP:
+	if (state.game_code.api.game_controller_touchpad_event)
+	  state.game_code.api.game_controller_touchpad_event(event->ctouchpad.which,
 							 TOUCHPAD_UP,
-							 event.ctouchpad.finger,
-							 event.ctouchpad.x,
-							 event.ctouchpad.y,
-							 event.ctouchpad.pressure);
+							 event->ctouchpad.finger,
+							 event->ctouchpad.x,
+							 event->ctouchpad.y,
+							 event->ctouchpad.pressure);
 	break;
 	break;
-      case SDL_CONTROLLERSENSORUPDATE:
-	if (state.game_code.game_controller_sensor_event)
-	  state.game_code.game_controller_sensor_event(event.csensor.which,
-						       event.csensor.sensor,
-						       event.csensor.data, 6);
+  case SDL_CONTROLLERSENSORUPDATE:
+	if (state.game_code.api.game_controller_sensor_event)
+	  state.game_code.api.game_controller_sensor_event(event->csensor.which,
+						       event->csensor.sensor,
+						       event->csensor.data, 6);
 	break;
 
 	// Touch
-      case SDL_FINGERDOWN:
-	if (state.game_code.game_touch_finger_event)
-	  state.game_code.game_touch_finger_event(event.tfinger.windowID,
-						  event.tfinger.touchId,
-						  event.tfinger.fingerId,
+  case SDL_FINGERDOWN:
+	if (state.game_code.api.game_touch_finger_event)
+	  state.game_code.api.game_touch_finger_event(event->tfinger.windowID,
+						  event->tfinger.touchId,
+						  event->tfinger.fingerId,
 						  TOUCHPAD_DOWN,
-						  event.tfinger.x,
-						  event.tfinger.y,
-						  event.tfinger.dx,
-						  event.tfinger.dy,
-						  event.tfinger.pressure);
+						  event->tfinger.x,
+						  event->tfinger.y,
+						  event->tfinger.dx,
+						  event->tfinger.dy,
+						  event->tfinger.pressure);
 	break;
-      case SDL_FINGERUP:
-	if (state.game_code.game_touch_finger_event)
-	  state.game_code.game_touch_finger_event(event.tfinger.windowID,
-						  event.tfinger.touchId,
-						  event.tfinger.fingerId,
+  case SDL_FINGERUP:
+	if (state.game_code.api.game_touch_finger_event)
+	  state.game_code.api.game_touch_finger_event(event->tfinger.windowID,
+						  event->tfinger.touchId,
+						  event->tfinger.fingerId,
 						  TOUCHPAD_UP,
-						  event.tfinger.x,
-						  event.tfinger.y,
-						  event.tfinger.dx,
-						  event.tfinger.dy,
-						  event.tfinger.pressure);
+						  event->tfinger.x,
+						  event->tfinger.y,
+						  event->tfinger.dx,
+						  event->tfinger.dy,
+						  event->tfinger.pressure);
 	break;
-      case SDL_FINGERMOTION:
-	if (state.game_code.game_touch_finger_event)
-	  state.game_code.game_touch_finger_event(event.tfinger.windowID,
-						  event.tfinger.touchId,
-						  event.tfinger.fingerId,
+  case SDL_FINGERMOTION:
+	if (state.game_code.api.game_touch_finger_event)
+	  state.game_code.api.game_touch_finger_event(event->tfinger.windowID,
+						  event->tfinger.touchId,
+						  event->tfinger.fingerId,
 						  TOUCHPAD_MOTION,
-						  event.tfinger.x,
-						  event.tfinger.y,
-						  event.tfinger.dx,
-						  event.tfinger.dy,
-						  event.tfinger.pressure);
+						  event->tfinger.x,
+						  event->tfinger.y,
+						  event->tfinger.dx,
+						  event->tfinger.dy,
+						  event->tfinger.pressure);
 	break;
 	// Unsupported touch-related
-      case SDL_DOLLARGESTURE:
-      case SDL_DOLLARRECORD:
-      case SDL_MULTIGESTURE:
+  case SDL_DOLLARGESTURE:
+  case SDL_DOLLARRECORD:
+  case SDL_MULTIGESTURE:
 	break;
 
 	// Drops
-      case SDL_DROPFILE:
-	if (state.game_code.game_drop_event)
-	  state.game_code.game_drop_event(event.drop.windowID,
+  case SDL_DROPFILE:
+	if (state.game_code.api.game_drop_event)
+	  state.game_code.api.game_drop_event(event->drop.windowID,
 					  DROP_FILE,
-					  event.drop.file);
-	SDL_free(event.drop.file);
+					  event->drop.file);
+	SDL_free(event->drop.file);
 	break;
-      case SDL_DROPTEXT:
-	if (state.game_code.game_drop_event)
-	  state.game_code.game_drop_event(event.drop.windowID,
+  case SDL_DROPTEXT:
+	if (state.game_code.api.game_drop_event)
+	  state.game_code.api.game_drop_event(event->drop.windowID,
 					  DROP_TEXT,
-					  event.drop.file);
-	SDL_free(event.drop.file);
+					  event->drop.file);
+	SDL_free(event->drop.file);
 	break;
-      case SDL_DROPBEGIN:
-	if (state.game_code.game_drop_event)
-	  state.game_code.game_drop_event(event.drop.windowID,
+  case SDL_DROPBEGIN:
+	if (state.game_code.api.game_drop_event)
+	  state.game_code.api.game_drop_event(event->drop.windowID,
 					  DROP_BEGIN,
-					  event.drop.file);
-	SDL_free(event.drop.file);
+					  event->drop.file);
+	SDL_free(event->drop.file);
 	break;
-      case SDL_DROPCOMPLETE:
-	if (state.game_code.game_drop_event)
-	  state.game_code.game_drop_event(event.drop.windowID,
+  case SDL_DROPCOMPLETE:
+	if (state.game_code.api.game_drop_event)
+	  state.game_code.api.game_drop_event(event->drop.windowID,
 					  DROP_COMPLETE,
-					  event.drop.file);
-	SDL_free(event.drop.file);
+					  event->drop.file);
+	SDL_free(event->drop.file);
 	break;
 
 	// Audio Devices
-      case SDL_AUDIODEVICEADDED:
-	if (state.game_code.game_audio_device_event)
-	  state.game_code.game_audio_device_event(event.adevice.which,
+  case SDL_AUDIODEVICEADDED:
+	if (state.game_code.api.game_audio_device_event)
+	  state.game_code.api.game_audio_device_event(event->adevice.which,
 						  CONNECT,
-						  event.adevice.iscapture);
+						  event->adevice.iscapture);
 	break;
-      case SDL_AUDIODEVICEREMOVED:
-	if (state.game_code.game_audio_device_event)
-	  state.game_code.game_audio_device_event(event.adevice.which,
+  case SDL_AUDIODEVICEREMOVED:
+	if (state.game_code.api.game_audio_device_event)
+	  state.game_code.api.game_audio_device_event(event->adevice.which,
 						  DISCONNECT,
-						  event.adevice.iscapture);
+						  event->adevice.iscapture);
 	break;
 
 	// Sensor 
-      case SDL_SENSORUPDATE:
-	if (state.game_code.game_sensor_event)
-	  state.game_code.game_sensor_event(event.sensor.which,
-					    event.sensor.type,
-					    event.sensor.data, 6);
+  case SDL_SENSORUPDATE:
+	if (state.game_code.api.game_sensor_event)
+	  state.game_code.api.game_sensor_event(event->sensor.which,
+					    event->sensor.type,
+					    event->sensor.data, 6);
 	break;
 	
 	// User event
-      case SDL_USEREVENT:
-	if (state.game_code.game_user_event)
-	  state.game_code.game_user_event(event.user.windowID,
-					  event.user.type,
-					  event.user.code,
-					  event.user.data1,
-					  event.user.data2);
+  case SDL_USEREVENT:
+	if (state.game_code.api.game_user_event)
+	  state.game_code.api.game_user_event(event->user.windowID,
+					  event->user.type,
+					  event->user.code,
+					  event->user.data1,
+					  event->user.data2);
 	break;
 	
 	// Unsupported for now
-      case SDL_RENDER_TARGETS_RESET:
-      case SDL_RENDER_DEVICE_RESET:
-      case SDL_CLIPBOARDUPDATE:
-      case SDL_LOCALECHANGED:
+  case SDL_RENDER_TARGETS_RESET:
+  case SDL_RENDER_DEVICE_RESET:
+  case SDL_CLIPBOARDUPDATE:
+  case SDL_LOCALECHANGED:
 	break;
+  }
+}
+
+void BuildRecordingPaths(const char *name)
+{
+  snprintf(state.recorder.state_file, sizeof(state.recorder.state_file),
+           "%s/%s.state", SNAPSHOTS_DIR, name);
+  snprintf(state.recorder.input_file, sizeof(state.recorder.input_file),
+           "%s/%s.input", SNAPSHOTS_DIR, name);
+}
+
+// Events that are replayed. Quits would end playback, and drops and
+// user events carry pointers that are meaningless in another run.
+bool IsRecordableEvent(SDL_Event *event)
+{
+  switch (event->type) {
+  case SDL_QUIT:
+  case SDL_APP_TERMINATING:
+  case SDL_DROPFILE:
+  case SDL_DROPTEXT:
+  case SDL_DROPBEGIN:
+  case SDL_DROPCOMPLETE:
+  case SDL_USEREVENT:
+  case SDL_CONTROLLERDEVICEADDED:
+  case SDL_CONTROLLERDEVICEREMOVED:
+    return false;
+  }
+  return true;
+}
+
+// Snapshot the game memory and start writing dispatched input
+void StartRecording(const char *name)
+{
+  RecordingHeader header = {RECORDING_MAGIC, RECORDING_VERSION,
+                            (uint32_t)time(NULL), 0};
+  BuildRecordingPaths(name);
+  mkdir(SNAPSHOTS_DIR, 0755);
+  if (!SaveGameMemory(&state.game_memory, state.recorder.state_file)) {
+    Die("failed to start recording %s\n", name);
+  }
+  state.recorder.file = fopen(state.recorder.input_file, "wb");
+  if (!state.recorder.file) {
+    Die("unable to open %s: %s\n", state.recorder.input_file, strerror(errno));
+  }
+  fwrite(&header, sizeof(header), 1, state.recorder.file);
+  state.recorder.seed = header.seed;
+  state.recorder.frame = 0;
+  state.recorder.mode = RECORDER_RECORDING;
+  srand(state.recorder.seed);
+  printf("recording input to %s\n", state.recorder.input_file);
+}
+
+void RecordEvent(SDL_Event *event)
+{
+  RecordedEvent recorded = {state.recorder.frame, *event};
+  fwrite(&recorded, sizeof(recorded), 1, state.recorder.file);
+}
+
+// Called on quit, stores the final frame count in the header
+void StopRecording()
+{
+  RecordingHeader header = {RECORDING_MAGIC, RECORDING_VERSION,
+                            state.recorder.seed, state.recorder.frame};
+  if (state.recorder.mode != RECORDER_RECORDING) {
+    return;
+  }
+  fseek(state.recorder.file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, state.recorder.file);
+  fclose(state.recorder.file);
+  state.recorder.file = NULL;
+  state.recorder.mode = RECORDER_OFF;
+  printf("recorded %u frames to %s\n", header.frames, state.recorder.input_file);
+}
+
+// Put the game back at the first recorded frame
+void RestartPlayback()
+{
+  if (!LoadGameMemory(&state.game_memory, state.recorder.state_file)) {
+    Die("failed to restore %s\n", state.recorder.state_file);
+  }
+  srand(state.recorder.seed);
+  state.game_code.api.game_init(&state.game_memory, GetPlatformAPI(),
+                            state.screen.w, state.screen.h);
+  state.recorder.frame = 0;
+  state.recorder.next_event = 0;
+}
+
+void StartPlayback(const char *name, uint32_t loops)
+{
+  RecordingHeader header;
+  size_t size;
+  int err;
+  char *contents;
+
+  BuildRecordingPaths(name);
+  contents = c_read_file(state.recorder.input_file, &err, &size);
+  if (err != FILE_OK || size < sizeof(header)) {
+    Die("unable to read recording %s\n", state.recorder.input_file);
+  }
+  memcpy(&header, contents, sizeof(header));
+  if (header.magic != RECORDING_MAGIC || header.version != RECORDING_VERSION ||
+      header.frames == 0) {
+    Die("%s is not a finished recording\n", state.recorder.input_file);
+  }
+  state.recorder.event_count = (size - sizeof(header)) / sizeof(RecordedEvent);
+  state.recorder.events = (RecordedEvent *)
+    GameAllocateMemory(&state.platform_memory,
+                       state.recorder.event_count * sizeof(RecordedEvent),
+                       MEMORY_TAG_STATE);
+  memcpy(state.recorder.events, contents + sizeof(header),
+         state.recorder.event_count * sizeof(RecordedEvent));
+  free(contents);
+
+  state.recorder.seed = header.seed;
+  state.recorder.frames = header.frames;
+  state.recorder.frame_times = (double *)
+    GameAllocateMemory(&state.platform_memory, header.frames * sizeof(double),
+                       MEMORY_TAG_STATE);
+  state.recorder.loop = 0;
+  state.recorder.loops = loops;
+  state.recorder.mode = RECORDER_PLAYING;
+  printf("playing %u frames, %u events from %s\n", header.frames,
+         state.recorder.event_count, state.recorder.input_file);
+  RestartPlayback();
+}
+
+// Dispatch the recorded events that belong to the current frame
+void PlaybackEvents()
+{
+  Recorder *recorder = &state.recorder;
+  while (recorder->next_event < recorder->event_count &&
+         recorder->events[recorder->next_event].frame == recorder->frame) {
+    DispatchEvent(&recorder->events[recorder->next_event].event);
+    recorder->next_event++;
+  }
+}
+
+int CompareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Print frame time statistics for one pass over the recording
+void ReportPlaybackLoop()
+{
+  Recorder *recorder = &state.recorder;
+  double total = 0;
+  for (uint32_t f = 0; f < recorder->frames; f++) {
+    total += recorder->frame_times[f];
+  }
+  qsort(recorder->frame_times, recorder->frames, sizeof(double), CompareDoubles);
+  printf("playback loop %u: %u frames, mean %.3f ms, p50 %.3f ms, "
+         "p99 %.3f ms, max %.3f ms\n",
+         recorder->loop, recorder->frames, total / recorder->frames,
+         recorder->frame_times[recorder->frames / 2],
+         recorder->frame_times[(recorder->frames * 99) / 100],
+         recorder->frame_times[recorder->frames - 1]);
+}
+
+void NoteFileChange(FileChange *change)
+{
+  uint64_t now = GetNanoseconds();
+  uint64_t none = 0;
+  __atomic_compare_exchange_n(&change->first_changed_ns, &none, now, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&change->changed_ns, now, __ATOMIC_RELEASE);
+}
+
+// True once a change has stayed untouched for the debounce interval, with
+// first_ns set to when the first change being picked up happened. This is
+// a single atomic load while nothing happens.
+bool TakeFileChange(FileChange *change, uint64_t *first_ns)
+{
+  uint64_t changed_ns = __atomic_load_n(&change->changed_ns, __ATOMIC_ACQUIRE);
+  if (!changed_ns || GetNanoseconds() - changed_ns < state.config.reload_debounce_ns) {
+    return false;
+  }
+  // Another write landing in between restarts the debounce
+  if (!__atomic_compare_exchange_n(&change->changed_ns, &changed_ns, 0, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  *first_ns = __atomic_exchange_n(&change->first_changed_ns, 0, __ATOMIC_ACQ_REL);
+  if (!*first_ns) {
+    *first_ns = changed_ns;
+  }
+  return true;
+}
+
+bool IsSourceFile(const char *name)
+{
+  size_t length = strlen(name);
+  return name[0] != '.' && length > 2 && name[length - 2] == '.' &&
+         (name[length - 1] == 'c' || name[length - 1] == 'h');
+}
+
+// A second write to the same file before the frame loop takes it only
+// pushes its debounce back
+void NoteAssetChange(LibraryWatch *watch, uint8_t kind, const char *name)
+{
+  uint64_t now = GetNanoseconds();
+  SDL_LockMutex(watch->asset_lock);
+  uint32_t c = 0;
+  while (c < watch->asset_change_count &&
+         (watch->asset_changes[c].kind != kind || strcmp(watch->asset_changes[c].name, name))) {
+    c++;
+  }
+  if (c < MAX_ASSET_CHANGES) {
+    AssetChange *change = &watch->asset_changes[c];
+    change->kind = kind;
+    snprintf(change->name, sizeof(change->name), "%s", name);
+    change->changed_ns = now;
+    watch->asset_change_count = MAX(watch->asset_change_count, c + 1);
+  }
+  SDL_UnlockMutex(watch->asset_lock);
+}
+
+int WatchGameLibrary(void *data)
+{
+  LibraryWatch *watch = data;
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+    if (length <= 0) {
+      break;
+    }
+    const struct inotify_event *event;
+    for (char *cursor = buffer; cursor < buffer + length;
+         cursor += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)cursor;
+      if (!event->len) {
+        continue;
+      }
+      int kind = 0;
+      while (kind < ASSET_KIND_COUNT && event->wd != watch->asset_wd[kind]) {
+        kind++;
+      }
+      if (kind < ASSET_KIND_COUNT) {
+        // Skips editors' hidden temporaries, and names too long to have
+        // been loaded
+        if (event->name[0] != '.' && strlen(event->name) < ASSET_NAME_SIZE) {
+          NoteAssetChange(watch, kind, event->name);
+        }
+      } else if (event->wd == watch->source_wd) {
+        // Editors save through all kinds of temporary files
+        if (IsSourceFile(event->name)) {
+          NoteFileChange(&watch->source);
+        }
+      } else if (!strcmp(event->name, GAME_LIB_NAME)) {
+        // The linker either writes the library in place or renames it over
+        // the old one, anything else in BUILD_DIR is not ours
+        NoteFileChange(&watch->library);
       }
     }
+  }
+  return 0;
+}
+
+void StartLibraryWatch()
+{
+  static const char *asset_dirs[ASSET_KIND_COUNT] = {IMAGES_DIR, AUDIO_DIR, MUSIC_DIR};
+  LibraryWatch *watch = &state.library_watch;
+  watch->source_wd = -1;
+  for (int kind = 0; kind < ASSET_KIND_COUNT; kind++) {
+    watch->asset_wd[kind] = -1;
+  }
+  watch->fd = inotify_init1(IN_CLOEXEC);
+  if (watch->fd >= 0 &&
+      inotify_add_watch(watch->fd, BUILD_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(watch->fd);
+    watch->fd = -1;
+  }
+  if (watch->fd >= 0 && state.config.rebuild_command) {
+    watch->source_wd = inotify_add_watch(watch->fd, SOURCE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch->source_wd < 0) {
+      printf("unable to watch %s (%s), rebuild by hand\n", SOURCE_DIR, strerror(errno));
+    }
+  }
+  if (watch->fd >= 0 && (watch->asset_lock = SDL_CreateMutex())) {
+    for (int kind = 0; kind < ASSET_KIND_COUNT; kind++) {
+      watch->asset_wd[kind] = inotify_add_watch(watch->fd, asset_dirs[kind],
+                                                IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+  }
+  if (watch->fd >= 0) {
+    watch->thread = SDL_CreateThread(WatchGameLibrary, "library watch", watch);
+  }
+  if (watch->fd >= 0 && !watch->thread) {
+    close(watch->fd);
+    watch->fd = -1;
+  }
+  if (watch->fd < 0) {
+    printf("inotify unavailable (%s), polling %s instead and not reloading assets\n",
+           strerror(errno), GAME_LIB);
+    if (state.config.rebuild_command) {
+      printf("not watching %s, rebuild by hand\n", SOURCE_DIR);
+    }
+  }
+}
+
+// True once the library has changed and stayed untouched for the debounce
+// interval, change_ns gets the time of the first change being picked up
+bool GameLibraryChanged(uint64_t *change_ns)
+{
+  LibraryWatch *watch = &state.library_watch;
+  if (watch->fd < 0) {
+    uint64_t write_ns = GetFileWriteTime(GAME_LIB);
+    if (write_ns != state.game_code.last_write_ns && write_ns != watch->seen_write_ns) {
+      watch->seen_write_ns = write_ns;
+      NoteFileChange(&watch->library);
+    }
+  }
+  return TakeFileChange(&watch->library, change_ns);
+}
+
+// Loads asset files that changed and have been quiet for the debounce
+// interval again, into every texture, channel and track that was loaded
+// from them. Images swap in when uploaded, audio and music at the end of a
+// later frame; the game keeps using the old ones until then.
+void ReloadAssets()
+{
+  SwapReloadedSounds();
+  LibraryWatch *watch = &state.library_watch;
+  if (!__atomic_load_n(&watch->asset_change_count, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  AssetChange changes[MAX_ASSET_CHANGES];
+  uint32_t count = 0;
+  uint64_t now = GetNanoseconds();
+  SDL_LockMutex(watch->asset_lock);
+  for (uint32_t c = 0; c < watch->asset_change_count;) {
+    if (now - watch->asset_changes[c].changed_ns < state.config.reload_debounce_ns) {
+      c++;
+      continue;
+    }
+    changes[count++] = watch->asset_changes[c];
+    watch->asset_changes[c] = watch->asset_changes[--watch->asset_change_count];
+  }
+  SDL_UnlockMutex(watch->asset_lock);
+
+  for (uint32_t c = 0; c < count; c++) {
+    AssetChange *change = &changes[c];
+    if (change->kind == ASSET_IMAGE) {
+      for (uint32_t id = 0; id < MAX_SURFACES; id++) {
+        if (!strcmp(state.assets.slots[id].filename, change->name)) {
+          printf("reloading %s/%s into texture %u\n", IMAGES_DIR, change->name, id);
+          LoadImage(change->name, id, false);
+        }
+      }
+    } else if (change->kind == ASSET_AUDIO) {
+      for (uint32_t a = 0; a < MAX_AUDIOS; a++) {
+        if (state.audio[a].chunk && !strcmp(state.audio[a].filename, change->name)) {
+          QueueSoundReload(ASSET_AUDIO, a, change->name);
+        }
+      }
+    } else {
+      for (uint32_t m = 0; m < MAX_MUSIC; m++) {
+        if (state.music[m].music && !strcmp(state.music[m].filename, change->name)) {
+          QueueSoundReload(ASSET_MUSIC, m, change->name);
+        }
+      }
+    }
+  }
+}
+
+// Shows what the compiler had to say about a failed build
+void PrintRebuildLog()
+{
+  char line[1024];
+  FILE *log = fopen(REBUILD_LOG, "r");
+  if (!log) {
+    return;
+  }
+  while (fgets(line, sizeof(line), log)) {
+    fputs(line, stderr);
+  }
+  fclose(log);
+}
+
+// Polls a running build and starts a new one once the source has settled.
+// The compiler runs in a child process, the frame loop only ever checks on
+// it with a non-blocking waitpid.
+void UpdateRebuild()
+{
+  extern char **environ;
+  Rebuilder *rebuilder = &state.rebuilder;
+  LibraryWatch *watch = &state.library_watch;
+  if (rebuilder->pid) {
+    int status;
+    pid_t done = waitpid(rebuilder->pid, &status, WNOHANG);
+    if (done == 0) {
+      return;
+    }
+    rebuilder->pid = 0;
+    double build_ms = (GetNanoseconds() - rebuilder->start_ns) / 1e6;
+    if (done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      rebuilder->built_edit_ns = rebuilder->edit_ns;
+      rebuilder->built_ns = GetNanoseconds();
+      printf("rebuilt the game in %.1f ms\n", build_ms);
+    } else {
+      fprintf(stderr, "rebuild failed after %.1f ms, still running the last good build:\n",
+              build_ms);
+      PrintRebuildLog();
+    }
+  }
+  uint64_t edit_ns;
+  if (watch->source_wd < 0 || !TakeFileChange(&watch->source, &edit_ns)) {
+    return;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, REBUILD_LOG,
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  char *argv[] = { "/bin/sh", "-c", (char *)state.config.rebuild_command, NULL };
+  pid_t pid;
+  int error = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error) {
+    fprintf(stderr, "failed to start %s: %s\n", state.config.rebuild_command, strerror(error));
+    return;
+  }
+  rebuilder->pid = pid;
+  rebuilder->edit_ns = edit_ns;
+  rebuilder->start_ns = GetNanoseconds();
+}
+
+void PrintBenchSeries(const char *name, double *values, uint32_t count, bool last)
+{
+  double total = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    total += values[i];
+  }
+  qsort(values, count, sizeof(double), CompareDoubles);
+  if (count) {
+    printf("\"%s\":{\"count\":%u,\"min\":%.4f,\"mean\":%.4f,\"p50\":%.4f,"
+           "\"p99\":%.4f,\"max\":%.4f}%s", name, count, values[0], total / count,
+           values[count / 2], values[(count * 99) / 100], values[count - 1],
+           last ? "" : ",");
+  } else {
+    printf("\"%s\":{\"count\":0}%s", name, last ? "" : ",");
+  }
+}
+
+// One JSON line, so runs can be compared by a script
+void ReportReloadBench()
+{
+  ReloadBench *bench = &state.reload_bench;
+  printf("{\"reload_bench\":{\"reloads\":%u,\"failed\":%u,\"mode\":\"%s\","
+         "\"debounce_ms\":%.3f,", bench->measured, bench->failed,
+         state.config.reload_bench_command ? "command" : "touch",
+         state.config.reload_debounce_ns / 1e6);
+  PrintBenchSeries("latency_ms", bench->latency, bench->measured, false);
+  PrintBenchSeries("load_ms", bench->load, bench->measured, false);
+  PrintBenchSeries("swap_ms", bench->swap, bench->measured, false);
+  PrintBenchSeries("worst_frame_ms", bench->worst_frame, bench->measured, false);
+  PrintBenchSeries("frame_ms", bench->frames, bench->frame_count, true);
+  printf("}}\n");
+  fflush(stdout);
+}
+
+void FinishBenchReload(bool failed)
+{
+  ReloadBench *bench = &state.reload_bench;
+  bench->in_reload = false;
+  if (failed) {
+    bench->failed++;
+  }
+  if (__atomic_add_fetch(&bench->completed, 1, __ATOMIC_ACQ_REL) >= state.config.reload_bench) {
+    ReportReloadBench();
+    QuitGame();
+  }
+}
+
+// Called once per frame with the length of the previous one
+void BenchFrame(double frame_ms)
+{
+  ReloadBench *bench = &state.reload_bench;
+  if (!bench->in_reload) {
+    if (bench->frame_count < BENCH_MAX_FRAMES) {
+      bench->frames[bench->frame_count++] = frame_ms;
+    }
+    return;
+  }
+  bench->worst = MAX(bench->worst, frame_ms);
+  if (bench->frames_after && --bench->frames_after == 0) {
+    bench->worst_frame[bench->measured++] = bench->worst;
+    FinishBenchReload(false);
+  }
+}
+
+// Keeps changing the library, waiting for each reload to be measured
+int RunReloadBench(void *data)
+{
+  ReloadBench *bench = data;
+  for (uint32_t i = 0; i < state.config.reload_bench; i++) {
+    SDL_Delay(BENCH_RELOAD_INTERVAL_MS);
+    if (state.config.reload_bench_command) {
+      if (system(state.config.reload_bench_command) != 0) {
+        fprintf(stderr, "reload bench: %s failed\n", state.config.reload_bench_command);
+      }
+    } else {
+      // Closing a descriptor opened for writing is what a linker does last,
+      // and bumping the mtime covers the stat() fallback
+      int fd = open(GAME_LIB, O_WRONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        futimens(fd, NULL);
+        close(fd);
+      }
+    }
+    while (__atomic_load_n(&bench->completed, __ATOMIC_ACQUIRE) <= i) {
+      SDL_Delay(1);
+    }
+  }
+  return 0;
+}
+
+void StartReloadBench()
+{
+  ReloadBench *bench = &state.reload_bench;
+  uint32_t reloads = state.config.reload_bench;
+  bench->latency = GameAllocateMemory(&state.platform_memory, reloads * sizeof(double), MEMORY_TAG_UNTAGGED);
+  bench->load = GameAllocateMemory(&state.platform_memory, reloads * sizeof(double), MEMORY_TAG_UNTAGGED);
+  bench->swap = GameAllocateMemory(&state.platform_memory, reloads * sizeof(double), MEMORY_TAG_UNTAGGED);
+  bench->worst_frame = GameAllocateMemory(&state.platform_memory, reloads * sizeof(double), MEMORY_TAG_UNTAGGED);
+  bench->frames = GameAllocateMemory(&state.platform_memory, BENCH_MAX_FRAMES * sizeof(double), MEMORY_TAG_UNTAGGED);
+  bench->thread = SDL_CreateThread(RunReloadBench, "reload bench", bench);
+  if (!bench->thread) {
+    Die("failed to start the reload bench: %s\n", SDL_GetError());
+  }
+}
+
+static const char *const latency_stages[LATENCY_STAGE_COUNT] = {
+  "queue", "update", "render", "present", "total"
+};
+
+// Counts per log2 bucket: under LATENCY_BUCKET_MS, under twice that and so
+// on, the last holding everything above
+void LatencyHistogram(const double *values, uint32_t count, uint32_t *buckets)
+{
+  memset(buckets, 0, LATENCY_BUCKETS * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++) {
+    int bucket = 0;
+    for (double bound = LATENCY_BUCKET_MS; bucket < LATENCY_BUCKETS - 1 && values[i] >= bound;
+         bound *= 2) {
+      bucket++;
+    }
+    buckets[bucket]++;
+  }
+}
+
+void ReportInputLatency()
+{
+  InputLatency *latency = &state.latency;
+  uint32_t count = latency->sample_count;
+  char title[64];
+  snprintf(title, sizeof(title), "input latency, %u events (ms)", count);
+  printf("%-32s %8s %8s %8s   ", title, "p50", "p99", "max");
+  for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+    printf(" <%-5g", LATENCY_BUCKET_MS * (1 << b));
+  }
+  printf(" more\n");
+  for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+    double *values = latency->samples[stage];
+    uint32_t buckets[LATENCY_BUCKETS];
+    LatencyHistogram(values, count, buckets);
+    qsort(values, count, sizeof(double), CompareDoubles);
+    printf("  %-30s %8.3f %8.3f %8.3f   ", latency_stages[stage], values[count / 2],
+           values[(count * 99) / 100], values[count - 1]);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      printf(" %-6u", buckets[b]);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+  latency->sample_count = 0;
+}
+
+// One JSON line for --input-latency-test, like the reload bench
+void ReportInputLatencyTest()
+{
+  InputLatency *latency = &state.latency;
+  printf("{\"input_latency\":{\"events\":%u,\"probes\":%u,\"probes_lost\":%u,"
+         "\"frame_pacing\":%u,\"histogram_ms\":[", latency->sample_count,
+         latency->probes_seen, __atomic_load_n(&latency->probes_lost, __ATOMIC_ACQUIRE),
+         state.config.frame_pacing);
+  for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+    printf("%s%g", b ? "," : "", LATENCY_BUCKET_MS * (1 << b));
+  }
+  printf("],");
+  for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+    uint32_t buckets[LATENCY_BUCKETS];
+    LatencyHistogram(latency->samples[stage], latency->sample_count, buckets);
+    printf("\"%s_histogram\":[", latency_stages[stage]);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      printf("%s%u", b ? "," : "", buckets[b]);
+    }
+    printf("],");
+    char name[32];
+    snprintf(name, sizeof(name), "%s_ms", latency_stages[stage]);
+    PrintBenchSeries(name, latency->samples[stage], latency->sample_count,
+                     stage == LATENCY_STAGE_COUNT - 1);
+  }
+  printf("}}\n");
+  fflush(stdout);
+}
+
+// Called at the end of every frame. The events the last GameUpdate got are
+// measured if the frame was presented and dropped if it was not, as a
+// hidden window shows nothing.
+void EndInputLatency(bool presented)
+{
+  InputLatency *latency = &state.latency;
+  if (!latency->updated) {
+    return;
+  }
+  if (presented) {
+    uint64_t now = GetNanoseconds();
+    for (uint32_t i = 0; i < latency->updated && latency->sample_count < latency->sample_capacity; i++) {
+      uint32_t n = latency->sample_count++;
+      latency->samples[LATENCY_QUEUE][n] = (latency->dispatched_ns[i] - latency->delivered_ns[i]) / 1e6;
+      latency->samples[LATENCY_UPDATE][n] = (latency->update_ns - latency->dispatched_ns[i]) / 1e6;
+      latency->samples[LATENCY_RENDER][n] = (latency->render_ns - latency->update_ns) / 1e6;
+      latency->samples[LATENCY_PRESENT][n] = (now - latency->render_ns) / 1e6;
+      latency->samples[LATENCY_TOTAL][n] = (now - latency->delivered_ns[i]) / 1e6;
+    }
+  }
+  latency->pending -= latency->updated;
+  memmove(latency->delivered_ns, latency->delivered_ns + latency->updated,
+          latency->pending * sizeof(uint64_t));
+  memmove(latency->dispatched_ns, latency->dispatched_ns + latency->updated,
+          latency->pending * sizeof(uint64_t));
+  latency->updated = 0;
+
+  if (!state.config.input_latency_test) {
+    if (latency->sample_count >= LATENCY_REPORT_SAMPLES) {
+      ReportInputLatency();
+    }
+  } else if (latency->probes_seen + __atomic_load_n(&latency->probes_lost, __ATOMIC_ACQUIRE) ==
+             state.config.input_latency_test && !latency->pending) {
+    ReportInputLatencyTest();
+    QuitGame();
+  }
+}
+
+// Pushes the probes from their own thread, as SDL_PushEvent is thread safe
+// and input from a device does not wait for the frame loop either
+int RunLatencyProbes(void *data)
+{
+  InputLatency *latency = data;
+  unsigned int seed = 37;
+  for (uint32_t i = 0; i < state.config.input_latency_test; i++) {
+    SDL_Delay(LATENCY_PROBE_MIN_MS + rand_r(&seed) % (LATENCY_PROBE_MAX_MS - LATENCY_PROBE_MIN_MS + 1));
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = i % 2 ? SDL_KEYUP : SDL_KEYDOWN;
+    event.key.state = i % 2 ? SDL_RELEASED : SDL_PRESSED;
+    event.key.windowID = LATENCY_PROBE_WINDOW | i;
+    event.key.keysym.scancode = LATENCY_PROBE_SCANCODE;
+    latency->probe_ns[i] = GetNanoseconds();
+    if (SDL_PushEvent(&event) < 0) {
+      fprintf(stderr, "input latency: failed to push probe %u: %s\n", i, SDL_GetError());
+      __atomic_fetch_add(&latency->probes_lost, 1, __ATOMIC_RELEASE);
+    }
+  }
+  return 0;
+}
+
+void StartInputLatency()
+{
+  InputLatency *latency = &state.latency;
+  uint32_t probes = state.config.input_latency_test;
+  latency->sample_capacity = MAX(LATENCY_REPORT_SAMPLES, probes);
+  for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+    latency->samples[stage] = GameAllocateMemory(&state.platform_memory,
+                                                 latency->sample_capacity * sizeof(double),
+                                                 MEMORY_TAG_UNTAGGED);
+  }
+  if (!probes) {
+    return;
+  }
+  if (!(state.game_code.api.input_mask & INPUT_MASK(INPUT_KEY))) {
+    Die("--input-latency-test needs a game that buffers INPUT_KEY events\n");
+  }
+  latency->probe_ns = GameAllocateMemory(&state.platform_memory, probes * sizeof(uint64_t),
+                                         MEMORY_TAG_UNTAGGED);
+  latency->thread = SDL_CreateThread(RunLatencyProbes, "latency probes", latency);
+  if (!latency->thread) {
+    Die("failed to start the latency probes: %s\n", SDL_GetError());
+  }
+}
+
+// Start loading a changed library, or swap in one that finished loading.
+// The old code keeps running until the new one has taken over.
+void UpdateGameCode()
+{
+  LibraryLoader *loader = &state.library_loader;
+  ReloadBench *bench = &state.reload_bench;
+  int library_status = __atomic_load_n(&loader->status, __ATOMIC_ACQUIRE);
+  if (library_status == LIBRARY_IDLE && GameLibraryChanged(&loader->change_ns)) {
+    loader->generation++;
+    loader->start_ns = GetNanoseconds();
+    loader->status = LIBRARY_LOADING;
+    loader->thread = SDL_CreateThread(LoadGameCodeAsync, "library loader", loader);
+    if (!loader->thread) {
+      fprintf(stderr, "failed to start library loader: %s\n", SDL_GetError());
+      loader->status = LIBRARY_IDLE;
+    } else if (state.config.reload_bench) {
+      bench->in_reload = true;
+      bench->worst = 0;
+    }
+  } else if (library_status == LIBRARY_READY || library_status == LIBRARY_FAILED) {
+    SDL_WaitThread(loader->thread, NULL);
+    loader->thread = NULL;
+    bool swapped = false;
+    loader->swap_start_ns = GetNanoseconds();
+    if (library_status == LIBRARY_READY) {
+      GameCode old_code = state.game_code;
+      if (old_code.api.state_hash == loader->code.api.state_hash ||
+          MigrateGameState(&state.game_memory, &old_code.api, &loader->code.api)) {
+        state.game_code = loader->code;
+        GameForgetMemorySites(&state.game_memory.stats);
+        UpdateEventState();
+        state.game_code.api.game_init(&state.game_memory, GetPlatformAPI(), 800, 600);
+        UnloadGameCode(&old_code);
+        loader->swap_ns = GetNanoseconds();
+        loader->first_frame = true;
+        swapped = true;
+        printf("reloaded %s: detected in %.3f ms, loaded in %.3f ms, swapped in %.3f ms\n",
+               GAME_LIB, (loader->start_ns - loader->change_ns) / 1e6,
+               (loader->ready_ns - loader->start_ns) / 1e6,
+               (loader->swap_ns - loader->swap_start_ns) / 1e6);
+        if (!state.config.reload_bench) {
+          GameMemoryReport(&state.game_memory, stdout);
+        }
+      } else {
+        UnloadGameCode(&loader->code);
+        fprintf(stderr, "keeping the running game, its state cannot be migrated\n");
+      }
+    } else {
+      fprintf(stderr, "keeping the running game, %s failed to load\n", GAME_LIB);
+    }
+    if (state.config.reload_bench && !swapped) {
+      FinishBenchReload(true);
+    }
+    loader->code = (GameCode){};
+    __atomic_store_n(&loader->status, LIBRARY_IDLE, __ATOMIC_RELEASE);
+  }
+}
+
+void WriteJsonString(FILE *out, const char *text)
+{
+  fputc('"', out);
+  for (const char *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+// Trace Event Format, open it in ui.perfetto.dev or chrome://tracing. Each
+// thread's ring holds its newest PROFILE_RING_SIZE blocks.
+void WriteProfile()
+{
+  Profiler *profiler = state.profiler;
+  if (!profiler || !state.config.profile_file) {
+    return;
+  }
+  FILE *out = fopen(state.config.profile_file, "w");
+  if (!out) {
+    fprintf(stderr, "failed to write %s: %s\n", state.config.profile_file, strerror(errno));
+    return;
+  }
+  double ns_per_tick = (double)(GetNanoseconds() - profiler->start_ns) /
+                       (ProfileTicks() - profiler->start_ticks);
+  uint32_t ring_count = MIN(__atomic_load_n(&profiler->ring_count, __ATOMIC_ACQUIRE),
+                            PROFILE_MAX_THREADS);
+  uint32_t site_count = MIN(profiler->site_count, PROFILE_MAX_SITES);
+  uint64_t event_count = 0;
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (uint32_t r = 0; r < ring_count; r++) {
+    ProfileRing *ring = &profiler->rings[r];
+    uint64_t end = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > PROFILE_RING_SIZE ? end - PROFILE_RING_SIZE : 0;
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":\"%s\"}}", r ? ",\n" : "", ring->tid,
+            ring->tid == (uint32_t)getpid() ? "main" : "worker");
+    for (uint64_t i = begin; i < end; i++) {
+      ProfileEvent *event = &ring->events[i & (PROFILE_RING_SIZE - 1)];
+      fprintf(out, ",\n{\"name\":");
+      WriteJsonString(out, profiler->sites[event->site < site_count ? event->site : 0]);
+      fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+              ring->tid, (event->start - profiler->start_ticks) * ns_per_tick / 1000.0,
+              (event->end - event->start) * ns_per_tick / 1000.0);
+    }
+    event_count += end - begin;
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+  printf("wrote %" PRIu64 " profile events from %u threads to %s\n",
+         event_count, ring_count, state.config.profile_file);
+}
+
+void StartProfiler()
+{
+#ifdef PROFILE
+  Profiler *profiler = GameAllocateStruct(&state.platform_memory, Profiler, MEMORY_TAG_UNTAGGED);
+  profiler->start_ticks = ProfileTicks();
+  profiler->start_ns = GetNanoseconds();
+  profiler->site_count = 1;
+  strcpy(profiler->sites[0], "(out of profile sites)");
+  state.profiler = profiler;
+  PROFILER_ATTACH(profiler);
+
+  // What an empty block costs, its events are dropped again
+  uint64_t start = GetNanoseconds();
+  for (uint32_t i = 0; i < PROFILE_RING_SIZE; i++) {
+    TIMED_BLOCK("profiler overhead");
+  }
+  double block_ns = (double)(GetNanoseconds() - start) / PROFILE_RING_SIZE;
+  ProfileRing *ring = ProfilerThreadRing(profiler);
+  if (ring) {
+    ring->written = 0;
+  }
+  printf("profiler: %.1f ns per block, %zu KiB of rings\n", block_ns, sizeof(Profiler) / 1024);
+#else
+  if (state.config.profile_file) {
+    printf("built without -DPROFILE, %s will not be written\n", state.config.profile_file);
+  }
+#endif
+}
+
+void StartFramePacer()
+{
+  FramePacer *pacer = &state.pacer;
+  pacer->mode = state.config.frame_pacing;
+  pacer->period_ns = 1000000000ULL / state.config.target_fps;
+  if (pacer->mode == PACING_VSYNC) {
+    SDL_RendererInfo info;
+    SDL_DisplayMode display;
+    if (SDL_GetRendererInfo(state.renderer, &info) == 0 &&
+        (info.flags & SDL_RENDERER_PRESENTVSYNC)) {
+      // Present blocks, the period is only used to measure jitter against
+      if (SDL_GetCurrentDisplayMode(0, &display) == 0 && display.refresh_rate > 0) {
+        pacer->period_ns = 1000000000ULL / display.refresh_rate;
+      }
+    } else {
+      printf("vsync unavailable, pacing to %u fps instead\n", state.config.target_fps);
+      pacer->mode = PACING_TARGET;
+    }
+  }
+  if (pacer->mode == PACING_UNLIMITED) {
+    pacer->period_ns = 0;
+  }
+  pacer->frame_ns = GetNanoseconds();
+  pacer->deadline_ns = pacer->frame_ns + pacer->period_ns;
+}
+
+void ReportFramePacer()
+{
+  FramePacer *pacer = &state.pacer;
+  static const char *const modes[] = { "target", "vsync", "unlimited" };
+  double elapsed = 0;
+  for (uint32_t i = 0; i < pacer->count; i++) {
+    elapsed += pacer->times[i];
+  }
+  qsort(pacer->times, pacer->count, sizeof(double), CompareDoubles);
+  qsort(pacer->jitter, pacer->count, sizeof(double), CompareDoubles);
+  printf("frames (%s): p50 %.3f ms, p99 %.3f ms, max %.3f ms; "
+         "jitter p50 %.3f ms, p99 %.3f ms; busy %.0f%%\n", modes[pacer->mode],
+         pacer->times[pacer->count / 2], pacer->times[(pacer->count * 99) / 100],
+         pacer->times[pacer->count - 1], pacer->jitter[pacer->count / 2],
+         pacer->jitter[(pacer->count * 99) / 100],
+         100.0 * pacer->busy_ns / 1e6 / elapsed);
+  pacer->count = 0;
+  pacer->busy_ns = 0;
+}
+
+// Wait for the end of the frame. Sleeping is done against an absolute
+// deadline on the monotonic clock so oversleeping one frame is made up in
+// the next instead of drifting.
+void EndFrame()
+{
+  TIMED_FUNCTION();
+  FramePacer *pacer = &state.pacer;
+  uint64_t now = GetNanoseconds();
+  uint64_t slept_ns = 0;
+  if (pacer->mode == PACING_TARGET) {
+    if (now + PACER_SPIN_NS < pacer->deadline_ns) {
+      uint64_t wake_ns = pacer->deadline_ns - PACER_SPIN_NS;
+      struct timespec wake = { wake_ns / 1000000000ULL, wake_ns % 1000000000ULL };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+      }
+      slept_ns = GetNanoseconds() - now;
+    }
+    while ((now = GetNanoseconds()) < pacer->deadline_ns) {
+    }
+    pacer->deadline_ns += pacer->period_ns;
+    if (pacer->deadline_ns < now) {
+      // Ran over by more than a frame, start a new schedule from here
+      pacer->deadline_ns = now + pacer->period_ns;
+    }
+  }
+  double frame_ms = (now - pacer->frame_ns) / 1e6;
+  double target_ms = pacer->period_ns ? pacer->period_ns / 1e6 :
+                     pacer->count ? pacer->times[pacer->count - 1] : frame_ms;
+  pacer->busy_ns += (now - pacer->frame_ns) - slept_ns;
+  pacer->frame_ns = now;
+  if (state.config.frame_stats) {
+    pacer->times[pacer->count] = frame_ms;
+    pacer->jitter[pacer->count] = fabs(frame_ms - target_ms);
+    if (++pacer->count == PACER_REPORT_FRAMES) {
+      ReportFramePacer();
+    }
+  }
+}
+
+void HandleEvent(SDL_Event *event)
+{
+  if (state.recorder.mode == RECORDER_PLAYING) {
+    // Live input is ignored during playback, except for quitting
+    if (!IsRecordableEvent(event)) {
+      DispatchEvent(event);
+    }
+    return;
+  }
+  if (state.recorder.mode == RECORDER_RECORDING && IsRecordableEvent(event)) {
+    RecordEvent(event);
+  }
+  DispatchEvent(event);
+}
+
+// Called once the frame's events are in. Returns whether this is a
+// background frame. Recordings need an update every frame, so they keep
+// running in the foreground.
+bool UpdateBackground()
+{
+  Background *background = &state.background;
+  bool active = (background->hidden || background->minimized) &&
+                state.config.background != BACKGROUND_RUN &&
+                state.recorder.mode == RECORDER_OFF;
+  if (active && !background->active) {
+    if (state.config.background == BACKGROUND_PAUSE) {
+      printf("window hidden, pausing\n");
+    } else {
+      printf("window hidden, updating at %u fps\n", state.config.background_fps);
+    }
+    background->next_update_ns = GetNanoseconds();
+  } else if (!active && background->active) {
+    printf("window shown, resuming\n");
+    // Pace from here rather than count the time away as one long frame
+    state.pacer.frame_ns = GetNanoseconds();
+    state.pacer.deadline_ns = state.pacer.frame_ns + state.pacer.period_ns;
+  }
+  background->active = active;
+  return active;
+}
+
+bool BackgroundUpdateDue()
+{
+  Background *background = &state.background;
+  if (state.config.background != BACKGROUND_THROTTLE) {
+    return false;
+  }
+  uint64_t now = GetNanoseconds();
+  if (now < background->next_update_ns) {
+    return false;
+  }
+  uint64_t period_ns = 1000000000ULL / state.config.background_fps;
+  background->next_update_ns += period_ns;
+  if (background->next_update_ns < now) {
+    background->next_update_ns = now + period_ns;
+  }
+  return true;
+}
+
+// Stands in for the frame pacer in the background: sleeps until an event
+// arrives or the next update is due
+void WaitInBackground()
+{
+  TIMED_FUNCTION();
+  Background *background = &state.background;
+  int timeout_ms = BACKGROUND_PAUSED_WAIT_MS;
+  if (state.config.background == BACKGROUND_THROTTLE) {
+    uint64_t now = GetNanoseconds();
+    timeout_ms = now < background->next_update_ns ?
+      (background->next_update_ns - now + 999999) / 1000000 : 0;
+  }
+  SDL_Event event;
+  if (timeout_ms > 0 && SDL_WaitEventTimeout(&event, timeout_ms)) {
+    HandleEvent(&event);
+  }
+}
+
+void GameLoop()
+{
+#ifdef DEBUG
+  uint64_t mallocs_at_frame = malloc_count;
+  uint64_t most_mallocs = 0;
+  uint64_t report_mallocs = malloc_count;
+  uint32_t report_frame = 0;
+#endif
+  uint64_t frame_begin = 0;
+  for(;;) {
+    if (state.config.reload_bench) {
+      uint64_t now = GetNanoseconds();
+      if (frame_begin) {
+        BenchFrame((now - frame_begin) / 1e6);
+      }
+      frame_begin = now;
+    }
+    TIMED_BLOCK("frame");
+    if (state.background.active) {
+      WaitInBackground();
+    }
+    SDL_Event event;
+    while(SDL_PollEvent(&event)) {
+      TIMED_BLOCK("event");
+      HandleEvent(&event);
+    }
+    if (state.recorder.mode == RECORDER_PLAYING) {
+      PlaybackEvents();
+    }
+    double frame_start = GetSeconds();
+    bool background = UpdateBackground();
 
     // If there are servers, 
     
-    state.game_code.game_update(1.0f/60.0f);
-
-    /*
-    glClear(GL_COLOR_BUFFER_BIT);
-    glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
-    */
-    state.game_code.game_render();
-    /*
-    for (int w = 0; w < state.window_count; w++) {
-      SDL_GL_SwapWindow(state.windows[w]);
-    }
-    */
-    SDL_SetRenderDrawColor(state.renderer, floor(255*0.3), floor(255*0.3), floor(255*0.3), 1);
-    SDL_SetRenderDrawBlendMode(state.renderer, SDL_BLENDMODE_BLEND);
-    SDL_RenderPresent(state.renderer);
+    if (!background || BackgroundUpdateDue()) {
+      TIMED_BLOCK("update");
+      UpdateGame(1.0f/60.0f);
+    }
+
+    // Nothing is drawn while hidden
+    if (!background) {
+      /*
+      glClear(GL_COLOR_BUFFER_BIT);
+      glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+      */
+      UploadTextures();
+      {
+        TIMED_BLOCK("render");
+        state.game_code.api.game_render();
+      }
+      state.latency.render_ns = GetNanoseconds();
+      /*
+      for (int w = 0; w < state.window_count; w++) {
+        SDL_GL_SwapWindow(state.windows[w]);
+      }
+      */
+      SDL_SetRenderDrawColor(state.renderer, floor(255*0.3), floor(255*0.3), floor(255*0.3), 1);
+      SDL_SetRenderDrawBlendMode(state.renderer, SDL_BLENDMODE_BLEND);
+      TIMED_BLOCK("present");
+      SDL_RenderPresent(state.renderer);
+    }
+    if (state.config.input_latency) {
+      EndInputLatency(!background);
+    }
+    if (state.library_loader.first_frame) {
+      // Latency of a reload runs until the new code's first frame is out
+      LibraryLoader *loader = &state.library_loader;
+      Rebuilder *rebuilder = &state.rebuilder;
+      loader->first_frame = false;
+      if (rebuilder->built_edit_ns) {
+        uint64_t now = GetNanoseconds();
+        printf("edit to running in %.1f ms: build %.1f ms, reload %.1f ms\n",
+               (now - rebuilder->built_edit_ns) / 1e6,
+               (rebuilder->built_ns - rebuilder->start_ns) / 1e6,
+               (now - rebuilder->built_ns) / 1e6);
+        rebuilder->built_edit_ns = 0;
+      }
+      if (state.config.reload_bench) {
+        ReloadBench *bench = &state.reload_bench;
+        bench->load[bench->measured] = (loader->ready_ns - loader->start_ns) / 1e6;
+        bench->swap[bench->measured] = (loader->swap_ns - loader->swap_start_ns) / 1e6;
+        bench->latency[bench->measured] = (GetNanoseconds() - loader->change_ns) / 1e6;
+        bench->frames_after = BENCH_HITCH_FRAMES;
+      }
+    }
+
+    // RECORDING
+    if (state.recorder.mode == RECORDER_PLAYING) {
+      Recorder *recorder = &state.recorder;
+      recorder->frame_times[recorder->frame] = (GetSeconds() - frame_start) * 1000.0;
+      if (++recorder->frame == recorder->frames) {
+        ReportPlaybackLoop();
+        if (recorder->loops && ++recorder->loop == recorder->loops) {
+          QuitGame();
+        }
+        RestartPlayback();
+      }
+    } else if (state.recorder.mode == RECORDER_RECORDING) {
+      state.recorder.frame++;
+    }
     
+    // SNAPSHOTS
+    if (state.save_state_file[0]) {
+      mkdir(SNAPSHOTS_DIR, 0755);
+      SaveGameMemory(&state.game_memory, state.save_state_file);
+      state.save_state_file[0] = 0;
+    }
+    if (state.load_state_file[0]) {
+      if (LoadGameMemory(&state.game_memory, state.load_state_file)) {
+        state.game_code.api.game_init(&state.game_memory, GetPlatformAPI(),
+                                  state.screen.w, state.screen.h);
+      }
+      state.load_state_file[0] = 0;
+    }
+
     // RELOAD
-    time_t new_dll_file_time = GetFileWriteTime(GAME_LIB);
-    if(new_dll_file_time > state.game_code.last_file_time) {
-      UnloadGameCode(&state.game_code);
-      SDL_Delay(200);
-      state.game_code = LoadGameCode(GAME_LIB);
-      state.game_code.game_init(state.game_memory, GetPlatformAPI(), 800, 600);
+    {
+      TIMED_BLOCK("reload");
+      if (state.config.rebuild_command) {
+        UpdateRebuild();
+      }
+      UpdateGameCode();
+      ReloadAssets();
     }
     
-    SDL_Delay(1);
+#ifdef DEBUG
+    // Steady state frames should not touch the heap at all
+    uint64_t mallocs = malloc_count - mallocs_at_frame;
+    mallocs_at_frame = malloc_count;
+    most_mallocs = MAX(most_mallocs, mallocs);
+    if (++report_frame == MALLOC_REPORT_FRAMES) {
+      printf("mallocs: %.2f per frame, %" PRIu64 " at most over the last %d frames\n",
+             (double)(malloc_count - report_mallocs) / MALLOC_REPORT_FRAMES,
+             most_mallocs, MALLOC_REPORT_FRAMES);
+      report_mallocs = malloc_count;
+      most_mallocs = 0;
+      report_frame = 0;
+    }
+#endif
+
+    if (!background) {
+      EndFrame();
+    }
   }
 }
 
@@ -1301,8 +4302,15 @@ void GameLoop()
 int main(int argc, char *argv[])
 {
   memset(&state, 0, sizeof(state));
-  for (int c = 0; c < argc; c++) {
-    printf("%c\n", *argv[c]);
+  ParseArgs(&state.config, argc, argv);
+  state.platform_memory = ReserveMemory(PLATFORM_MEMORY_SIZE);
+  state.scratch = ReserveMemory(SCRATCH_MEMORY_SIZE);
+  GamePoolInitStruct(&state.sockets, &state.platform_memory, Connection, MAX_SOCKETS,
+                     MEMORY_TAG_NET);
+  StartProfiler();
+  if (state.config.headless) {
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    setenv("SDL_AUDIODRIVER", "dummy", 1);
   }
   if(SDL_Init(SDL_INIT_EVERYTHING) < 0) {
     Die("failed to initialize SDL2: %s\n", SDL_GetError());
@@ -1331,7 +4339,7 @@ int main(int argc, char *argv[])
 	 link_version->patch);
   // open 44.1KHz, signed 16bit, system byte order,
   //      stereo audio, using 1024 byte chunks
-  if(Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024)==-1) {
+  if(Mix_OpenAudio(AUDIO_FREQUENCY, AUDIO_FORMAT, AUDIO_CHANNELS, 1024)==-1) {
     Die("Mix_OpenAudio: %s\n", Mix_GetError());
   }
   if(0 > Mix_AllocateChannels(200)){
@@ -1341,6 +4349,9 @@ int main(int argc, char *argv[])
   Mix_HookMusicFinished(musicDone);
   // print the number of music decoders available
   printf("There are %d music deocoders available\n", Mix_GetNumMusicDecoders());
+  if (state.config.pack_file) {
+    OpenPack(state.config.pack_file);
+  }
   state.window_count = 0;
   state.screen.w = 800;
   state.screen.h = 600;
@@ -1348,9 +4359,44 @@ int main(int argc, char *argv[])
   
   // get version info
   // game state init
-  state.game_memory = AllocateGameMemory();
-  state.game_code = LoadGameCode(GAME_LIB);
-  state.game_code.game_init(state.game_memory, GetPlatformAPI(), state.screen.w, state.screen.h);
+  size_t rss_before = GetResidentMemory();
+  double start = GetSeconds();
+  state.game_memory = AllocateGameMemory(&state.config);
+  if (state.config.restore_file &&
+      !LoadGameMemory(&state.game_memory, state.config.restore_file)) {
+    Die("failed to restore %s\n", state.config.restore_file);
+  }
+  state.game_code = LoadGameCodeCopy(GAME_LIB, 0);
+  if (!state.game_code.handle) {
+    Die("failed to load %s\n", GAME_LIB);
+  }
+  // Recordings hold SDL events, so they take sticks and sensors from SDL
+  if (state.config.input_rate && !state.config.record_name && !state.config.playback_name) {
+    StartInputSampler();
+  }
+  UpdateEventState();
+  StartInputBuffer();
+  StartAssetLoader();
+  StartLibraryWatch();
+  state.game_code.api.game_init(&state.game_memory, GetPlatformAPI(), state.screen.w, state.screen.h);
+  printf("game memory: %zu bytes reserved, %zu committed, huge pages %d; "
+         "init took %.3f ms, rss %zu -> %zu KiB\n",
+         state.game_memory.size,
+         (size_t)(state.game_memory.committed - state.game_memory.ptr),
+         state.config.huge_pages, (GetSeconds() - start) * 1000.0,
+         rss_before / 1024, GetResidentMemory() / 1024);
+  StartFramePacer();
+  if (state.config.reload_bench) {
+    StartReloadBench();
+  }
+  if (state.config.input_latency) {
+    StartInputLatency();
+  }
+  if (state.config.record_name) {
+    StartRecording(state.config.record_name);
+  } else if (state.config.playback_name) {
+    StartPlayback(state.config.playback_name, state.config.playback_loops);
+  }
   GameLoop();
   return 0;
 }
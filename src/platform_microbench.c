@@ -0,0 +1,99 @@
+// Microbenchmarks for the platform's per-event work. platform.c is
+// compiled into this file with its main renamed, and the game behind it
+// is a table of counters, so only the platform's side is timed. Built
+// and run by scripts/build_microbench.sh.
+
+#define main PlatformMain
+#include "platform.c"
+#undef main
+
+#include "microbench.h"
+
+#define EVENT_COUNT 1024
+#define EVENT_MASK (EVENT_COUNT - 1)
+
+static struct
+{
+  SDL_Event events[EVENT_COUNT];
+  uint64_t calls;
+} dispatch;
+
+GAME_KEYBOARD_INPUT(CountKeyboardInput) { dispatch.calls += symbol; }
+GAME_MOUSE_MOTION(CountMouseMotion) { dispatch.calls += x; }
+GAME_MOUSE_BUTTON(CountMouseButton) { dispatch.calls += button; }
+GAME_WINDOW_MOVED(CountWindowMoved) { dispatch.calls += x; }
+GAME_WINDOW_FOCUSED(CountWindowFocused) { dispatch.calls += gained; }
+
+// What a frame of play sends: mostly mouse motion and keys, now and then
+// something from the window
+void SetupEvents()
+{
+  srand(37);
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    SDL_Event *event = &dispatch.events[i];
+    memset(event, 0, sizeof(*event));
+    int kind = rand() % 10;
+    if (kind < 4) {
+      event->type = SDL_MOUSEMOTION;
+      event->motion.x = rand() % 800;
+      event->motion.y = rand() % 600;
+    } else if (kind < 8) {
+      event->type = rand() % 2 ? SDL_KEYDOWN : SDL_KEYUP;
+      event->key.keysym.scancode = SCANCODE_A + rand() % 26;
+    } else if (kind < 9) {
+      event->type = rand() % 2 ? SDL_MOUSEBUTTONDOWN : SDL_MOUSEBUTTONUP;
+      event->button.button = 1 + rand() % 3;
+    } else {
+      event->type = SDL_WINDOWEVENT;
+      event->window.event = rand() % 2 ? SDL_WINDOWEVENT_MOVED : SDL_WINDOWEVENT_FOCUS_GAINED;
+      event->window.data1 = rand() % 800;
+    }
+  }
+
+  GameAPI api = {};
+  api.game_keyboard_input = CountKeyboardInput;
+  api.game_mouse_motion = CountMouseMotion;
+  api.game_mouse_button = CountMouseButton;
+  api.game_window_moved = CountWindowMoved;
+  api.game_window_focused = CountWindowFocused;
+  state.game_code.api = api;
+}
+
+uint64_t BenchDispatchEvent(void *data, uint64_t iterations)
+{
+  for (uint64_t i = 0; i < iterations; i++) {
+    DispatchEvent(&dispatch.events[i & EVENT_MASK]);
+  }
+  return dispatch.calls;
+}
+
+// The same events queued for GameUpdate instead of called back, with the
+// buffer emptied as an update would
+uint64_t BenchBufferEvent(void *data, uint64_t iterations)
+{
+  GameAPI api = state.game_code.api;
+  state.game_code.api = (GameAPI){};
+  state.game_code.api.input_mask = INPUT_MASK(INPUT_KEY) | INPUT_MASK(INPUT_MOUSE_MOTION) |
+                                   INPUT_MASK(INPUT_MOUSE_BUTTON);
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    DispatchEvent(&dispatch.events[i & EVENT_MASK]);
+    if (state.input.count == MAX_INPUT_EVENTS) {
+      total += state.input.events[0].code;
+      state.input.count = 0;
+    }
+  }
+  state.input.count = 0;
+  state.game_code.api = api;
+  return total;
+}
+
+int main(int argc, char *argv[])
+{
+  MicroBenchSuite suite;
+  MicroBenchInit(&suite, argc, argv);
+  SetupEvents();
+  MicroBenchRun(&suite, "platform/DispatchEvent", BenchDispatchEvent, NULL);
+  MicroBenchRun(&suite, "platform/BufferInputEvent", BenchBufferEvent, NULL);
+  return MicroBenchFinish(&suite);
+}
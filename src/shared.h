@@ -1,7 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
 
 enum {
   SCANCODE_UNKNOWN = 0,
@@ -519,27 +526,376 @@ enum {
 };
 
 
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Every allocation from GameMemory is tagged with the subsystem that
+// made it, so the platform and the game can see where the memory goes.
+enum {
+  MEMORY_TAG_UNTAGGED = 0,
+  MEMORY_TAG_STATE,
+  MEMORY_TAG_ENTITIES,
+  MEMORY_TAG_POOL,
+  MEMORY_TAG_ASSETS,
+  MEMORY_TAG_AUDIO,
+  MEMORY_TAG_NET,
+  MEMORY_TAG_SCRATCH,
+  MEMORY_TAG_COUNT
+};
+
+static const char *const MEMORY_TAG_NAMES[MEMORY_TAG_COUNT] = {
+  "untagged",
+  "state",
+  "entities",
+  "pool",
+  "assets",
+  "audio",
+  "net",
+  "scratch",
+};
+
+#define MAX_MEMORY_SITES 64
+#define MEMORY_SITE_FILE_LENGTH 24
+#define MEMORY_SITE_BUCKETS 128 // a power of two
+
+// Bytes allocated from one line of code. The file name is copied so
+// that it outlives the library that made the allocation.
+typedef struct
+{
+  char file[MEMORY_SITE_FILE_LENGTH];
+  uint32_t line;
+  uint32_t count;
+  uint8_t tag;
+  size_t bytes;
+  const char *file_pointer; // the __FILE__ last matched to this site
+} GameMemorySite;
+
+typedef struct
+{
+  size_t live[MEMORY_TAG_COUNT];  // bytes currently allocated
+  size_t peak[MEMORY_TAG_COUNT];  // highest live bytes seen
+  uint32_t count[MEMORY_TAG_COUNT];
+  size_t peak_used;               // high-water mark of the cursor
+  GameMemorySite sites[MAX_MEMORY_SITES];
+  uint32_t site_count;
+  // Site index + 1 by __FILE__ pointer and line, 0 when empty. Pointers
+  // into an unloaded library can be reused by the next one, so the
+  // platform clears this with GameForgetMemorySites on every reload.
+  uint8_t site_buckets[MEMORY_SITE_BUCKETS];
+} GameMemoryStats;
+
 // All game memory is encapsuled in this struct. It uses the basic
 // technique of stack allocation.
+//
+// The platform reserves the whole block up front but only commits
+// (makes readable/writable) the part below `committed`. Allocations
+// that step past it commit more in GAME_MEMORY_COMMIT_SIZE steps. A
+// block with committed == NULL is treated as fully committed.
 typedef struct GameMemory
 {
     uint8_t *ptr;
     uint8_t *cursor;
+    uint8_t *committed;
     size_t size;
+    GameMemoryStats stats;
 } GameMemory;
 
-// Allocate a block of memory
-void *GameAllocateMemory(GameMemory *memory, size_t size)
+#define GAME_MEMORY_COMMIT_SIZE (16 * 1024 * 1024)
+
+// Commit enough of the reservation to cover everything up to the cursor.
+// Returns false when the cursor is past the reservation or the pages
+// could not be committed.
+bool GameCommitMemory(GameMemory *memory)
+{
+  size_t used = memory->cursor - memory->ptr;
+  size_t commit = (used + GAME_MEMORY_COMMIT_SIZE - 1) &
+    ~((size_t)GAME_MEMORY_COMMIT_SIZE - 1);
+  if (used > memory->size) {
+    fprintf(stderr, "game memory exhausted, %zu of %zu bytes asked for\n",
+            used, memory->size);
+    return false;
+  }
+  if (commit > memory->size) {
+    commit = memory->size;
+  }
+  if (memory->ptr + commit <= memory->committed) {
+    return true;
+  }
+  if (mprotect(memory->committed, memory->ptr + commit - memory->committed,
+               PROT_READ | PROT_WRITE) != 0) {
+    perror("failed to commit game memory");
+    return false;
+  }
+  memory->committed = memory->ptr + commit;
+  return true;
+}
+
+void GameForgetMemorySites(GameMemoryStats *stats)
 {
-  void *result = memory->cursor;
+  memset(stats->site_buckets, 0, sizeof(stats->site_buckets));
+}
+
+// Finds the site by comparing pointers, the file names are only compared
+// the first time a call site is seen or when two share a bucket
+void GameTrackMemory(GameMemoryStats *stats, size_t size, uint8_t tag,
+                     const char *file, uint32_t line)
+{
+  if (tag >= MEMORY_TAG_COUNT) {
+    tag = MEMORY_TAG_UNTAGGED;
+  }
+  stats->live[tag] += size;
+  stats->count[tag]++;
+  if (stats->live[tag] > stats->peak[tag]) {
+    stats->peak[tag] = stats->live[tag];
+  }
+
+  uint32_t bucket = (((uintptr_t)file >> 3) ^ (line * 2654435761u) ^ tag) &
+                    (MEMORY_SITE_BUCKETS - 1);
+  GameMemorySite *site = NULL;
+  if (stats->site_buckets[bucket]) {
+    site = &stats->sites[stats->site_buckets[bucket] - 1];
+    if (site->file_pointer != file || site->line != line || site->tag != tag) {
+      site = NULL;
+    }
+  }
+  if (!site) {
+    const char *name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+    for (uint32_t s = 0; s < stats->site_count && !site; s++) {
+      if (stats->sites[s].line == line && stats->sites[s].tag == tag &&
+          !strncmp(stats->sites[s].file, name, MEMORY_SITE_FILE_LENGTH - 1)) {
+        site = &stats->sites[s];
+      }
+    }
+    if (!site && stats->site_count < MAX_MEMORY_SITES) {
+      site = &stats->sites[stats->site_count++];
+      snprintf(site->file, sizeof(site->file), "%s", name);
+      site->line = line;
+      site->tag = tag;
+    }
+    if (site) {
+      site->file_pointer = file;
+      stats->site_buckets[bucket] = site - stats->sites + 1;
+    }
+  }
+  if (site) {
+    site->bytes += size;
+    site->count++;
+  }
+}
+
+// Allocate a block of memory. Use GameAllocateMemory, which fills in
+// the call site. Returns NULL, with the cursor left where it was, when
+// the memory behind the block cannot be committed.
+void *GameAllocateMemoryAt(GameMemory *memory, size_t size, uint8_t tag,
+                           const char *file, uint32_t line)
+{
+  uint8_t *result = memory->cursor;
   memory->cursor += size;
+  if (memory->committed && memory->cursor > memory->committed &&
+      !GameCommitMemory(memory)) {
+    memory->cursor = result;
+    return NULL;
+  }
+  GameTrackMemory(&memory->stats, size, tag, file, line);
+  if ((size_t)(memory->cursor - memory->ptr) > memory->stats.peak_used) {
+    memory->stats.peak_used = memory->cursor - memory->ptr;
+  }
   return result;
 }
 
+#define GameAllocateMemory(memory, size, tag)                                  \
+  GameAllocateMemoryAt(memory, size, tag, __FILE__, __LINE__)
+
 // Simple helper macro to make allocation of structs easier, you
 // could also use a template for this
-#define GameAllocateStruct(memory, type)                                       \
-  (type *)GameAllocateMemory(memory, sizeof(type))
+#define GameAllocateStruct(memory, type, tag)                                  \
+  (type *)GameAllocateMemory(memory, sizeof(type), tag)
+
+// Temporary memory hands everything allocated after Begin back on End,
+// which makes a GameMemory usable as a scratch stack
+typedef struct
+{
+  GameMemory *memory;
+  uint8_t *cursor;
+  size_t live[MEMORY_TAG_COUNT];
+} GameTemporaryMemory;
+
+GameTemporaryMemory GameBeginTemporaryMemory(GameMemory *memory)
+{
+  GameTemporaryMemory temp;
+  temp.memory = memory;
+  temp.cursor = memory->cursor;
+  memcpy(temp.live, memory->stats.live, sizeof(temp.live));
+  return temp;
+}
+
+void GameEndTemporaryMemory(GameTemporaryMemory temp)
+{
+  temp.memory->cursor = temp.cursor;
+  memcpy(temp.memory->stats.live, temp.live, sizeof(temp.live));
+}
+
+// Print live and peak bytes per tag plus the largest call sites
+void GameMemoryReport(GameMemory *memory, FILE *out)
+{
+  GameMemoryStats *stats = &memory->stats;
+  size_t used = memory->cursor - memory->ptr;
+  size_t committed = memory->committed ?
+    (size_t)(memory->committed - memory->ptr) : memory->size;
+  fprintf(out, "game memory: %zu used (%.2f%%), %zu peak, %zu committed, "
+          "%zu reserved\n", used, 100.0 * used / memory->size,
+          stats->peak_used, committed, memory->size);
+  for (int t = 0; t < MEMORY_TAG_COUNT; t++) {
+    if (stats->count[t]) {
+      fprintf(out, "  %-10s %12zu live %12zu peak %8u allocations\n",
+              MEMORY_TAG_NAMES[t], stats->live[t], stats->peak[t],
+              stats->count[t]);
+    }
+  }
+  for (uint32_t s = 0; s < stats->site_count; s++) {
+    GameMemorySite *site = &stats->sites[s];
+    fprintf(out, "    %s:%u %s %zu bytes in %u allocations\n",
+            site->file, site->line, MEMORY_TAG_NAMES[site->tag],
+            site->bytes, site->count);
+  }
+}
+
+#define CACHE_LINE_SIZE 64
+
+// Allocate a block of memory starting at a multiple of alignment,
+// which must be a power of two
+void *GameAllocateAlignedAt(GameMemory *memory, size_t size, size_t alignment,
+                            uint8_t tag, const char *file, uint32_t line)
+{
+  uintptr_t cursor = (uintptr_t)memory->cursor;
+  size_t padding = ((cursor + alignment - 1) & ~(alignment - 1)) - cursor;
+  uint8_t *result = (uint8_t *)GameAllocateMemoryAt(memory, padding + size, tag,
+                                                    file, line);
+  return result ? result + padding : NULL;
+}
+
+#define GameAllocateAligned(memory, size, alignment, tag)                      \
+  GameAllocateAlignedAt(memory, size, alignment, tag, __FILE__, __LINE__)
+
+// Fixed size pool for objects that come and go (connections, voices,
+// projectiles, ...). The blocks are carved out of GameMemory once and
+// recycled through an intrusive free list, so alloc and free are O(1)
+// and pointers into the pool stay valid across reloads and snapshots.
+//
+// Building with -DDEBUG poisons freed blocks, checks the poison when
+// they are handed out again and rejects double frees and frees of
+// foreign pointers.
+typedef struct GamePoolBlock
+{
+  struct GamePoolBlock *next;
+} GamePoolBlock;
+
+typedef struct
+{
+  uint8_t *blocks;
+  GamePoolBlock *free_list;
+  size_t block_size;     // item size rounded up to a cache line
+  uint32_t capacity;
+  uint32_t used;         // blocks ever handed out, the rest are untouched
+  uint32_t count;        // blocks currently allocated
+} GamePool;
+
+#define GAME_POOL_FREED_BYTE 0xdd
+#define GAME_POOL_ALLOCATED_BYTE 0xcd
+
+void GamePoolInitAt(GamePool *pool, GameMemory *memory, size_t item_size,
+                    uint32_t capacity, uint8_t tag, const char *file,
+                    uint32_t line)
+{
+  if (item_size < sizeof(GamePoolBlock)) {
+    item_size = sizeof(GamePoolBlock);
+  }
+  pool->block_size = (item_size + CACHE_LINE_SIZE - 1) &
+    ~((size_t)CACHE_LINE_SIZE - 1);
+  pool->blocks = (uint8_t *)GameAllocateAlignedAt(memory,
+                                                  pool->block_size * capacity,
+                                                  CACHE_LINE_SIZE, tag,
+                                                  file, line);
+  pool->free_list = NULL;
+  pool->capacity = pool->blocks ? capacity : 0;
+  pool->used = 0;
+  pool->count = 0;
+}
+
+#ifdef DEBUG
+// Whether everything past the free list link still holds the poison
+bool GamePoolIsPoisoned(GamePool *pool, uint8_t *block)
+{
+  for (size_t b = sizeof(GamePoolBlock); b < pool->block_size; b++) {
+    if (block[b] != GAME_POOL_FREED_BYTE) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+// Returns NULL when every block is in use
+void *GamePoolAlloc(GamePool *pool)
+{
+  uint8_t *block;
+  if (pool->free_list) {
+    block = (uint8_t *)pool->free_list;
+    pool->free_list = pool->free_list->next;
+#ifdef DEBUG
+    if (!GamePoolIsPoisoned(pool, block)) {
+      fprintf(stderr, "pool block %p was written to after being freed\n",
+              (void *)block);
+      abort();
+    }
+#endif
+  } else if (pool->used < pool->capacity) {
+    // Untouched blocks are handed out in order so that creating a pool
+    // does not have to touch (and commit) all of its memory
+    block = pool->blocks + pool->block_size * pool->used++;
+  } else {
+    return NULL;
+  }
+#ifdef DEBUG
+  memset(block, GAME_POOL_ALLOCATED_BYTE, pool->block_size);
+#endif
+  pool->count++;
+  return block;
+}
+
+void GamePoolFree(GamePool *pool, void *item)
+{
+  GamePoolBlock *block = (GamePoolBlock *)item;
+  if (!item) {
+    return;
+  }
+#ifdef DEBUG
+  size_t offset = (uint8_t *)item - pool->blocks;
+  if ((uint8_t *)item < pool->blocks ||
+      offset >= pool->block_size * pool->used ||
+      offset % pool->block_size != 0) {
+    fprintf(stderr, "pointer %p was not allocated from this pool\n", item);
+    abort();
+  }
+  // A live block that happens to hold nothing but the poison is reported
+  // too, which is rare enough for a debug build
+  if (GamePoolIsPoisoned(pool, (uint8_t *)item)) {
+    fprintf(stderr, "pool block %p was freed twice\n", item);
+    abort();
+  }
+  memset(item, GAME_POOL_FREED_BYTE, pool->block_size);
+#endif
+  block->next = pool->free_list;
+  pool->free_list = block;
+  pool->count--;
+}
+
+#define GamePoolInit(pool, memory, item_size, capacity, tag)                   \
+  GamePoolInitAt(pool, memory, item_size, capacity, tag, __FILE__, __LINE__)
+#define GamePoolInitStruct(pool, memory, type, capacity, tag)                  \
+  GamePoolInit(pool, memory, sizeof(type), capacity, tag)
+#define GamePoolAllocStruct(pool, type) (type *)GamePoolAlloc(pool)
 
 typedef struct {
   uint32_t texture_id;
@@ -571,13 +927,191 @@ typedef PLATFORM_DRAW_BOX(PlatformDrawBoxFn);
   void n(Rect *rects, unsigned int count, float r, float g, float b, float a, bool fill)
 typedef PLATFORM_DRAW_BOXES(PlatformDrawBoxesFn);
 
+// Profiling
+//
+// TIMED_BLOCK("name") times the rest of the enclosing scope. Events go to
+// a lock-free ring buffer per thread inside a Profiler the platform owns
+// and hands to the game through PlatformAPI, so the platform, the game and
+// every reload of it all end up in one trace. Names are copied into the
+// Profiler for the same reason. Without -DPROFILE the macros compile to
+// nothing.
+#define PROFILE_MAX_THREADS 16
+#define PROFILE_RING_SIZE 16384 // events per thread, a power of two
+#define PROFILE_MAX_SITES 256
+#define PROFILE_NAME_SIZE 48
+
+typedef struct
+{
+  uint64_t start;       // ProfileTicks()
+  uint64_t end;
+  uint32_t site;
+} ProfileEvent;
+
+// Written by its thread only, read by whoever exports the trace
+typedef struct
+{
+  uint32_t tid;         // 0 while unclaimed
+  uint64_t written;     // events ever written, the ring keeps the newest
+  ProfileEvent events[PROFILE_RING_SIZE];
+} ProfileRing;
+
+typedef struct Profiler
+{
+  uint64_t start_ticks; // to turn ticks into time when exporting
+  uint64_t start_ns;
+  uint32_t site_count;  // site 0 is for blocks that did not fit
+  char sites[PROFILE_MAX_SITES][PROFILE_NAME_SIZE];
+  uint32_t ring_count;
+  ProfileRing rings[PROFILE_MAX_THREADS];
+} Profiler;
+
+typedef struct
+{
+  ProfileRing *ring;
+  uint64_t start;
+  uint32_t site;
+} ProfileBlock;
+
+uint64_t ProfileTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// The thread's ring, claimed on its first event. Rings are looked up by
+// thread id so a reloaded library keeps writing to the same ones.
+ProfileRing *ProfilerThreadRing(Profiler *profiler)
+{
+  uint32_t tid = (uint32_t)syscall(SYS_gettid);
+  uint32_t count = __atomic_load_n(&profiler->ring_count, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < count && i < PROFILE_MAX_THREADS; i++) {
+    if (__atomic_load_n(&profiler->rings[i].tid, __ATOMIC_ACQUIRE) == tid) {
+      return &profiler->rings[i];
+    }
+  }
+  uint32_t index = __atomic_fetch_add(&profiler->ring_count, 1, __ATOMIC_ACQ_REL);
+  if (index >= PROFILE_MAX_THREADS) {
+    return NULL;
+  }
+  __atomic_store_n(&profiler->rings[index].tid, tid, __ATOMIC_RELEASE);
+  return &profiler->rings[index];
+}
+
+// Sites are interned by name, so they survive the library that named them
+uint32_t ProfilerSite(Profiler *profiler, const char *name)
+{
+  uint32_t count = __atomic_load_n(&profiler->site_count, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 1; i < count && i < PROFILE_MAX_SITES; i++) {
+    if (!strncmp(profiler->sites[i], name, PROFILE_NAME_SIZE - 1)) {
+      return i;
+    }
+  }
+  uint32_t index = __atomic_fetch_add(&profiler->site_count, 1, __ATOMIC_ACQ_REL);
+  if (index >= PROFILE_MAX_SITES) {
+    return 0;
+  }
+  strncpy(profiler->sites[index], name, PROFILE_NAME_SIZE - 1);
+  return index;
+}
+
+#ifdef PROFILE
+// Each module (the platform, each load of the game) has its own copy
+static Profiler *global_profiler;
+static __thread ProfileRing *profile_ring;
+static __thread Profiler *profile_ring_owner;
+
+ProfileBlock ProfileBegin(uint32_t *site, const char *name)
+{
+  ProfileBlock block = {};
+  if (!global_profiler) {
+    return block;
+  }
+  if (profile_ring_owner != global_profiler) {
+    profile_ring = ProfilerThreadRing(global_profiler);
+    profile_ring_owner = global_profiler;
+  }
+  if (!*site) {
+    *site = ProfilerSite(global_profiler, name);
+  }
+  block.ring = profile_ring;
+  block.site = *site;
+  block.start = ProfileTicks();
+  return block;
+}
+
+void ProfileEnd(ProfileBlock *block)
+{
+  uint64_t end = ProfileTicks();
+  ProfileRing *ring = block->ring;
+  if (!ring) {
+    return;
+  }
+  uint64_t index = ring->written;
+  ProfileEvent *event = &ring->events[index & (PROFILE_RING_SIZE - 1)];
+  event->start = block->start;
+  event->end = end;
+  event->site = block->site;
+  __atomic_store_n(&ring->written, index + 1, __ATOMIC_RELEASE);
+}
+
+#define PROFILE_JOIN_(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN_(a, b)
+#define TIMED_BLOCK(name)                                                      \
+  static uint32_t PROFILE_JOIN(profile_site_, __LINE__);                       \
+  ProfileBlock PROFILE_JOIN(profile_block_, __LINE__)                          \
+    __attribute__((cleanup(ProfileEnd))) =                                     \
+      ProfileBegin(&PROFILE_JOIN(profile_site_, __LINE__), name)
+#define TIMED_FUNCTION() TIMED_BLOCK(__func__)
+#define PROFILER_ATTACH(profiler) (global_profiler = (profiler))
+#else
+#define TIMED_BLOCK(name)
+#define TIMED_FUNCTION()
+#define PROFILER_ATTACH(profiler) ((void)(profiler))
+#endif
+
 // Image and Sprite loading
-#define MAX_SURFACES 100
+#define MAX_SURFACES 1024
 #define MAX_FILENAME_LENGTH 31
 
+// Images load in the background: PlatformEnsureImage returns at once and
+// the texture is drawn as a placeholder until it is READY. Ensuring an id
+// again keeps drawing the old texture until the new one is in.
+enum {
+  TEXTURE_EMPTY = 0,
+  TEXTURE_PENDING,
+  TEXTURE_READY,
+  TEXTURE_FAILED
+};
+
 #define PLATFORM_ENSURE_IMAGE(n) void n(const char *filename, unsigned int texture_id)
 typedef PLATFORM_ENSURE_IMAGE(PlatformEnsureImageFn);
 
+#define PLATFORM_GET_TEXTURE_STATE(n) int n(unsigned int texture_id)
+typedef PLATFORM_GET_TEXTURE_STATE(PlatformGetTextureStateFn);
+
+// Small images are packed into shared atlas pages as they load, and
+// PlatformDrawTexture draws sprites from the right part of the page, so
+// sprite rects stay relative to the image. Draws sorted by atlas bind each
+// page once. UVs are normalized to the page, or to the image's own texture
+// when atlas is ATLAS_NONE.
+#define ATLAS_NONE 0xffffffffu
+
+typedef struct
+{
+  unsigned int atlas;
+  float u0, v0, u1, v1;
+  int width, height;
+} TextureRegion;
+
+// False until the texture is READY
+#define PLATFORM_GET_TEXTURE_REGION(n) bool n(unsigned int texture_id, TextureRegion *region)
+typedef PLATFORM_GET_TEXTURE_REGION(PlatformGetTextureRegionFn);
+
 #define PLATFORM_DRAW_TEXTURE(n)                                               \
   void n(unsigned int texture_index, float x, float y, float width,             \
          float height, int sprite_x, int sprite_y, int sprite_w, int sprite_h)
@@ -657,6 +1191,20 @@ typedef PLATFORM_NET_RECV(PlatformNetRecvFn);
 #define PLATFORM_CLOSE_CONNECTION(n) void n(unsigned int socket)
 typedef PLATFORM_CLOSE_CONNECTION(PlatformCloseConnectionFn);
 
+// Snapshots of the whole used game memory. Both are applied at the end
+// of the current frame, the game is re-initialized after a load.
+#define PLATFORM_SAVE_STATE(n) void n(const char *filename)
+typedef PLATFORM_SAVE_STATE(PlatformSaveStateFn);
+
+#define PLATFORM_LOAD_STATE(n) void n(const char *filename)
+typedef PLATFORM_LOAD_STATE(PlatformLoadStateFn);
+
+// Copy of the game memory accounting, for showing it in game
+#define PLATFORM_GET_MEMORY_STATS(n)                                           \
+  void n(GameMemoryStats *stats, size_t *used, size_t *committed,             \
+         size_t *reserved)
+typedef PLATFORM_GET_MEMORY_STATS(PlatformGetMemoryStatsFn);
+
 typedef struct
 {
   // Draw
@@ -664,6 +1212,8 @@ typedef struct
   PlatformDrawBoxFn *PlatformDrawBox;
   PlatformDrawBoxesFn *PlatformDrawBoxes;
   PlatformEnsureImageFn *PlatformEnsureImage;
+  PlatformGetTextureStateFn *PlatformGetTextureState;
+  PlatformGetTextureRegionFn *PlatformGetTextureRegion;
   PlatformDrawTextureFn *PlatformDrawTexture;
   PlatformScreenshotFn *PlatformScreenshot;
   // App
@@ -686,8 +1236,85 @@ typedef struct
   PlatformNetSendFn *PlatformNetSend;
   PlatformNetRecvFn *PlatformNetRecv;
   PlatformCloseConnectionFn *PlatformCloseConnection;
+  // State
+  PlatformSaveStateFn *PlatformSaveState;
+  PlatformLoadStateFn *PlatformLoadState;
+  PlatformGetMemoryStatsFn *PlatformGetMemoryStats;
+  // Debug
+  Profiler *profiler;      // NULL unless the platform was built with -DPROFILE
 } PlatformAPI;
 
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// Layout hashes let the platform refuse a game library that was built
+// against different structs instead of letting it scribble over memory.
+// FNV-1a over a field's name, description, offset and size.
+#define LAYOUT_HASH_SEED 0xcbf29ce484222325ULL
+
+uint64_t GameHashLayout(uint64_t hash, const char *name, size_t offset, size_t size)
+{
+  const uint64_t prime = 0x100000001b3ULL;
+  for (const char *c = name; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * prime;
+  }
+  hash = (hash ^ offset) * prime;
+  hash = (hash ^ size) * prime;
+  return hash;
+}
+
+#define LAYOUT_HASH_FIELD(hash, type, field, description)                      \
+  hash = GameHashLayout(hash, #field " " description, offsetof(type, field),   \
+                        sizeof(((type *)0)->field))
+
+// Reflection of a struct's fields, the tables are generated at build time
+// by scripts/reflect_struct.sh. Structs held by value that are declared in
+// the same file are reflected too, so a change inside one shows up.
+typedef struct GameFieldInfo
+{
+  const char *name;
+  const char *type;      // as declared, array extents included
+  uint32_t offset;
+  uint32_t size;
+  uint32_t element_size; // one element of an array, size otherwise
+  const struct GameFieldInfo *fields; // the struct's own fields, or NULL
+  uint32_t field_count;
+} GameFieldInfo;
+
+#define REFLECT_FIELD(type, field, type_name)                                  \
+  { #field, type_name, offsetof(type, field), sizeof(((type *)0)->field),      \
+    sizeof(((type *)0)->field), NULL, 0 }
+
+#define REFLECT_ARRAY(type, field, type_name)                                  \
+  { #field, type_name, offsetof(type, field), sizeof(((type *)0)->field),      \
+    sizeof(((type *)0)->field[0]), NULL, 0 }
+
+#define REFLECT_STRUCT(type, field, type_name, nested)                         \
+  { #field, type_name, offsetof(type, field), sizeof(((type *)0)->field),      \
+    sizeof(((type *)0)->field), nested, sizeof(nested) / sizeof(nested[0]) }
+
+#define REFLECT_STRUCT_ARRAY(type, field, type_name, nested)                   \
+  { #field, type_name, offsetof(type, field), sizeof(((type *)0)->field),      \
+    sizeof(((type *)0)->field[0]), nested, sizeof(nested) / sizeof(nested[0]) }
+
+uint64_t GameHashFields(const GameFieldInfo *fields, uint32_t count, size_t size)
+{
+  uint64_t hash = GameHashLayout(LAYOUT_HASH_SEED, "", 0, size);
+  for (uint32_t i = 0; i < count; i++) {
+    hash = GameHashLayout(hash, fields[i].name, fields[i].offset, fields[i].size);
+    hash = GameHashLayout(hash, fields[i].type, fields[i].element_size, 0);
+    if (fields[i].fields) {
+      hash = GameHashLayout(hash, "", 0, GameHashFields(fields[i].fields, fields[i].field_count,
+                                                         fields[i].element_size));
+    }
+  }
+  return hash;
+}
+
+// The game state is allocated at this size so fields can be added to it
+// during a session and migrated in place
+#define GAME_STATE_RESERVE (2 * 1024 * 1024)
+
 //
 // These are all the game functions. These macros help maintain the
 // signature across various places easier.
@@ -696,9 +1323,49 @@ typedef struct
 // This is an optional macro for exporting game funcs
 #define func(a,b) extern a(b)
 
-#define GAME_INIT(n) void n(GameMemory memory, PlatformAPI api, int screen_w, int screen_h)
+// Buffered input
+//
+// Input the game asks for in GameAPI.input_mask is collected while the
+// platform polls events and handed to GameUpdate as one batch per frame,
+// oldest first, instead of as a callback per event. Types left out of the
+// mask still go to their callback if the game exports one; types with
+// neither are switched off in SDL.
+enum {
+  INPUT_KEY = 1,          // code scancode, state pressed/released, values[0] 1 on repeat
+  INPUT_MOUSE_MOTION,     // values x, y, xrel, yrel in pixels
+  INPUT_MOUSE_BUTTON,     // code button, state, values x, y, clicks
+  INPUT_MOUSE_WHEEL,      // values x, y scrolled, flipped wheels already undone
+  INPUT_CONTROLLER_BUTTON, // code button, state
+  INPUT_CONTROLLER_AXIS,  // code axis, values[0] from -1 to 1
+  INPUT_TOUCH,            // device finger, state TOUCHPAD_*, values x, y, dx, dy normalized
+  INPUT_SENSOR,           // code SENSOR_*, values[0..2] sensor data
+  INPUT_TYPE_COUNT
+};
+
+#define INPUT_MASK(type) (1u << (type))
+
+typedef struct
+{
+  uint64_t time_ns;   // when it happened, on the clock of GameInput's times
+  uint32_t device;    // mouse, controller, finger or sensor instance
+  uint16_t code;
+  uint8_t type;
+  uint8_t state;
+  float values[4];
+} GameInputEvent;
+
+typedef struct
+{
+  const GameInputEvent *events;
+  uint32_t count;
+  uint32_t dropped;         // lost to a full buffer since the last update
+  uint64_t last_update_ns;  // the events happened after this
+  uint64_t now_ns;          // and before this
+} GameInput;
+
+#define GAME_INIT(n) void n(GameMemory *memory, PlatformAPI api, int screen_w, int screen_h)
 typedef GAME_INIT(GameInitFn);
-#define GAME_UPDATE(n) void n(float dt)
+#define GAME_UPDATE(n) void n(float dt, const GameInput *input)
 typedef GAME_UPDATE(GameUpdateFn);
 
 #define GAME_RENDER(n) void n()
@@ -710,6 +1377,11 @@ typedef GAME_QUIT(GameQuitFn);
 #define GAME_LOW_MEMORY(n) void n()
 typedef GAME_LOW_MEMORY(GameLowMemoryFn);
 
+// Puts the game in a repeatable state for scripts/build_bench.sh: the
+// given number of boxes, laid out from the given seed
+#define GAME_BENCH_SETUP(n) void n(uint32_t box_count, uint32_t seed)
+typedef GAME_BENCH_SETUP(GameBenchSetupFn);
+
 enum { CONNECT = 1, DISCONNECT = 0 };
 
 enum { WINDOW_VISIBLE = 1, WINDOW_INVISIBLE = 0 };
@@ -835,6 +1507,43 @@ enum {
   CONTROLLER_TYPE_PS5
 };
 
+// Same values as SDL_GameControllerButton
+enum {
+  CONTROLLER_BUTTON_A = 0,
+  CONTROLLER_BUTTON_B,
+  CONTROLLER_BUTTON_X,
+  CONTROLLER_BUTTON_Y,
+  CONTROLLER_BUTTON_BACK,
+  CONTROLLER_BUTTON_GUIDE,
+  CONTROLLER_BUTTON_START,
+  CONTROLLER_BUTTON_LEFTSTICK,
+  CONTROLLER_BUTTON_RIGHTSTICK,
+  CONTROLLER_BUTTON_LEFTSHOULDER,
+  CONTROLLER_BUTTON_RIGHTSHOULDER,
+  CONTROLLER_BUTTON_DPAD_UP,
+  CONTROLLER_BUTTON_DPAD_DOWN,
+  CONTROLLER_BUTTON_DPAD_LEFT,
+  CONTROLLER_BUTTON_DPAD_RIGHT,
+  CONTROLLER_BUTTON_MISC1,
+  CONTROLLER_BUTTON_PADDLE1,
+  CONTROLLER_BUTTON_PADDLE2,
+  CONTROLLER_BUTTON_PADDLE3,
+  CONTROLLER_BUTTON_PADDLE4,
+  CONTROLLER_BUTTON_TOUCHPAD,
+  CONTROLLER_BUTTON_COUNT
+};
+
+// Same values as SDL_GameControllerAxis
+enum {
+  CONTROLLER_AXIS_LEFTX = 0,
+  CONTROLLER_AXIS_LEFTY,
+  CONTROLLER_AXIS_RIGHTX,
+  CONTROLLER_AXIS_RIGHTY,
+  CONTROLLER_AXIS_TRIGGERLEFT,
+  CONTROLLER_AXIS_TRIGGERRIGHT,
+  CONTROLLER_AXIS_COUNT
+};
+
 #define GAME_CONTROLLER_BUTTON_EVENT(n)                                        \
   void n(uint32_t id, uint8_t button, uint8_t state)
 typedef GAME_CONTROLLER_BUTTON_EVENT(GameControllerButtonEventFn);
@@ -893,6 +1602,113 @@ typedef GAME_SENSOR_EVENT(GameSensorEventFn);
   void n(uint32_t window, uint32_t type, int32_t code, const void *data, const void *data2)
 typedef GAME_USER_EVENT(GameUserEventFn);
 
+// Everything the game and the platform share: the memory block header and
+// stats, what GameInit and GameUpdate are called with, and every PlatformAPI
+// entry along with its full signature
+uint64_t GamePlatformLayoutHash()
+{
+  uint64_t hash = LAYOUT_HASH_SEED;
+  hash = GameHashLayout(hash, "GameMemory", 0, sizeof(GameMemory));
+  hash = GameHashLayout(hash, "GameMemoryStats", 0, sizeof(GameMemoryStats));
+  hash = GameHashLayout(hash, "GamePool", 0, sizeof(GamePool));
+  hash = GameHashLayout(hash, "PlatformAPI", 0, sizeof(PlatformAPI));
+  hash = GameHashLayout(hash, STRINGIFY(GAME_INIT(n)), 0, 0);
+  hash = GameHashLayout(hash, STRINGIFY(GAME_UPDATE(n)), 0, 0);
+  hash = GameHashLayout(hash, "GameInputEvent", 0, sizeof(GameInputEvent));
+  hash = GameHashLayout(hash, "GameInput", 0, sizeof(GameInput));
+  hash = GameHashLayout(hash, "GAME_STATE_RESERVE", 0, GAME_STATE_RESERVE);
+  hash = GameHashLayout(hash, "GameFieldInfo", 0, sizeof(GameFieldInfo));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformSetProjection, STRINGIFY(PLATFORM_SET_PROJECTION(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformDrawBox, STRINGIFY(PLATFORM_DRAW_BOX(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformDrawBoxes, STRINGIFY(PLATFORM_DRAW_BOXES(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformEnsureImage, STRINGIFY(PLATFORM_ENSURE_IMAGE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformGetTextureState, STRINGIFY(PLATFORM_GET_TEXTURE_STATE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformGetTextureRegion, STRINGIFY(PLATFORM_GET_TEXTURE_REGION(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformDrawTexture, STRINGIFY(PLATFORM_DRAW_TEXTURE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformScreenshot, STRINGIFY(PLATFORM_SCREENSHOT(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformQuit, STRINGIFY(PLATFORM_QUIT(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformCreateWindow, STRINGIFY(PLATFORM_CREATE_WINDOW(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformEnsureAudio, STRINGIFY(PLATFORM_ENSURE_AUDIO(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformPlayAudio, STRINGIFY(PLATFORM_PLAY_AUDIO(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformStopAudio, STRINGIFY(PLATFORM_STOP_AUDIO(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformEnsureMusic, STRINGIFY(PLATFORM_ENSURE_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformPlayMusic, STRINGIFY(PLATFORM_PLAY_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformSetPositionMusic, STRINGIFY(PLATFORM_SET_POSITION_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformRewindMusic, STRINGIFY(PLATFORM_REWIND_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformPauseMusic, STRINGIFY(PLATFORM_PAUSE_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformStopMusic, STRINGIFY(PLATFORM_STOP_MUSIC(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformListenAndServe, STRINGIFY(PLATFORM_LISTEN_AND_SERVE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformConnectToServer, STRINGIFY(PLATFORM_CONNECT_TO_SERVER(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformNetSend, STRINGIFY(PLATFORM_NET_SEND(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformNetRecv, STRINGIFY(PLATFORM_NET_RECV(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformCloseConnection, STRINGIFY(PLATFORM_CLOSE_CONNECTION(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformSaveState, STRINGIFY(PLATFORM_SAVE_STATE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformLoadState, STRINGIFY(PLATFORM_LOAD_STATE(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, PlatformGetMemoryStats, STRINGIFY(PLATFORM_GET_MEMORY_STATS(n)));
+  LAYOUT_HASH_FIELD(hash, PlatformAPI, profiler, "Profiler *");
+  hash = GameHashLayout(hash, "Profiler", 0, sizeof(Profiler));
+  return hash;
+}
+
+// The game library exports a single symbol, GameGetAPI, returning this
+// table. Bump GAME_API_VERSION whenever the table itself changes.
+#define GAME_API_VERSION 4
+
+typedef struct
+{
+  uint32_t version;          // GAME_API_VERSION the library was built with
+  uint32_t size;             // sizeof(GameAPI) in the library
+  uint64_t platform_hash;    // GamePlatformLayoutHash() in the library
+  uint64_t state_hash;       // layout of what the game keeps in GameMemory
+  // GameState as laid out by this library, used to migrate the running
+  // state when it changes
+  const GameFieldInfo *state_fields;
+  uint32_t state_field_count;
+  uint32_t state_size;
+  uint32_t input_mask;       // INPUT_MASK() of each type GameUpdate wants
+
+  GameInitFn *game_init;
+  GameUpdateFn *game_update;
+  GameRenderFn *game_render;
+
+  GameQuitFn *game_quit;
+  GameLowMemoryFn *game_low_memory;
+  GameBenchSetupFn *game_bench_setup;
+
+  GameWindowShownFn *game_window_shown;
+  GameWindowMovedFn *game_window_moved;
+  GameWindowResizedFn *game_window_resized;
+  GameWindowMinMaxedFn *game_window_minmaxed;
+  GameWindowMousedFn *game_window_moused;
+  GameWindowFocusedFn *game_window_focused;
+  GameWindowClosedFn *game_window_closed;
+
+  GameKeyboardInputFn *game_keyboard_input;
+  GameMouseMotionFn *game_mouse_motion;
+  GameMouseButtonFn *game_mouse_button;
+  GameMouseWheelFn *game_mouse_wheel;
+  GameJoyDeviceEventFn *game_joy_device_event;
+  GameJoyButtonEventFn *game_joy_button_event;
+  GameJoyHatEventFn *game_joy_hat_event;
+  GameJoyAxisEventFn *game_joy_axis_event;
+  GameJoyBallEventFn *game_joy_ball_event;
+  GameControllerEventFn *game_controller_device_event;
+  GameControllerButtonEventFn *game_controller_button_event;
+  GameControllerAxisEventFn *game_controller_axis_event;
+  GameControllerSensorEventFn *game_controller_sensor_event;
+  GameControllerTouchpadEventFn *game_controller_touchpad_event;
+  GameAudioDeviceEventFn *game_audio_device_event;
+  GameChannelHaltedFn *game_channel_halted;
+  GameMusicHaltedFn *game_music_halted;
+  GameTouchFingerEventFn *game_touch_finger_event;
+  GameDropEventFn *game_drop_event;
+  GameSensorEventFn *game_sensor_event;
+  GameUserEventFn *game_user_event;
+} GameAPI;
+
+#define GAME_GET_API(n) const GameAPI *n()
+typedef GAME_GET_API(GameGetAPIFn);
+
 // Event map
 enum {
   QUIT = 0x100, 